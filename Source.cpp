@@ -1,5 +1,33 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <vector>           // Scene node and instance batch storage
+#include <algorithm>        // sort
+#include <cstdint>          // uint64_t draw keys
+#include <cstring>          // memcmp
+#include <unordered_map>    // Vertex deduplication, shader variant cache
+#include <unordered_set>    // Mesh simplification border edges
+#include <string>
+#include <deque>
+#include <thread>           // Texture decode workers
+#include <mutex>
+#include <condition_variable>
+#include <fstream>          // Texture cache files, profiler trace
+#include <cstdio>           // snprintf
+#include <chrono>           // Benchmark texture wait
+#include <random>           // Stress scene placement
+#include <cmath>            // powf, sqrtf (vertex cache scores)
+#include <cerrno>           // strtol range errors
+#include <climits>          // INT_MAX
+#include <sys/stat.h>       // Mesh source size and modification time, cache directories
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>        // Mesh cache mapping
+#else
+#include <sys/mman.h>       // Mesh cache mapping
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
@@ -9,6 +37,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>  // Compact vertex encoding
 
 #include <learnOpengl/camera.h> // Camera class
 
@@ -19,6 +48,16 @@ using namespace std; // Standard namespace
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+/*Shader program Macro for shaders that require a GLSL extension (directives cannot appear inside the macro argument)*/
+#ifndef GLSL_EXT
+#define GLSL_EXT(Version, Extension, Source) "#version " #Version " core \n#extension " #Extension " : require \n" #Source
+#endif
+
+/*Shader snippet Macro: part of a shader variant, which gets its version and feature defines when it is assembled*/
+#ifndef GLSL_SNIPPET
+#define GLSL_SNIPPET(Source) #Source
+#endif
+
 // Unnamed namespace
 namespace
 {
@@ -28,19 +67,834 @@ namespace
     const int WINDOW_WIDTH = 1600;
     const int WINDOW_HEIGHT = 900;
 
-    // Stores the GL data relative to a given mesh
+    // Near and far planes of both projections; the draw sort keys and the light clusters cover the same depth range
+    const float NEAR_PLANE = 0.1f;
+    const float FAR_PLANE = 100.0f;
+
+    // Texture streaming: decoded rows go to the GPU through a ring of persistent-mapped PBO slots
+    const int TEXTURE_UPLOAD_SLOTS = 4;
+    const GLsizeiptr TEXTURE_UPLOAD_SLOT_SIZE = 8 * 1024 * 1024;
+    const int TEXTURE_UPLOAD_SLOTS_PER_FRAME = 2; // Caps upload work per frame so streaming never hitches
+
+    // Material textures are packed into texture arrays, so every layer has the same size and a full mip chain
+    const int MATERIAL_TEXTURE_SIZE = 1024;
+    const int MATERIAL_TEXTURE_LEVELS = 11; // log2(MATERIAL_TEXTURE_SIZE) + 1
+
+    // Frame profiler: CPU timers and GPU timestamp query pairs per scope, read back a frame later so they never stall
+    const int PROFILER_MAX_SCOPES = 32;         // Per frame; further scopes are not recorded
+    const int PROFILER_QUERY_FRAMES = 4;        // Ring of query sets; a set stays in flight until its results are available
+    const int PROFILER_HISTORY = 240;           // Resolved frames kept for the min / avg / p99 statistics
+    const double PROFILER_REPORT_INTERVAL = 0.5; // Seconds between overlay text updates
+    const float PROFILER_OVERLAY_BUDGET_MS = 33.3f; // Full width of the overlay bars
+
+    // Headless benchmark (--bench)
+    const int BENCH_DEFAULT_FRAMES = 1000;
+    const int BENCH_WARMUP_FRAMES = 30;         // Rendered before measuring (shader and driver warm-up)
+    const int BENCH_FRAMES_IN_FLIGHT = 2;       // Frames the CPU may run ahead of the GPU
+    const float BENCH_DELTA_TIME = 1.0f / 60.0f; // Fixed step, so every run sees the same frames
+
+    // Stress scenes (--bench --stress): procedural grids of towers and bushes, measured on every render path
+    const int STRESS_DEFAULT_COUNTS[] = { 1000, 10000, 100000, 1000000 };
+    const int STRESS_DEFAULT_FRAMES = 120;      // Per object count and render path, unless --bench gives a count
+    const float STRESS_FOOTPRINT = 60.0f;       // Side of the square the grid is fitted into, whatever the count
+    const float STRESS_CAMERA_RADIUS = 40.0f;   // Camera orbit around the grid
+    const float STRESS_CAMERA_HEIGHT = 20.0f;
+
+    // GPU-driven culling: one compute invocation per node, and a ring of command copies read back for statistics
+    const int GPU_CULL_GROUP_SIZE = 64;         // Must match local_size_x of the culling compute shader
+    const int GPU_CULL_READBACK_FRAMES = 4;     // A copy is only read once its fence passed, so it never stalls
+
+    // Occlusion culling against the previous frame's depth pyramid, skipped for a frame after a camera cut
+    const int HIZ_GROUP_SIZE = 8;               // Must match local_size_x / local_size_y of the reduction shader
+    const float HIZ_CUT_DISTANCE = 5.0f;        // Camera moves longer than this in one frame are cuts
+    const float HIZ_CUT_ANGLE = 30.0f;          // Degrees the view direction may turn in one frame
+
+    // Normal matrices are built from the model axes when those are orthogonal (rotation and per-axis scale)
+    const float NORMAL_MATRIX_SHEAR_TOLERANCE = 1e-4f; // Largest axis dot product, relative to the axis lengths
+
+    // Clustered forward lighting: CLUSTER_X x CLUSTER_Y screen tiles times CLUSTER_Z exponential depth slices
+    const int CLUSTER_X = 16;
+    const int CLUSTER_Y = 9;
+    const int CLUSTER_Z = 24;
+    const int CLUSTER_MAX_LIGHTS = 128;         // Per cluster; further lights reaching it are dropped
+    const int CLUSTER_GROUP_SIZE = 64;          // Work group size of the light assignment shader
+    const float LIGHT_RANGE_SCALE = 2.0f;       // Point light range, relative to the node it is placed at
+    const unsigned int LIGHT_SEED = 1;          // Light placement is random but the same on every run
+
+    // Cooked (block-compressed, mipmapped) textures, named by the hash of their source file
+    const char* const TEXTURE_CACHE_DIR = "../../resources/cache/";
+
+    // DDS container: "DDS " magic, then DDSHeader, then DDSHeaderDX10 when fourCC is "DX10"
+    const uint32_t DDS_MAGIC = 0x20534444;          // "DDS "
+    const uint32_t DDS_FOURCC_DXT1 = 0x31545844;    // "DXT1" (BC1)
+    const uint32_t DDS_FOURCC_DXT5 = 0x35545844;    // "DXT5" (BC3)
+    const uint32_t DDS_FOURCC_DX10 = 0x30315844;    // "DX10"
+    const uint32_t DXGI_FORMAT_BC1_UNORM = 71;
+    const uint32_t DXGI_FORMAT_BC3_UNORM = 77;
+    const uint32_t DXGI_FORMAT_BC7_UNORM = 98;
+
+    struct DDSPixelFormat
+    {
+        uint32_t size;
+        uint32_t flags;
+        uint32_t fourCC;
+        uint32_t rgbBitCount;
+        uint32_t rBitMask;
+        uint32_t gBitMask;
+        uint32_t bBitMask;
+        uint32_t aBitMask;
+    };
+
+    struct DDSHeader
+    {
+        uint32_t size;
+        uint32_t flags;
+        uint32_t height;
+        uint32_t width;
+        uint32_t pitchOrLinearSize;
+        uint32_t depth;
+        uint32_t mipMapCount;
+        uint32_t reserved1[11];
+        DDSPixelFormat pixelFormat;
+        uint32_t caps;
+        uint32_t caps2;
+        uint32_t caps3;
+        uint32_t caps4;
+        uint32_t reserved2;
+    };
+
+    struct DDSHeaderDX10
+    {
+        uint32_t dxgiFormat;
+        uint32_t resourceDimension;
+        uint32_t miscFlag;
+        uint32_t arraySize;
+        uint32_t miscFlags2;
+    };
+
+    // One mip level inside TextureJob::compressedData, or TextureJob::pixels for decoded images
+    struct CompressedLevel
+    {
+        size_t offset;
+        size_t size;
+        int width;
+        int height;
+    };
+
+    // Imported meshes (--mesh file.obj|.gltf|.glb), converted once into a binary cache entry that is memory-mapped
+    // on later runs
+    const char* const MESH_CACHE_DIR = "../../resources/cache/";
+    const uint32_t MESH_CACHE_MAGIC = 0x3148534D;   // "MSH1"
+    const uint32_t MESH_CACHE_VERSION = 3;          // Bump when the import pipeline or the entry layout changes
+    const int VERTEX_CACHE_SIZE = 32;               // Post-transform cache modelled by the vertex cache optimization
+    const int VERTEX_FIFO_SIZE = 16;                // FIFO cache simulated by the ACMR report and the overdraw clustering
+    const float OVERDRAW_THRESHOLD = 1.05f;         // ACMR a cluster may lose to be split for overdraw ordering
+
+    // Detail levels of imported meshes: quadric error simplification at import, picked per node from its screen size
+    const int MESH_MAX_LODS = 4;
+    const float LOD_REDUCTION = 0.5f;               // Triangle ratio between consecutive levels
+    const float LOD_MAX_ERROR = 0.01f;              // Largest simplification error (RMS distance), relative to the mesh radius
+    const float LOD_BORDER_WEIGHT = 10.0f;          // Keeps open borders in place
+    // Projected sphere radius, as a fraction of the screen height, below which level l + 1 replaces level l
+    const float LOD_SCREEN_SIZES[MESH_MAX_LODS - 1] = { 0.1f, 0.05f, 0.025f };
+    const float LOD_HYSTERESIS = 0.15f;             // Relative band around each threshold where a node keeps its level
+    const float IMPORTED_MESH_SIZE = 0.5f;          // Bounding sphere radius imported meshes are scaled to in the scene
+
+    // glTF binary container (.glb): 12-byte header, then a JSON chunk and an optional binary chunk
+    const uint32_t GLB_MAGIC = 0x46546C67;          // "glTF"
+    const uint32_t GLB_CHUNK_JSON = 0x4E4F534A;     // "JSON"
+    const uint32_t GLB_CHUNK_BIN = 0x004E4942;      // "BIN\0"
+
+    // Mesh cache entry: header, then nVertices vertices in the arena vertex format, then nIndices 32-bit indices
+    // relative to the first vertex
+    struct MeshCacheHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t vertexFormat;
+        uint32_t vertexSize;
+        uint32_t nVertices;
+        uint32_t nIndices;      // Every detail level, back to back
+        float boundsMin[3];
+        float boundsMax[3];
+        float boundingSphere[4];
+        uint32_t nLods;
+        uint32_t lodIndexCounts[MESH_MAX_LODS];
+        uint32_t reserved[3];   // Keeps the vertices 32-byte aligned
+    };
+
+    // Minimal JSON document tree, enough for glTF
+    struct JsonValue
+    {
+        enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+        Type type;
+        double number;          // Numbers, and 0 / 1 for booleans
+        std::string string;
+        std::vector<JsonValue> items;   // Array elements, or object values
+        std::vector<std::string> keys;  // Object keys, parallel to items
+    };
+
+    // A glTF accessor resolved to its bytes inside a loaded buffer
+    struct GltfAccessor
+    {
+        const unsigned char* data;
+        size_t count;
+        size_t stride;
+        GLenum componentType;   // glTF component types are the GL enums (GL_FLOAT, GL_UNSIGNED_SHORT, ...)
+        int components;
+        bool normalized;
+    };
+
+    // Mesh slots in the mesh arena
+    enum MeshId
+    {
+        MESH_GROUND,
+        MESH_TOWER_WIDE,
+        MESH_TOWER_SKINNY,
+        MESH_TOWER_TALL_SKINNY,
+        MESH_TOWER_CAP,
+        MESH_TOWER_SMALL,
+        MESH_SKY,
+        MESH_BUSH,
+        MESH_COUNT
+    };
+
+    // Stores the GL data relative to a given mesh: its range inside the mesh arena buffers
     struct GLMesh
     {
-        GLuint vao[10];         // Handle for the vertex array object
-        GLuint vbo[10];         // Handle for the vertex buffer object
-        GLuint nVertices[10];    // Number of indices of the mesh
+        GLint baseVertex;       // First vertex of the mesh in the arena vertex buffer
+        GLuint firstIndex;      // First index of the mesh in the arena index buffer
+        GLsizei nIndices;       // Number of indices of the mesh
+        GLuint nVertices;       // Number of unique vertices of the mesh
+        glm::vec3 boundsMin;    // Local-space axis-aligned bounding box
+        glm::vec3 boundsMax;
+        glm::vec4 boundingSphere; // Local-space bounding sphere (center, radius)
+        glm::mat4 dequantize;   // Maps stored positions to local space; drawn with world * dequantize
+        bool imported;          // Vertices come from a mesh cache entry, already in the arena format
+
+        // Detail levels, finest first, inside [firstIndex, firstIndex + nIndices). They share the mesh vertices.
+        int nLods;
+        GLuint lodFirstIndex[MESH_MAX_LODS];
+        GLsizei lodIndexCount[MESH_MAX_LODS];
+    };
+
+    // Symmetric 4x4 error quadric (Garland-Heckbert) of the planes around a vertex, with their total weight
+    struct Quadric
+    {
+        double a[10];           // xx, xy, xz, xw, yy, yz, yw, zz, zw, ww
+        double weight;
+    };
+
+    // Vertex layout of the mesh arena on the GPU
+    enum VertexFormat
+    {
+        VERTEX_FORMAT_COMPACT,  // CompactVertex, 16 bytes
+        VERTEX_FORMAT_FLOAT     // 8 floats, 32 bytes
+    };
+
+    // Compact vertex: position as unorm16 inside the mesh bounding box (w pads), normal as GL_INT_2_10_10_10_REV,
+    // texture coordinate as two half floats
+    struct CompactVertex
+    {
+        GLushort position[4];
+        GLuint normal;
+        GLuint textureCoordinate;
+    };
+
+    // Read-only view of a whole file mapped into memory
+    struct MappedFile
+    {
+        const unsigned char* data;
+        size_t size;
+    };
+
+    // A mesh loaded from the mesh cache. Its vertices and indices point into the mapping, or into the entry built in
+    // memory when the source was just converted, and are copied straight to the GPU by UUploadMeshArena.
+    struct ImportedMesh
+    {
+        int mesh;
+        MappedFile file;
+        std::vector<unsigned char> entry;   // Empty when the mesh came from the mapping
+        const unsigned char* vertices;
+        const GLuint* indices;
+    };
+
+    // Every mesh lives in one shared vertex buffer and one index buffer, described by a single VAO
+    struct MeshArena
+    {
+        GLuint vao;             // Handle for the vertex array object
+        GLuint vbo;             // Handle for the vertex buffer object
+        GLuint ebo;             // Handle for the element (index) buffer object
+        GLuint instanceVbo;     // Handle for the per-instance model matrix buffer (every batch)
+        VertexFormat format;    // Set before UCreateMesh (--vertex-format)
+        std::vector<GLMesh> meshes;
+
+        // CPU copy of the arena contents, filled by UAddMesh and sent to the GPU by UUploadMeshArena
+        std::vector<GLfloat> vertices;
+        std::vector<GLuint> indices;
+
+        // Imported meshes waiting for UUploadMeshArena, which releases their mappings
+        std::vector<ImportedMesh> imported;
+    };
+
+    // Interleaved vertex (position, normal, texture coordinate), used as the key when deduplicating
+    struct PackedVertex
+    {
+        GLfloat data[8];
+
+        bool operator==(const PackedVertex& other) const { return memcmp(data, other.data, sizeof(data)) == 0; }
+    };
+
+    struct PackedVertexHash
+    {
+        // FNV-1a over the vertex bytes
+        size_t operator()(const PackedVertex& vertex) const
+        {
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(vertex.data);
+            size_t hash = 2166136261u;
+            for (size_t i = 0; i < sizeof(vertex.data); ++i)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            return hash;
+        }
+    };
+
+    // Material slots in gMaterials
+    enum MaterialId
+    {
+        MATERIAL_GROUND,
+        MATERIAL_SKY,
+        MATERIAL_GLASS_ONE,
+        MATERIAL_GLASS_TWO,
+        MATERIAL_BUSH,
+        MATERIAL_COUNT
+    };
+
+    // Texture and UV scale used to shade a node
+    struct Material
+    {
+        GLuint texture;         // Slot in gMaterialTextures
+        const glm::vec2* uvScale; // Points at a shared scale so runtime changes ([ and ]) apply to every user
+    };
+
+    // A node of the scene graph. Nodes live in one flat array where parents always precede their children.
+    struct SceneNode
+    {
+        int parent;             // Index of the parent node, -1 for a root node
+        int mesh;               // MeshId
+        int material;           // MaterialId
+        bool instanced;         // Mesh is shared with other nodes, so it can be drawn from an instance buffer
+        bool dirty;             // Local transform changed since the world transform was last computed
+        glm::vec3 position;     // Local transform
+        glm::vec3 rotation;     // Euler angles in degrees, applied X then Y then Z
+        glm::vec3 scale;
+        glm::mat4 world;        // Cached world transform
+    };
+
+    // Per-instance vertex attributes in the mesh instance buffer (locations 3-6 and 7-9)
+    struct InstanceData
+    {
+        glm::mat4 model;        // World transform times the mesh dequantize matrix
+        glm::mat3x4 normalMatrix; // Inverse transpose of the model, columns padded to vec4
+    };
+
+    // A run of instanced nodes sharing a mesh and material, stored contiguously in the mesh instance buffer
+    struct InstanceBatch
+    {
+        int mesh;
+        int material;
+        GLuint firstInstance;
+        GLsizei count;
+        GLsizei visibleCount;   // Instances that survived culling, packed at the front of the batch
+        GLsizei lodCounts[MESH_MAX_LODS]; // Visible instances per detail level, packed in level order
+        std::vector<int> nodes; // Node indices in instance order
+    };
+
+    struct Scene
+    {
+        std::vector<SceneNode> nodes;
+        std::vector<InstanceBatch> batches;
+
+        // World-space bounding spheres, one entry per node, kept as separate arrays so the
+        // culling loop runs over contiguous floats and vectorizes
+        std::vector<float> boundsX;
+        std::vector<float> boundsY;
+        std::vector<float> boundsZ;
+        std::vector<float> boundsRadius;
+        std::vector<unsigned char> visible; // Result of the last culling pass
+        std::vector<unsigned char> lod;     // Detail level of every node, from USelectLods
+        std::vector<glm::mat3x4> normalMatrices; // Inverse transpose of world * mesh dequantize, from UUpdateScene
+    };
+
+    // View frustum planes (a * x + b * y + c * z + d >= 0 is inside), in the same array layout as the bounds
+    struct Frustum
+    {
+        float a[6];
+        float b[6];
+        float c[6];
+        float d[6];
+    };
+
+    // Program slots used by the render queue
+    enum ProgramSlot
+    {
+        PROGRAM_TOWER,
+        PROGRAM_INSTANCED,
+        PROGRAM_COUNT
+    };
+
+    // Profiler scope names of the draw groups issued with each program
+    const char* const PROGRAM_SLOT_NAMES[PROGRAM_COUNT] = { "tower draws", "instanced draws" };
+
+    // One draw collected for the frame. The key packs, from most to least significant:
+    // program (4 bits) | texture (16 bits) | mesh (16 bits) | depth (24 bits)
+    struct DrawItem
+    {
+        uint64_t key;
+        int node;               // Scene node to draw, -1 for an instance batch
+        int batch;              // Instance batch to draw, -1 for a single node
+    };
+
+    // Draws collected each frame, sorted by key so consecutive draws share state
+    struct RenderQueue
+    {
+        std::vector<DrawItem> items;
+        std::vector<int> frontToBack;   // Item indices by program, then nearest first, for the depth pre-pass
+
+        // Statistics of the last submission
+        int nDraws;
+        int nProgramBinds;
+        int nTextureBinds;
+        int nVaoBinds;
+    };
+
+    // Layout of one command in a GL_DRAW_INDIRECT_BUFFER for glMultiDrawElementsIndirect
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;    // Index of the command's first object in the object buffer
+    };
+
+    // Per-object data read by the indirect vertex shader (std430, 128 bytes)
+    struct IndirectObject
+    {
+        glm::mat4 model;
+        glm::mat3x4 normalMatrix;
+        glm::vec4 material;     // xy UV scale, z texture array layer, w pads the struct to a vec4 boundary
+    };
+
+    // Commands that share a texture array, issued with one glMultiDrawElementsIndirect
+    struct IndirectGroup
+    {
+        int textureArray;
+        GLsizei firstCommand;
+        GLsizei nCommands;
+    };
+
+    // GPU command and object buffers for drawing the static scene with multi-draw indirect
+    struct IndirectDraws
+    {
+        GLuint commandBuffer;
+        GLuint objectBuffer;
+        std::vector<DrawElementsIndirectCommand> commands;
+        std::vector<IndirectObject> objects;
+        std::vector<IndirectGroup> groups;
+    };
+
+    // Per-node data read and updated by the culling compute shader (std430, 160 bytes)
+    struct GpuCullObject
+    {
+        glm::mat4 model;        // World transform times the mesh dequantize matrix
+        glm::mat3x4 normalMatrix; // Its inverse transpose
+        glm::vec4 sphere;       // World-space bounding sphere
+        glm::vec4 material;     // xy UV scale, z texture array layer
+        GLuint firstCommand;    // Command drawing detail level 0 of the node; level l uses firstCommand + l
+        GLuint nLods;
+        GLuint lod;             // Level picked on the previous frame, kept on the GPU for the hysteresis
+        GLuint pad;
+    };
+
+    // GPU-driven path: a compute pass culls every node and appends the visible ones to their command, so the CPU
+    // only uploads the objects when the scene changes. Every (texture array, mesh) pair gets one command per
+    // detail level, each with room in the visible list for all of the pair's nodes.
+    struct GpuCulling
+    {
+        GLuint program;         // Culling compute program
+        GLint frustumPlanes;    // Uniform locations
+        GLint cameraPosition;
+        GLint projectionScale;
+        GLint perspective;
+        GLint lodScreenSizes;
+        GLint lodHysteresis;
+        GLint objectCount;
+        GLint useCulling;
+        GLint useOcclusion;
+        GLint previousViewProjection;
+        GLint depthSize;
+        GLint hiZ;
+
+        GLuint objectBuffer;
+        GLuint commandTemplate; // Commands with no instances, copied over commandBuffer before every dispatch
+        GLuint commandBuffer;
+        GLuint visibleBuffer;   // Object indices, in one range per command starting at its baseInstance
+        GLuint readbackBuffer;  // GPU_CULL_READBACK_FRAMES copies of the culled commands
+        GLsync readbackFences[GPU_CULL_READBACK_FRAMES];
+        int readbackFrame;
+
+        GLuint nObjects;
+        std::vector<DrawElementsIndirectCommand> commands;
+        std::vector<IndirectGroup> groups;
+        GLuint visibleCount;    // Visible nodes of the last frame read back (a few frames old)
+    };
+
+    // Depth pyramid (Hi-Z) of the last frame drawn by the GPU-culled path. Level 0 is half the framebuffer size and
+    // every texel holds the farthest depth of the pixels it covers; the last texel of a row or column also covers
+    // the odd pixel a halving leaves over.
+    struct HiZBuffer
+    {
+        GLuint program;         // Reduction compute program
+        GLint sourceLevel;      // Uniform location
+        GLuint depthTexture;    // Copy of the depth buffer
+        GLuint pyramid;
+        int width;              // Framebuffer size the textures were made for
+        int height;
+        int nLevels;
+
+        // View the pyramid was built from; valid is false until one matches the current scene
+        bool valid;
+        glm::mat4 viewProjection;
+        glm::mat4 projection;
+        glm::vec3 cameraPosition;
+        glm::vec3 cameraFront;
+    };
+
+    // Point light in the layout of the light storage buffer (std430, 32 bytes)
+    struct PointLight
+    {
+        glm::vec4 positionRange;    // World position, w distance where the light fades out
+        glm::vec4 color;            // rgb color times intensity
+    };
+
+    // Clustered forward lighting: a compute pass lists the point lights reaching every cluster of the view frustum,
+    // and the Phong shader only loops over the list of its fragment's cluster
+    struct LightClusters
+    {
+        GLuint program;         // Light assignment compute program
+        GLint view;             // Uniform locations
+        GLint inverseProjection;
+        GLint perspective;
+        GLint lightCount;
+
+        GLuint lightBuffer;
+        GLuint gridBuffer;      // uvec2 (first index, light count) per cluster
+        GLuint indexBuffer;     // CLUSTER_MAX_LIGHTS light indices per cluster
+        std::vector<PointLight> lights;
+        bool lightsChanged;     // Lights are uploaded on the next update
+
+        // Fragment to cluster: tile = gl_FragCoord.xy * scale.xy, slice = log(view depth) * scale.z + scale.w
+        glm::vec4 scale;
+    };
+
+    // Deferred shading: the opaque pass writes surface attributes here, then one full-screen pass lights every pixel
+    struct GBuffer
+    {
+        GLuint fbo;
+        GLuint albedo;          // GL_RGBA8, texture color
+        GLuint normal;          // GL_RG16F, octahedral-encoded world normal
+        GLuint depth;           // GL_DEPTH_COMPONENT24; positions are reconstructed from it
+        int width;              // Framebuffer size the textures were made for
+        int height;
+        GLint target;           // Framebuffer the lighting pass writes to, saved when the G-buffer is bound
+        GLuint emptyVao;        // The full-screen triangle comes from gl_VertexID
+    };
+
+    // Texture arrays holding the material textures, one per storage format
+    enum TextureArrayId
+    {
+        TEXTURE_ARRAY_RGBA8,    // Decoded images, and the placeholder layers of every material
+        TEXTURE_ARRAY_BC1,      // Cooked textures (created on first use)
+        TEXTURE_ARRAY_BC3,
+        TEXTURE_ARRAY_BC7,
+        TEXTURE_ARRAY_COUNT
+    };
+
+    const GLenum TEXTURE_ARRAY_FORMATS[TEXTURE_ARRAY_COUNT] = {
+        GL_RGBA8, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_RGBA_BPTC_UNORM
+    };
+
+    // Where a material texture currently lives
+    struct TextureSlot
+    {
+        int array;              // TextureArrayId
+        int layer;
+    };
+
+    // Material textures packed into GL_TEXTURE_2D_ARRAYs. Draws pick their layer from per-draw data,
+    // so only a change of array (storage format) needs a texture bind.
+    struct TextureArrays
+    {
+        GLuint ids[TEXTURE_ARRAY_COUNT];    // 0 until the array is first used
+        int nLayers[TEXTURE_ARRAY_COUNT];
+        int capacity;                       // Layers allocated in each array
+        std::vector<TextureSlot> slots;
+        bool slotsChanged;                  // A texture moved to another array; per-object data must be rebuilt
+    };
+
+    // A texture decode request, filled in by a worker thread and streamed to the GPU by the render thread
+    struct TextureJob
+    {
+        std::string filename;
+        GLuint texture;         // Slot showing the placeholder layer until the upload finishes
+        std::vector<unsigned char> pixels; // Mip chain of the decoded image at the layer size, empty when decoding failed
+        int width;              // Size of the decoded source image, before resampling to the layer size
+        int height;
+        int channels;
+        int nextRow;            // Next row of the current level to stream to the GPU
+        std::vector<CompressedLevel> levels; // Mip chain, largest first
+        int nextLevel;          // Next mip level to stream to the GPU
+
+        // Set instead of pixels when the texture was found in the cooked texture cache
+        bool compressed;
+        GLenum compressedFormat;
+        std::vector<unsigned char> compressedData;
+        int layer;              // Layer in the compressed array, taken when the upload starts
+    };
+
+    // Worker pool that decodes images off the render thread, plus the PBO ring the render thread uploads through
+    struct TextureLoader
+    {
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wakeWorkers;
+        std::deque<TextureJob*> pending;    // Waiting for a worker (guarded by mutex)
+        std::deque<TextureJob*> decoded;    // Waiting for the render thread (guarded by mutex)
+        int decoding;                       // Jobs taken by a worker and not yet decoded (guarded by mutex)
+        bool stopping;                      // Guarded by mutex
+
+        // Render thread only
+        std::deque<TextureJob*> uploading;
+        GLuint pbo;
+        unsigned char* mapped;              // Persistent, coherent mapping of the whole PBO
+        GLsync slotFences[TEXTURE_UPLOAD_SLOTS]; // Signaled once the GPU has consumed a slot
+        int nextSlot;
+
+        bool s3tcSupported;                 // BC1/BC3 cache entries can be used (read by workers, set before they start)
+    };
+
+    // One timed region of a frame
+    struct ProfileScope
+    {
+        const char* name;
+        int depth;              // 0 for the whole frame, 1 for passes, 2 for draw groups inside a pass
+        double cpuBegin;        // Seconds (glfwGetTime)
+        double cpuMs;
+        GLuint64 gpuBegin;      // Nanoseconds (GL_TIMESTAMP), filled in when the queries resolve
+        double gpuMs;
+        bool gpuTimed;          // False for CPU-only scopes such as the swap, which has no GPU timestamps
+    };
+
+    // Scopes recorded during one frame and the timestamp queries bracketing each of them on the GPU
+    struct ProfilerFrame
+    {
+        std::vector<ProfileScope> scopes;
+        GLuint queries[PROFILER_MAX_SCOPES][2];
+        bool pending;           // Queries issued but not read back yet
+        long long frameNumber;
+    };
+
+    // Running totals of one scope name between two overlay reports
+    struct ProfilePassStats
+    {
+        const char* name;
+        double cpuMs;
+        double gpuMs;
+        int count;
+    };
+
+    struct Profiler
+    {
+        ProfilerFrame frames[PROFILER_QUERY_FRAMES];
+        int current;                    // Set recording this frame, -1 when every set was still in flight
+        int next;                       // Next set of the ring to record into
+        long long frameNumber;
+        std::vector<int> openScopes;
+
+        // Statistics of resolved frames
+        std::deque<float> cpuHistory;   // Wall time of the frame
+        std::deque<float> gpuHistory;   // Sum of the passes' GPU time
+        std::vector<ProfileScope> lastScopes; // Most recent resolved frame, drawn by the overlay
+        std::vector<ProfilePassStats> passStats;
+        int untimedFrames;              // Frames not recorded because every query set was still in flight
+        double lastReport;
+
+        // Trace file (--trace name.csv or name.json)
+        std::ofstream trace;
+        bool traceJson;
+        bool traceHasEvents;
+        double traceCpuEpoch;
+        GLuint64 traceGpuEpoch;
+
+        // Overlay (F1 shows, F2 hides)
+        bool showOverlay;
+        GLuint overlayVao;
+        GLuint overlayVbo;
+        GLint overlayRect;
+    };
+
+    // Camera pose at one control point of a camera path
+    struct CameraKey
+    {
+        glm::vec3 position;
+        float yaw;              // Degrees, as used by Camera
+        float pitch;
+    };
+
+    // Offscreen benchmark: replays a camera path into an FBO and records frame times and latencies
+    struct Benchmark
+    {
+        bool enabled;
+        int nFrames;
+        std::vector<CameraKey> path;    // Catmull-Rom control points, passed through in order
+        GLuint fbo;
+        GLuint colorBuffer;
+        GLuint depthBuffer;
+        std::vector<float> frameMs;     // Start of one frame to the start of the next
+        std::vector<float> latencyMs;   // Start of a frame to the GPU finishing it
+        double visibleObjects;          // Average nodes left after culling
+
+        // Stress sweep, empty for a plain benchmark of the scene
+        std::vector<int> stressCounts;
+        unsigned int stressSeed;
+        std::string stressOutFilename;  // CSV of the sweep (--stress-out)
+    };
+
+    // How the scene is submitted
+    enum RenderPath
+    {
+        RENDER_PATH_NAIVE,      // One draw per node through the render queue
+        RENDER_PATH_INSTANCED,  // Repeated meshes drawn as instance batches through the render queue
+        RENDER_PATH_INDIRECT,   // Whole scene drawn from an indirect command buffer
+        RENDER_PATH_GPU_CULLED  // Whole scene culled by a compute shader into an indirect command buffer
+    };
+
+    // How the opaque pass is lit
+    enum ShadingMode
+    {
+        SHADING_FORWARD,        // Phong in the fragment shader of every draw
+        SHADING_DEFERRED,       // Draws fill a G-buffer, then a full-screen pass runs Phong once per pixel
+        SHADING_COUNT
+    };
+
+    const char* const SHADING_MODE_NAMES[SHADING_COUNT] = { "forward", "deferred" };
+
+    // Shader permutations: the tower programs are assembled from GLSL snippets and feature defines, and compiled on
+    // first use. Where the vertex shader reads each object's transforms (the instancing feature):
+    enum ShaderInput
+    {
+        SHADER_INPUT_NODE,      // Uniforms, one node per draw
+        SHADER_INPUT_INSTANCED, // Per-instance vertex attributes
+        SHADER_INPUT_INDIRECT,  // Object buffer indexed by the draw's base instance
+        SHADER_INPUT_GPU_CULLED // Object buffer indexed through the culling pass's visible list
+    };
+
+    // What the fragment shader writes
+    enum ShaderOutput
+    {
+        SHADER_OUTPUT_FORWARD,  // Lit color
+        SHADER_OUTPUT_GBUFFER,  // Surface color and normal for the deferred lighting pass
+        SHADER_OUTPUT_DEPTH,    // Nothing; depth pre-pass
+        SHADER_OUTPUT_DEFERRED_LIGHTING // Lit color from the G-buffer, full-screen triangle
+    };
+
+    enum LightingModel
+    {
+        LIGHTING_PHONG,
+        LIGHTING_BLINN_PHONG,
+        LIGHTING_UNLIT,         // Surface color only
+        LIGHTING_MODEL_COUNT
+    };
+
+    const char* const LIGHTING_MODEL_NAMES[LIGHTING_MODEL_COUNT] = { "phong", "blinn-phong", "unlit" };
+
+    // Vertex input of each render queue program slot
+    const ShaderInput PROGRAM_SLOT_INPUTS[PROGRAM_COUNT] = { SHADER_INPUT_NODE, SHADER_INPUT_INSTANCED };
+
+    // Features of one shader variant; each becomes a define or a snippet choice in its sources
+    struct ShaderVariant
+    {
+        ShaderInput input;
+        ShaderOutput output;
+        LightingModel lighting;
+        bool textured;          // Material texture, or the flat object color
+        bool pointLights;       // Clustered point lights; compiled out while the scene has none
+    };
+
+    // Scene description: one entry per drawable object, in draw order
+    struct SceneObjectDesc
+    {
+        int mesh;
+        int material;
+        glm::vec3 position;
+        glm::vec3 rotation;
+        glm::vec3 scale;
+    };
+
+    // Stores a linked shader program and its uniform locations, resolved once at link time
+    struct GLProgram
+    {
+        GLuint id;              // Handle for the shader program
+        GLint model;            // Uniform locations (-1 when the program does not use the uniform)
+        GLint normalMatrix;
+        GLint view;
+        GLint projection;
+        GLint objectColor;
+        GLint lightColor;
+        GLint lightPos;
+        GLint viewPosition;
+        GLint uvScale;
+        GLint textureLayer;
+        GLint uTexture;
+        GLint clusterScale;
+        GLint clusterCount;
+        GLint ambientStrength;
+        GLint specularIntensity;
+        GLint highlightSize;
+        GLint inverseViewProjection;
+    };
+
+    // Compiled shader variants by packed feature key (UShaderVariantKey). Variants that failed to build stay in the
+    // cache with id 0, so they are reported once rather than recompiled every frame.
+    struct ShaderVariantCache
+    {
+        std::unordered_map<uint32_t, GLProgram> programs;
     };
 
     // Main GLFW window
     GLFWwindow* gWindow = nullptr;
     // Triangle mesh data
-    GLMesh gMesh;
-    // Texture
+    MeshArena gMeshArena;
+    // Scene graph and the materials it references
+    Scene gScene;
+    Material gMaterials[MATERIAL_COUNT];
+    // Per-frame list of draws
+    RenderQueue gRenderQueue;
+    // Indirect command and object buffers
+    IndirectDraws gIndirectDraws;
+    // Culling compute pass and the command buffer it fills
+    GpuCulling gGpuCulling;
+    // Previous frame's depth pyramid, tested by the culling pass
+    HiZBuffer gHiZ;
+    // Point lights and their per-cluster lists
+    LightClusters gLightClusters;
+    int gLightCount = 0;        // Point lights placed around the scene (--lights n)
+    // Background texture decoding and streaming
+    TextureLoader gTextureLoader;
+    // Material textures, packed into texture arrays
+    TextureArrays gMaterialTextures;
+    // Texture slots in gMaterialTextures
     GLuint glassOneTextureId;
     GLuint glassTwoTextureId;
     GLuint groundTextureId;
@@ -51,9 +905,36 @@ namespace
     glm::vec2 gSKYUVScale(1.0f, 1.0f);
     GLint gTexWrapMode = GL_REPEAT;
 
-    // Shader programs
-    GLuint gProgramId;
-    GLuint gLampProgramId;
+    // Shader programs; the scene is drawn with shader variants built on demand
+    ShaderVariantCache gShaderVariants;
+    GLProgram gLampProgram;
+    GLProgram gOverlayProgram;
+    // Lighting model (1 Phong, 2 Blinn-Phong, 3 unlit, --lighting name) and material textures (T on, Y off,
+    // --untextured), both compiled into the shader variants
+    LightingModel gLightingModel = LIGHTING_PHONG;
+    bool gTextured = true;
+
+    // Render path (U naive, I instanced, M multi-draw indirect, G GPU-culled indirect)
+    RenderPath gRenderPath = RENDER_PATH_INSTANCED;
+    bool gIndirectSupported = false; // Requires GL_ARB_shader_draw_parameters
+    bool gGpuCullingSupported = false; // Indirect support, and the culling compute shader compiled
+    // Forward or deferred shading (K forward, L deferred, --deferred to start deferred)
+    ShadingMode gShadingMode = SHADING_FORWARD;
+    GBuffer gGBuffer;
+    // Depth pre-pass before the opaque pass (B on, N off, --depth-prepass to start with it)
+    bool gDepthPrepass = false;
+    // Set while the GPU-culled path skips the CPU culling, so the CPU paths rebuild their draws when selected again
+    bool gCpuDrawsStale = false;
+    // Frustum culling (toggle with C / V)
+    bool gUseCulling = true;
+    // Hi-Z occlusion culling on the GPU-culled path (toggle with Z / X)
+    bool gUseOcclusion = true;
+    // CPU and GPU frame timings
+    Profiler gProfiler;
+    // Headless benchmark state
+    Benchmark gBench;
+    // Print the vertex cache statistics of every mesh at load (--mesh-report)
+    bool gMeshReport = false;
 
     // camera
     Camera gCamera(glm::vec3(0.0f, 0.2f, 4.0f));
@@ -73,10 +954,50 @@ namespace
     glm::vec3 gBackdropScale(1.0f);
     glm::vec3 gBushScale(0.2f);
 
+    // Objects placed in the scene
+    const SceneObjectDesc gSceneObjects[] = {
+        // Ground and sky
+        { MESH_GROUND, MATERIAL_GROUND, gGroundPosition, glm::vec3(0.0f), gGroundScale },
+        { MESH_SKY, MATERIAL_SKY, glm::vec3(0.0f, 2.7f, -2.7f), glm::vec3(90.0f, 0.0f, 0.0f), gBackdropScale },
+
+        // Towers
+        { MESH_TOWER_SKINNY, MATERIAL_GLASS_ONE, glm::vec3(1.6f, 1.5f, -2.2f), glm::vec3(0.0f), glm::vec3(0.4f) },
+        { MESH_TOWER_WIDE, MATERIAL_GLASS_TWO, glm::vec3(0.8f, 1.58f, -2.2f), glm::vec3(0.0f), glm::vec3(0.75f) },
+        { MESH_TOWER_TALL_SKINNY, MATERIAL_GLASS_ONE, glm::vec3(-0.6f, 2.3f, -2.2f), glm::vec3(0.0f), glm::vec3(0.4f) },
+        { MESH_TOWER_TALL_SKINNY, MATERIAL_GLASS_ONE, glm::vec3(0.1f, 2.1f, -2.2f), glm::vec3(0.0f), glm::vec3(0.37f) },
+        { MESH_TOWER_CAP, MATERIAL_GLASS_TWO, glm::vec3(-1.4f, 1.50f, -2.2f), glm::vec3(0.0f), glm::vec3(0.40f) },
+        { MESH_TOWER_SMALL, MATERIAL_GLASS_TWO, glm::vec3(-1.0f, 0.45f, -2.4f), glm::vec3(0.0f), glm::vec3(0.30f) },
+        { MESH_TOWER_SMALL, MATERIAL_GLASS_TWO, glm::vec3(-0.27f, 0.21f, -2.5f), glm::vec3(0.0f), glm::vec3(0.20f) },
+
+        // Bushes
+        { MESH_BUSH, MATERIAL_BUSH, glm::vec3(-0.7f, -0.3f, 1.0f), glm::vec3(0.0f), gBushScale },
+        { MESH_BUSH, MATERIAL_BUSH, glm::vec3(-0.9f, -0.3f, 0.3f), glm::vec3(0.0f), gBushScale },
+        { MESH_BUSH, MATERIAL_BUSH, glm::vec3(0.7f, -0.3f, 1.0f), glm::vec3(0.0f), gBushScale },
+        { MESH_BUSH, MATERIAL_BUSH, glm::vec3(0.9f, -0.3f, 0.3f), glm::vec3(0.0f), gBushScale },
+        { MESH_BUSH, MATERIAL_BUSH, glm::vec3(-0.5f, -0.3f, 1.7f), glm::vec3(0.0f), gBushScale },
+        { MESH_BUSH, MATERIAL_BUSH, glm::vec3(0.5f, -0.3f, 1.7f), glm::vec3(0.0f), gBushScale }
+    };
+
+    // Benchmark camera path when no --bench-path is given: around the scene and back to the start pose
+    const CameraKey gDefaultCameraPath[] = {
+        { glm::vec3(0.0f, 0.2f, 4.0f), -90.0f, 0.0f },
+        { glm::vec3(2.5f, 0.8f, 3.0f), -115.0f, -5.0f },
+        { glm::vec3(3.5f, 1.5f, 0.0f), -150.0f, -10.0f },
+        { glm::vec3(0.0f, 1.0f, 1.5f), -90.0f, 5.0f },
+        { glm::vec3(-3.0f, 1.2f, 1.0f), -45.0f, -5.0f },
+        { glm::vec3(-1.5f, 0.4f, 3.5f), -75.0f, 0.0f },
+        { glm::vec3(0.0f, 0.2f, 4.0f), -90.0f, 0.0f }
+    };
+
     // Tower and light color
     glm::vec3 gObjectColor(1.f, 0.2f, 0.0f);
     glm::vec3 gLightColor(1.0f, 1.0f, 0.95f);
 
+    // Lighting parameters shared by every lit variant
+    float gAmbientStrength = 0.1f;      // Ambient or global lighting strength
+    float gSpecularIntensity = 0.8f;    // Specular light strength
+    float gHighlightSize = 16.0f;       // Specular exponent (Phong; Blinn-Phong uses four times this)
+
     // Light position and scale
     glm::vec3 gLightPosition(0.0f, 7.5f, 5.0f);
     glm::vec3 gLightScale(0.7f);
@@ -93,17 +1014,140 @@ void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
+void UCreateMesh(MeshArena& arena, const std::vector<const char*>& meshFiles);
+int UAddMesh(MeshArena& arena, const GLfloat* verts, GLuint nVertices);
+GLuint UIndexVertices(const GLfloat* verts, GLuint nVertices, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices);
+void UComputeMeshBounds(GLMesh& mesh, const GLfloat* vertices, GLuint nVertices);
+void UUploadMeshArena(MeshArena& arena);
+void UEncodeCompactVertices(MeshArena& arena, std::vector<CompactVertex>& compact);
+glm::vec3 UCompactExtent(const GLMesh& mesh);
+CompactVertex UEncodeCompactVertex(const GLfloat* vertex, glm::vec3 boundsMin, glm::vec3 extent);
+bool UImportMesh(MeshArena& arena, const char* filename);
+std::string UMeshCachePath(const char* filename, VertexFormat format);
+bool UCheckMeshCache(const MappedFile& file, VertexFormat format);
+void UBuildMeshCache(VertexFormat format, const std::vector<GLfloat>& vertices, const std::vector<GLuint>& indices, const std::vector<GLuint>& lodIndexCounts, std::vector<unsigned char>& entry);
+bool UWriteMeshCache(const std::string& path, const std::vector<unsigned char>& entry);
+bool UMapFile(const char* filename, MappedFile& file);
+void UUnmapFile(MappedFile& file);
+bool UCreateCacheDirectory(const char* path);
+bool ULoadMeshSource(const char* filename, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices);
+bool ULoadObj(const char* filename, std::vector<GLfloat>& soup);
+int UObjIndex(long index, size_t count);
+bool ULoadGltf(const char* filename, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices);
+glm::mat4 UGltfNodeTransform(const JsonValue& node);
+bool UGetGltfAccessor(const JsonValue& gltf, const std::vector<std::vector<unsigned char>>& buffers, int index, GltfAccessor& accessor);
+float UGltfFloat(const GltfAccessor& accessor, size_t element, int component);
+GLuint UGltfIndex(const GltfAccessor& accessor, size_t element);
+bool UParseJson(const char*& p, const char* end, JsonValue& value);
+const JsonValue* UJsonFind(const JsonValue& object, const char* key);
+double UJsonNumber(const JsonValue* value, double fallback);
+bool UDecodeBase64(const char* text, size_t length, std::vector<unsigned char>& bytes);
+void UOptimizeMesh(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices, const std::string& name, bool report);
+void UOptimizeVertexCache(std::vector<GLuint>& indices, GLuint nVertices);
+void UOptimizeOverdraw(std::vector<GLuint>& indices, const std::vector<GLfloat>& vertices, float threshold);
+void UOptimizeVertexFetch(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices);
+float UAnalyzeVertexCache(const std::vector<GLuint>& indices, GLuint nVertices);
+void UGenerateLods(const std::vector<GLfloat>& vertices, std::vector<GLuint>& indices, std::vector<GLuint>& lodIndexCounts, const std::string& name);
+void USimplifyMesh(std::vector<GLuint>& indices, const std::vector<GLfloat>& vertices, size_t targetIndexCount, float maxError);
+void UAddPlaneQuadric(Quadric& quadric, glm::vec3 normal, float distance, float weight);
+double UQuadricError(const Quadric& quadric, glm::vec3 position);
+float UVertexCacheScore(int cachePosition, GLuint remainingTriangles);
+void UCreateInstances(MeshArena& arena, Scene& scene);
+void UUpdateInstances(MeshArena& arena, Scene& scene);
+void UCreateScene(Scene& scene, const MeshArena& arena);
+int UAddSceneNode(Scene& scene, int parent, int mesh, int material, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale);
+void USetNodeTransform(Scene& scene, int node, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale);
+bool UUpdateScene(Scene& scene, const MeshArena& arena);
+void UComputeNormalMatrices(const glm::mat4* models, glm::mat3x4* normalMatrices, size_t count);
+Frustum UExtractFrustum(const glm::mat4& viewProjection);
+bool UCullScene(Scene& scene, const Frustum& frustum);
+bool USelectLods(Scene& scene, const MeshArena& arena, const glm::mat4& projection, glm::vec3 cameraPosition);
+void USubmitOpaque(bool depthOnly, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+uint64_t UMakeDrawKey(GLuint program, GLuint texture, GLuint mesh, float depth);
+void UBuildRenderQueue(RenderQueue& queue, const Scene& scene, glm::vec3 cameraPosition);
+void USubmitRenderQueue(RenderQueue& queue, const Scene& scene, const MeshArena& arena, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void USubmitDepthPrepass(const RenderQueue& queue, const Scene& scene, const MeshArena& arena, const glm::mat4& view, const glm::mat4& projection);
+int UDrawQueueItem(const DrawItem& item, const Scene& scene, const MeshArena& arena, const GLProgram& program);
+void USetFrameUniforms(const GLProgram& program, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void UCreateIndirectDraws(IndirectDraws& draws);
+void UBuildIndirectDraws(IndirectDraws& draws, const Scene& scene, const MeshArena& arena);
+void USubmitIndirectDraws(const IndirectDraws& draws, const MeshArena& arena, bool depthOnly, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void UDestroyIndirectDraws(IndirectDraws& draws);
+bool UCreateGpuCulling(GpuCulling& culling);
+void UBuildGpuCulling(GpuCulling& culling, const Scene& scene, const MeshArena& arena);
+void UCullSceneGpu(GpuCulling& culling, const HiZBuffer& hiZ, bool useOcclusion, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void USubmitGpuCulledDraws(const GpuCulling& culling, const MeshArena& arena, bool depthOnly, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void UReadGpuCullingStats(GpuCulling& culling);
+void UDestroyGpuCulling(GpuCulling& culling);
+bool UCreateHiZ(HiZBuffer& hiZ);
+void UBuildHiZ(HiZBuffer& hiZ, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+bool UIsCameraCut(const HiZBuffer& hiZ, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void UDestroyHiZ(HiZBuffer& hiZ);
+bool UCreateLightClusters(LightClusters& clusters);
+void UCreateLights(LightClusters& clusters, const Scene& scene, int count, unsigned int seed);
+void UUpdateLightClusters(LightClusters& clusters, const glm::mat4& view, const glm::mat4& projection);
+void UDestroyLightClusters(LightClusters& clusters);
+void UCreateGBuffer(GBuffer& gBuffer);
+void UBindGBuffer(GBuffer& gBuffer);
+void ULightGBuffer(GBuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition);
+void UDestroyGBuffer(GBuffer& gBuffer);
+bool UCreateProfiler(Profiler& profiler, const char* traceFilename);
+void UBeginProfilerFrame(Profiler& profiler);
+void UEndProfilerFrame(Profiler& profiler, GLFWwindow* window);
+int UBeginProfileScope(Profiler& profiler, const char* name, bool gpuTimed = true);
+void UEndProfileScope(Profiler& profiler, int scope);
+void UResolveProfilerFrame(Profiler& profiler, ProfilerFrame& frame);
+void UWriteProfilerTrace(Profiler& profiler, const ProfilerFrame& frame);
+void UDrawProfilerOverlay(const Profiler& profiler);
+void UDestroyProfiler(Profiler& profiler);
+float UPercentile(std::vector<float> values, float percentile);
+bool ULoadCameraPath(const char* filename, std::vector<CameraKey>& path);
+CameraKey USampleCameraPath(const std::vector<CameraKey>& path, float t);
+void UApplyCameraKey(Camera& camera, const CameraKey& key);
+bool UCreateBenchmarkTarget(Benchmark& bench);
+bool URunBenchmark(Benchmark& bench);
+double UBenchmarkFrames(Benchmark& bench);
+bool URunStressBenchmark(Benchmark& bench);
+void UCreateStressScene(Scene& scene, const MeshArena& arena, int count, unsigned int seed);
+bool UParseCountList(const char* text, std::vector<int>& counts);
+bool UParseInt(const char* text, int minimum, int& value);
+void UMakeStressCameraPath(std::vector<CameraKey>& path);
+float URandom01(std::mt19937& rng);
+void UPrintBenchmarkStats(const char* label, const std::vector<float>& values);
+void UDestroyBenchmarkTarget(Benchmark& bench);
+bool UTextureLoaderIdle(TextureLoader& loader);
+void UDestroyMesh(MeshArena& arena);
+bool UCreateTexture(const char* filename, GLuint& texture);
+void UCreateTextureArrays(TextureArrays& arrays, int capacity);
+GLuint UCreateTextureArray(GLenum internalFormat, int capacity);
+void UDestroyTextureArrays(TextureArrays& arrays);
+void UResampleImage(const unsigned char* image, int width, int height, int channels, int size, std::vector<unsigned char>& out);
+void UDownsampleImage(const unsigned char* image, int width, int height, int channels, std::vector<unsigned char>& out);
+void UCreateTextureLoader(TextureLoader& loader);
+void UTextureWorker(TextureLoader* loader);
+void UUpdateTextureLoader(TextureLoader& loader, TextureArrays& arrays);
+void UDestroyTextureLoader(TextureLoader& loader);
+uint64_t UHashFile(const char* filename, std::vector<unsigned char>& contents);
+uint64_t UHashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull);
+bool UReadFile(const char* filename, std::vector<unsigned char>& contents);
+std::string UTextureCachePath(uint64_t hash);
+bool ULoadCachedTexture(const std::string& path, TextureJob& job, bool s3tcSupported);
+bool UCookTexture(const char* filename);
+void UCompressBlockBC(const unsigned char* rgba, bool withAlpha, unsigned char* out);
 void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLProgram& program);
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId);
+void UDestroyShaderProgram(GLProgram& program);
+const GLProgram* UGetShaderVariant(ShaderVariantCache& cache, ShaderVariant variant);
+const GLProgram* UGetSceneProgram(ShaderInput input, ShaderOutput output);
+const GLProgram* UGetOpaqueProgram(ShaderInput input, bool depthOnly);
+uint32_t UShaderVariantKey(const ShaderVariant& variant);
+void UBuildShaderVariantSources(const ShaderVariant& variant, std::string& vertexSource, std::string& fragmentSource);
+void UDestroyShaderVariants(ShaderVariantCache& cache);
 
 
-/* Tower Vertex Shader Source Code*/
-const GLchar* towerVertexShaderSource = GLSL(440,
+/* Tower Vertex Shader Source Code: the part shared by every variant, after the object input snippet*/
+const GLchar* towerVertexShaderSource = GLSL_SNIPPET(
 
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
 layout(location = 1) in vec3 normal; // VAP position 1 for normals
@@ -112,1328 +1156,6787 @@ layout(location = 2) in vec2 textureCoordinate;
 out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
 out vec2 vertexTextureCoordinate;
+flat out int vertexTextureLayer;
+invariant gl_Position; // Same depth in the pre-pass and the shading pass, so GL_EQUAL holds
 
 //Uniform / Global variables for the  transform matrices
-uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    mat4 objectModel;
+    mat3 objectNormalMatrix;
+    vec2 objectUvScale;
+    int objectLayer;
+    loadObject(objectModel, objectNormalMatrix, objectUvScale, objectLayer);
 
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+    gl_Position = projection * view * objectModel * vec4(position, 1.0f); // Transforms vertices into clip coordinates
 
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
+    vertexFragmentPos = vec3(objectModel * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+    vertexNormal = objectNormalMatrix * normal; // get normal vectors in world space only and exclude normal translation properties
+    vertexTextureCoordinate = textureCoordinate * objectUvScale;
+    vertexTextureLayer = objectLayer;
 }
 );
 
 
-/* Tower Fragment Shader Source Code*/
-const GLchar* towerFragmentShaderSource = GLSL(440,
-
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
-
-out vec4 fragmentColor; // For outgoing tower color to the GPU
+/* Object Input Shader Source Code: one snippet per ShaderInput, each defining loadObject*/
+const GLchar* nodeInputShaderSource = GLSL_SNIPPET(
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform vec2 uvScale;
+    uniform mat4 model;
+uniform mat3x4 normalMatrix; // Inverse transpose of the model matrix, computed once per object on the CPU
+uniform int textureLayer; // Layer of the material texture in the bound texture array
 
-void main()
+void loadObject(out mat4 objectModel, out mat3 objectNormalMatrix, out vec2 objectUvScale, out int objectLayer)
 {
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
-
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.1f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on tower
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+    objectModel = model;
+    objectNormalMatrix = mat3(normalMatrix);
+    objectUvScale = vec2(1.0); // The uvScale uniform applies it in the fragment shader
+    objectLayer = textureLayer;
+}
+);
 
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
+const GLchar* instancedInputShaderSource = GLSL_SNIPPET(
 
-    // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    layout(location = 3) in mat4 instanceModel; // VAP positions 3-6 for the per-instance model matrix
+layout(location = 7) in mat3x4 instanceNormalMatrix; // VAP positions 7-9 for its inverse transpose
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+uniform int textureLayer; // Layer of the material texture in the bound texture array
 
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
+void loadObject(out mat4 objectModel, out mat3 objectNormalMatrix, out vec2 objectUvScale, out int objectLayer)
+{
+    objectModel = instanceModel;
+    objectNormalMatrix = mat3(instanceNormalMatrix);
+    objectUvScale = vec2(1.0); // The uvScale uniform applies it in the fragment shader
+    objectLayer = textureLayer;
 }
 );
 
+const GLchar* indirectInputShaderSource = GLSL_SNIPPET(
 
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
-
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+    struct ObjectData
+{
+    mat4 model;
+    mat3x4 normalMatrix; // Inverse transpose of the model matrix
+    vec4 material; // xy UV scale, z texture array layer
+};
 
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+// Per-object data; each indirect command points baseInstance at its first object
+layout(std430, binding = 0) readonly buffer ObjectBuffer
+{
+    ObjectData objects[];
+};
 
-void main()
+void loadObject(out mat4 objectModel, out mat3 objectNormalMatrix, out vec2 objectUvScale, out int objectLayer)
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    ObjectData object = objects[gl_BaseInstanceARB + gl_InstanceID];
+
+    objectModel = object.model;
+    objectNormalMatrix = mat3(object.normalMatrix);
+    objectUvScale = object.material.xy; // UV scale is per object, so it is applied here
+    objectLayer = int(object.material.z);
 }
 );
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+const GLchar* gpuCulledInputShaderSource = GLSL_SNIPPET(
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller tower) to the GPU
+    struct CullObject
+{
+    mat4 model;
+    mat3x4 normalMatrix; // Inverse transpose of the model matrix
+    vec4 sphere;
+    vec4 material; // xy UV scale, z texture array layer
+    uvec4 lod; // x first command, y detail levels, z current level
+};
 
-void main()
+layout(std430, binding = 0) readonly buffer ObjectBuffer
 {
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+    CullObject objects[];
+};
+
+// Visible objects, written by the culling pass; each command points baseInstance at its range
+layout(std430, binding = 2) readonly buffer VisibleBuffer
+{
+    uint visibleObjects[];
+};
+
+void loadObject(out mat4 objectModel, out mat3 objectNormalMatrix, out vec2 objectUvScale, out int objectLayer)
+{
+    CullObject object = objects[visibleObjects[gl_BaseInstanceARB + gl_InstanceID]];
+
+    objectModel = object.model;
+    objectNormalMatrix = mat3(object.normalMatrix);
+    objectUvScale = object.material.xy; // UV scale is per object, so it is applied here
+    objectLayer = int(object.material.z);
 }
 );
 
+const GLchar* const SHADER_INPUT_SOURCES[] = { nodeInputShaderSource, instancedInputShaderSource, indirectInputShaderSource, gpuCulledInputShaderSource };
+
 
+/* Culling Compute Shader Source Code*/
+const GLchar* cullComputeShaderSource = GLSL(440,
 
+    layout(local_size_x = 64) in; // GPU_CULL_GROUP_SIZE
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
+struct CullObject
 {
-    for (int j = 0; j < height / 2; ++j)
-    {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+    mat4 model;
+    mat3x4 normalMatrix; // Inverse transpose of the model matrix
+    vec4 sphere;
+    vec4 material;
+    uvec4 lod; // x first command, y detail levels, z current level
+};
 
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
-    }
-}
+struct DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
 
+layout(std430, binding = 0) buffer ObjectBuffer
+{
+    CullObject objects[];
+};
 
-int main(int argc, char* argv[])
+layout(std430, binding = 1) buffer CommandBuffer
 {
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
-
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
-
-    // Create the shader programs
-    if (!UCreateShaderProgram(towerVertexShaderSource, towerFragmentShaderSource, gProgramId))
-        return EXIT_FAILURE;
-
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
-
-    // Load texture
-    const char* glassOneFilename = "../../resources/textures/Glass.jpg";
-    const char* glassTwoFilename = "../../resources/textures/GlassTwo.jpg";
-    const char* groundFilename = "../../resources/textures/natural-stone-aged-paviment.jpg";
-    const char* skyFilename = "../../resources/textures/Sky3.jpg";
-    const char* bushFilename = "../../resources/textures/Bush.jpg";
-
-    if (!UCreateTexture(glassOneFilename, glassOneTextureId))
-    {
-        cout << "Failed to load texture " << glassOneFilename << endl;
-        return EXIT_FAILURE;
-    }
-
-    if (!UCreateTexture(glassTwoFilename, glassTwoTextureId))
-    {
-        cout << "Failed to load texture " << glassOneFilename << endl;
-        return EXIT_FAILURE;
-    }
-
-    if (!UCreateTexture(groundFilename, groundTextureId)) {
-        cout << "Failed to load texture " << groundFilename << endl;
-        system("PAUSE");
-        return EXIT_FAILURE;
-    }
-
-    if (!UCreateTexture(skyFilename, skyTextureId)) {
-        cout << "Failed to load texture " << skyFilename << endl;
-        system("PAUSE");
-        return EXIT_FAILURE;
-    }
-
-    if (!UCreateTexture(bushFilename, bushTextureId)) {
-        cout << "Failed to load texture " << bushFilename << endl;
-        system("PAUSE");
-        return EXIT_FAILURE;
-    }
-
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 0);
+    DrawCommand commands[];
+};
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+layout(std430, binding = 2) writeonly buffer VisibleBuffer
+{
+    uint visibleObjects[];
+};
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+uniform vec4 frustumPlanes[6]; // Normalized, inside when dot(xyz, p) + w >= 0
+uniform vec3 cameraPosition;
+uniform float projectionScale; // 0.5 * projection[1][1]
+uniform int perspective;
+uniform vec3 lodScreenSizes; // LOD_SCREEN_SIZES
+uniform float lodHysteresis;
+uniform uint objectCount;
+uniform int useCulling;
+
+// Previous frame's depth pyramid (see HiZBuffer) and the camera it was drawn with
+uniform int useOcclusion;
+uniform mat4 previousViewProjection;
+uniform ivec2 depthSize; // Framebuffer pixels
+uniform sampler2D hiZ;
+
+// True when the sphere's screen rectangle lies entirely behind the previous frame's depth. Spheres reaching
+// behind the camera are never occluded.
+bool isOccluded(vec4 sphere)
+{
+    vec2 rectMin = vec2(1.0);
+    vec2 rectMax = vec2(-1.0);
+    float nearest = 1.0;
+    for (int i = 0; i < 8; ++i)
     {
-        // per-frame timing
-        // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
-
-        // input
-        // -----
-        UProcessInput(gWindow);
-
-        // Render this frame
-        URender();
+        vec3 corner = sphere.xyz + sphere.w * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 clip = previousViewProjection * vec4(corner, 1.0);
+        if (clip.w <= 0.0)
+            return false;
 
-        glfwPollEvents();
+        vec3 ndc = clip.xyz / clip.w;
+        rectMin = min(rectMin, ndc.xy);
+        rectMax = max(rectMax, ndc.xy);
+        nearest = min(nearest, ndc.z);
     }
 
-    // Release mesh data
-    UDestroyMesh(gMesh);
+    // Pixels covered, then the level where they span at most 2x2 texels (a level l texel covers 2^(l + 1) pixels)
+    ivec2 pixelMin = clamp(ivec2((rectMin * 0.5 + 0.5) * vec2(depthSize)), ivec2(0), depthSize - 1);
+    ivec2 pixelMax = clamp(ivec2((rectMax * 0.5 + 0.5) * vec2(depthSize)), ivec2(0), depthSize - 1);
+    ivec2 span = pixelMax - pixelMin + 1;
+    int level = clamp(int(ceil(log2(float(max(span.x, span.y))))) - 1, 0, textureQueryLevels(hiZ) - 1);
 
-    // Release texture
-    UDestroyTexture(glassOneTextureId);
-    UDestroyTexture(glassTwoTextureId);
-    UDestroyTexture(groundTextureId);
-    UDestroyTexture(skyTextureId);
-    UDestroyTexture(bushTextureId);
-    
-    // Release shader programs
-    UDestroyShaderProgram(gProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    ivec2 levelMax = textureSize(hiZ, level) - 1;
+    ivec2 texelMin = min(pixelMin >> (level + 1), levelMax);
+    ivec2 texelMax = min(pixelMax >> (level + 1), levelMax);
+    float depth = max(max(texelFetch(hiZ, texelMin, level).r, texelFetch(hiZ, ivec2(texelMax.x, texelMin.y), level).r),
+        max(texelFetch(hiZ, ivec2(texelMin.x, texelMax.y), level).r, texelFetch(hiZ, texelMax, level).r));
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    return nearest * 0.5 + 0.5 > depth;
 }
 
-
-// Initialize GLFW, GLEW, and create a window
-bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+void main()
 {
-    // GLFW: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= objectCount)
+        return;
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-
-#endif
-
-    // GLFW: window creation
-    // ---------------------
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+    vec4 sphere = objects[index].sphere;
+    if (useCulling != 0)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return false;
+        for (int p = 0; p < 6; ++p)
+        {
+            if (dot(frustumPlanes[p].xyz, sphere.xyz) + frustumPlanes[p].w < -sphere.w)
+                return;
+        }
     }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
-
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-    // GLEW: initialize
-    // ----------------
-    // Note: if using GLEW version 1.13 or earlier
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
+    if (useOcclusion != 0 && isOccluded(sphere))
+        return;
 
-    if (GLEW_OK != GlewInitResult)
+    // Detail level from the projected radius, with the same hysteresis as USelectLods
+    uvec4 lod = objects[index].lod;
+    uint level = lod.z;
+    if (lod.y > 1u)
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
-        return false;
+        float size = projectionScale * sphere.w;
+        if (perspective != 0)
+            size /= max(distance(sphere.xyz, cameraPosition), 1e-4);
+
+        while (level + 1u < lod.y && size < lodScreenSizes[level] * (1.0 - lodHysteresis))
+            ++level;
+        while (level > 0u && size > lodScreenSizes[level - 1u] * (1.0 + lodHysteresis))
+            --level;
+        objects[index].lod.z = level;
     }
 
-    // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
-
-    return true;
+    // Append to the command of that level; its range of the visible list has room for every node of the command
+    uint command = lod.x + level;
+    uint slot = atomicAdd(commands[command].instanceCount, 1u);
+    visibleObjects[commands[command].baseInstance + slot] = index;
 }
+);
 
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
-{
-    static const float cameraSpeed = 2.5f;
+/* Hi-Z Reduction Compute Shader Source Code*/
+const GLchar* hiZComputeShaderSource = GLSL(440,
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    layout(local_size_x = 8, local_size_y = 8) in; // HIZ_GROUP_SIZE
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(UP, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
-        isPerspective = false;
-    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
-        isPerspective = true;
+uniform sampler2D source; // Depth copy for level 0, else the pyramid itself
+uniform int sourceLevel;
+layout(r32f) writeonly uniform image2D destination;
 
-    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
-    {
-        gUVScale += 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+void main()
+{
+    ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 size = imageSize(destination);
+    if (texel.x >= size.x || texel.y >= size.y)
+        return;
+
+    // Farthest of the 2x2 source texels; the last row and column also take the odd texel left over
+    ivec2 sourceMax = textureSize(source, sourceLevel) - 1;
+    ivec2 first = texel * 2;
+    ivec2 last = ivec2(texel.x == size.x - 1 ? sourceMax.x : first.x + 1, texel.y == size.y - 1 ? sourceMax.y : first.y + 1);
+
+    float depth = 0.0;
+    for (int y = first.y; y <= last.y; ++y)
     {
-        gUVScale -= 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+        for (int x = first.x; x <= last.x; ++x)
+            depth = max(depth, texelFetch(source, ivec2(x, y), sourceLevel).r);
     }
 
+    imageStore(destination, texel, vec4(depth));
 }
+);
 
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
-}
+/* Light Assignment Compute Shader Source Code: after the CLUSTER_* defines built by UCreateLightClusters*/
+const GLchar* lightClusterComputeShaderSource = GLSL_SNIPPET(
 
+    layout(local_size_x = CLUSTER_GROUP_SIZE) in;
 
-// glfw: whenever the mouse moves, this callback is called
-// -------------------------------------------------------
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+struct PointLight
 {
-    if (gFirstMouse)
-    {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
-    }
+    vec4 positionRange;
+    vec4 color;
+};
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+layout(std430, binding = 3) readonly buffer LightBuffer
+{
+    PointLight lights[];
+};
 
-    gLastX = xpos;
-    gLastY = ypos;
+layout(std430, binding = 4) writeonly buffer LightGridBuffer
+{
+    uvec2 lightGrid[];
+};
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
-}
+layout(std430, binding = 5) writeonly buffer LightIndexBuffer
+{
+    uint lightIndices[];
+};
 
+uniform mat4 view;
+uniform mat4 inverseProjection;
+uniform int perspective;
+uniform uint lightCount;
 
-// glfw: whenever the mouse scroll wheel scrolls, this callback is called
-// ----------------------------------------------------------------------
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+const ivec3 clusterCount = ivec3(CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+const uint maxLights = uint(CLUSTER_MAX_LIGHTS);
+const float depthNear = float(CLUSTER_NEAR);
+const float depthFar = float(CLUSTER_FAR);
+
+// View-space point at the given depth along the view ray through ndc (parallel rays in orthographic projection)
+vec3 pointAtDepth(vec2 ndc, float depth)
 {
-    gCamera.ProcessMouseScroll(yoffset);
+    vec4 nearPoint = inverseProjection * vec4(ndc, -1.0, 1.0);
+    nearPoint.xyz /= nearPoint.w;
+    return perspective != 0 ? nearPoint.xyz * (depth / -nearPoint.z) : vec3(nearPoint.xy, -depth);
 }
 
-// glfw: handle mouse button events
-// --------------------------------
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+void main()
 {
-    switch (button)
-    {
-    case GLFW_MOUSE_BUTTON_LEFT:
-    {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
-    }
-    break;
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= uint(clusterCount.x * clusterCount.y * clusterCount.z))
+        return;
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
+    ivec3 cluster = ivec3(int(index) % clusterCount.x, (int(index) / clusterCount.x) % clusterCount.y, int(index) / (clusterCount.x * clusterCount.y));
+
+    // View-space box around the cluster's corners
+    vec2 ndcMin = vec2(cluster.xy) / vec2(clusterCount.xy) * 2.0 - 1.0;
+    vec2 ndcMax = vec2(cluster.xy + 1) / vec2(clusterCount.xy) * 2.0 - 1.0;
+    float sliceNear = depthNear * pow(depthFar / depthNear, float(cluster.z) / float(clusterCount.z));
+    float sliceFar = depthNear * pow(depthFar / depthNear, float(cluster.z + 1) / float(clusterCount.z));
+
+    vec3 boxMin = vec3(1e30);
+    vec3 boxMax = vec3(-1e30);
+    for (int i = 0; i < 4; ++i)
     {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
+        vec2 corner = vec2((i & 1) != 0 ? ndcMax.x : ndcMin.x, (i & 2) != 0 ? ndcMax.y : ndcMin.y);
+        vec3 nearCorner = pointAtDepth(corner, sliceNear);
+        vec3 farCorner = pointAtDepth(corner, sliceFar);
+        boxMin = min(boxMin, min(nearCorner, farCorner));
+        boxMax = max(boxMax, max(nearCorner, farCorner));
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
+    // Lights whose range sphere touches the box
+    uint first = index * maxLights;
+    uint count = 0u;
+    for (uint l = 0u; l < lightCount && count < maxLights; ++l)
     {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
+        vec3 center = (view * vec4(lights[l].positionRange.xyz, 1.0)).xyz;
+        vec3 offset = clamp(center, boxMin, boxMax) - center;
+        if (dot(offset, offset) <= lights[l].positionRange.w * lights[l].positionRange.w)
+            lightIndices[first + count++] = l;
     }
-    break;
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
-    }
+    lightGrid[index] = uvec2(first, count);
 }
+);
 
 
-// Functioned called to render a frame
-void URender()
-{
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
+/* Surface Shader Source Code: tower fragment inputs and the surface color, for the forward and G-buffer variants*/
+const GLchar* surfaceShaderSource = GLSL_SNIPPET(
 
-    // Clear the frame and z buffers
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+in vec2 vertexTextureCoordinate;
+flat in int vertexTextureLayer;
 
+uniform vec3 objectColor; // Surface color of untextured variants
+uniform sampler2DArray uTexture; // Material textures; the layer comes from the vertex shader
+uniform vec2 uvScale;
 
-    // GROUND: draw ground
-    // Activate the ground VAO 
-    glBindVertexArray(gMesh.vao[0]);
+vec3 surfaceColor()
+{
+    // TEXTURED is a compile-time constant, so each variant keeps one side of the branch
+    if (TEXTURED == 0)
+        return objectColor;
 
-    //----------------
-    // Set the shader to be used
-    glUseProgram(gProgramId);
+    // Texture holds the color to be used for all three components
+    return texture(uTexture, vec3(vertexTextureCoordinate * uvScale, vertexTextureLayer)).rgb;
+}
+);
 
-    // Model matrix: transformations are applied right-to-left order
-    glm::mat4 model = glm::translate(gGroundPosition) * glm::scale(gGroundScale);
 
-    // camera/view transformation
-    glm::mat4 view = gCamera.GetViewMatrix();
+/* Lighting Shader Source Code: the lighting model, shared by the forward and deferred lighting variants*/
+const GLchar* lightingShaderSource = GLSL_SNIPPET(
 
-    // Creates a projection
-    glm::mat4 projection;
+    // Uniform / Global variables for light color, light position, and camera/view position
+    uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPosition;
+uniform float ambientStrength; // Ambient or global lighting strength
+uniform float specularIntensity; // Specular light strength
+uniform float highlightSize; // Specular highlight size
 
-    // Check for isPerspective / Toggle with P/O for Perspective, Ortho 
-    if (isPerspective) {
-        projection = glm::perspective(glm::radians(gCamera.Zoom),
-            (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-    }
-    else {
-        projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, 0.1f, 100.0f);
-    }
+// Point lights, and the lights reaching each cluster (see LightClusters)
+struct PointLight
+{
+    vec4 positionRange;
+    vec4 color;
+};
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gProgramId, "projection");
+layout(std430, binding = 3) readonly buffer LightBuffer
+{
+    PointLight lights[];
+};
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+layout(std430, binding = 4) readonly buffer LightGridBuffer
+{
+    uvec2 lightGrid[]; // First index, count
+};
 
-    // Reference matrix uniforms from the tower Shader program for the cub color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
+layout(std430, binding = 5) readonly buffer LightIndexBuffer
+{
+    uint lightIndices[];
+};
 
-    // Pass color, light, and camera data to the tower Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+uniform mat4 view;
+uniform vec4 clusterScale;
+uniform ivec3 clusterCount;
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    //glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr((gGROUNDUVScale)));
+// Specular factor of one light. Phong reflects the light direction; Blinn-Phong uses the half vector, with four
+// times the exponent for a highlight of about the same size.
+float specularTerm(vec3 norm, vec3 lightDirection, vec3 viewDir)
+{
+    if (LIGHTING_MODEL == LIGHTING_BLINN_PHONG)
+        return pow(max(dot(norm, normalize(lightDirection + viewDir)), 0.0), highlightSize * 4.0);
 
-    // bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, groundTextureId);
+    return pow(max(dot(viewDir, reflect(-lightDirection, norm)), 0.0), highlightSize);
+}
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[0]);
-
-    // Draw the Sky
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr((gSKYUVScale)));
-    model = glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f)) * glm::translate(glm::vec3(0.0f, -2.7f, -2.7f)) * 
-        glm::scale(glm::vec3(1.0f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Activate the VAO 
-    glBindVertexArray(gMesh.vao[6]);
-    glBindTexture(GL_TEXTURE_2D, skyTextureId);
-    glActiveTexture(GL_TEXTURE0);
-
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[6]);
+// Lights a surface point. LIGHTING_MODEL and POINT_LIGHTS are compile-time constants, so the branches below are
+// resolved when the variant is compiled.
+vec3 shade(vec3 fragmentPos, vec3 norm, vec3 color)
+{
+    if (LIGHTING_MODEL == LIGHTING_UNLIT)
+        return color;
 
-    
-    //TOWER: draw Tower Skinny 
-    //gTexWrapMode = GL_REPEAT;
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr((gUVScale)));
-    model = glm::translate(glm::vec3(1.6f, 1.5f, -2.2f)) * glm::scale(glm::vec3(0.4f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[2]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassOneTextureId);
+    //Calculate Ambient lighting*/
+    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[2]);
+    //Calculate Diffuse lighting*/
+    vec3 lightDirection = normalize(lightPos - fragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on tower
+    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+    vec3 diffuse = impact * lightColor; // Generate diffuse light color
 
-    //TOWER: draw Tower Wide 
-    model = glm::translate(glm::vec3(0.8f, 1.58f, -2.2f)) * glm::scale(glm::vec3(0.75f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    //Calculate Specular lighting*/
+    vec3 viewDir = normalize(viewPosition - fragmentPos); // Calculate view direction
+    vec3 specular = specularIntensity * specularTerm(norm, lightDirection, viewDir) * lightColor;
 
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[1]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassTwoTextureId);
+    // Point lights of this fragment's cluster, with the same diffuse and specular terms, fading out at their range
+    if (POINT_LIGHTS != 0)
+    {
+        float viewDepth = -(view * vec4(fragmentPos, 1.0)).z;
+        ivec3 cluster = ivec3(ivec2(gl_FragCoord.xy * clusterScale.xy), int(floor(log(max(viewDepth, 1e-4)) * clusterScale.z + clusterScale.w)));
+        cluster = clamp(cluster, ivec3(0), clusterCount - 1);
+        uvec2 lightRange = lightGrid[(cluster.z * clusterCount.y + cluster.y) * clusterCount.x + cluster.x];
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[1]);
+        for (uint i = 0u; i < lightRange.y; ++i)
+        {
+            PointLight light = lights[lightIndices[lightRange.x + i]];
+            vec3 toLight = light.positionRange.xyz - fragmentPos;
+            float distanceSquared = dot(toLight, toLight);
+            float fade = max(1.0 - distanceSquared / (light.positionRange.w * light.positionRange.w), 0.0);
+            vec3 pointDirection = toLight * inversesqrt(max(distanceSquared, 1e-8));
+
+            vec3 radiance = light.color.rgb * (fade * fade);
+            diffuse += max(dot(norm, pointDirection), 0.0) * radiance;
+            specular += specularIntensity * specularTerm(norm, pointDirection, viewDir) * radiance;
+        }
+    }
 
-    //TOWER: draw Tall Tower Skinny (1)
-    model = glm::translate(glm::vec3(-0.6f, 2.3f, -2.2f)) * glm::scale(glm::vec3(0.4f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    // Calculate phong result
+    return (ambient + diffuse + specular) * color;
+}
+);
 
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[3]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassOneTextureId);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[3]);
+/* Tower Fragment Shader Source Code: forward variants, after the surface and lighting snippets*/
+const GLchar* towerFragmentShaderSource = GLSL_SNIPPET(
 
-    //TOWER: draw Tall Tower Skinny (2)
-    model = glm::translate(glm::vec3(0.1f, 2.1f, -2.2f)) * glm::scale(glm::vec3(0.37f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    out vec4 fragmentColor; // For outgoing tower color to the GPU
 
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[3]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassOneTextureId);
+void main()
+{
+    fragmentColor = vec4(shade(vertexFragmentPos, normalize(vertexNormal), surfaceColor()), 1.0); // Send lighting results to GPU
+}
+);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[3]);
 
+/* G-Buffer Fragment Shader Source Code: after the surface snippet*/
+const GLchar* geometryFragmentShaderSource = GLSL_SNIPPET(
 
-    //TOWER: draw Tower Cap 
-    model = glm::translate(glm::vec3(-1.4f, 1.50f, -2.2f)) * glm::scale(glm::vec3(0.40f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
 
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[4]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassTwoTextureId);
+// Octahedral encoding: the unit sphere folded onto a square, two components at any precision
+vec2 encodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+}
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[4]);
+void main()
+{
+    gAlbedo = vec4(surfaceColor(), 1.0);
+    gNormal = encodeNormal(normalize(vertexNormal));
+}
+);
 
-    //TOWER: draw Tower Small (1)
-    model = glm::translate(glm::vec3(-1.0f, 0.45f, -2.4f)) * glm::scale(glm::vec3(0.30f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[5]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassTwoTextureId);
+/* Depth Pre-Pass Fragment Shader Source Code*/
+const GLchar* depthFragmentShaderSource = GLSL_SNIPPET(
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[5]);
+    void main()
+{
+    // Depth only: the rasterizer writes the depth, color writes are masked off
+}
+);
 
-    //TOWER: draw Tower Small (2)
-    model = glm::translate(glm::vec3(-0.27f, 0.21f, -2.5f)) * glm::scale(glm::vec3(0.20f));
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
-    // Activate the Tower VAO 
-    glBindVertexArray(gMesh.vao[5]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, glassTwoTextureId);
+/* Deferred Lighting Shader Source Code*/
+const GLchar* deferredLightingVertexShaderSource = GLSL_SNIPPET(
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[5]);
+    void main()
+{
+    // One triangle covering the screen: (-1, -1), (3, -1), (-1, 3)
+    vec2 corner = vec2((gl_VertexID & 1) != 0 ? 3.0 : -1.0, (gl_VertexID & 2) != 0 ? 3.0 : -1.0);
+    gl_Position = vec4(corner, 0.0, 1.0);
+}
+);
 
+// After the lighting snippet
+const GLchar* deferredLightingFragmentShaderSource = GLSL_SNIPPET(
 
-    //TOWER: draw Bush (1)
-    model = glm::translate(glm::vec3(-0.7f, -0.3f, 1.0f)) * glm::scale(gBushScale);
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    out vec4 fragmentColor;
 
-    // Activate the Bush VAO 
-    glBindVertexArray(gMesh.vao[7]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bushTextureId);
+// G-buffer written by the geometry pass
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform mat4 inverseViewProjection;
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+vec3 decodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    n.xy = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signs;
+    return normalize(n);
+}
 
-    //TOWER: draw Bush (2)
-    model = glm::translate(glm::vec3(-0.9f, -0.3f, 0.3f)) * glm::scale(gBushScale);
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0)
+        discard; // Nothing drawn here; the frame keeps its clear color
+
+    // World position from the pixel and its depth
+    vec4 world = inverseViewProjection * vec4(gl_FragCoord.xy / vec2(textureSize(gDepth, 0)) * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec3 fragmentPos = world.xyz / world.w;
+    vec3 norm = decodeNormal(texelFetch(gNormal, pixel, 0).xy);
+
+    fragmentColor = vec4(shade(fragmentPos, norm, texelFetch(gAlbedo, pixel, 0).rgb), 1.0);
+    gl_FragDepth = depth; // Later passes (Hi-Z, overlays) see the scene depth
+}
+);
 
-    // Activate the Bush VAO 
-    glBindVertexArray(gMesh.vao[7]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bushTextureId);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+/* Lamp Shader Source Code*/
+const GLchar* lampVertexShaderSource = GLSL(440,
 
-    //TOWER: draw Bush (3)
-    model = glm::translate(glm::vec3(0.7f, -0.3f, 1.0f)) * glm::scale(gBushScale);
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
 
-    // Activate the Bush VAO 
-    glBindVertexArray(gMesh.vao[7]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bushTextureId);
+//Uniform / Global variables for the  transform matrices
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+}
+);
 
-    //TOWER: draw Bush (4)
-    model = glm::translate(glm::vec3(0.9f, -0.3f, 0.3f)) * glm::scale(gBushScale);
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
 
-    // Activate the Bush VAO 
-    glBindVertexArray(gMesh.vao[7]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bushTextureId);
+    out vec4 fragmentColor; // For outgoing lamp color (smaller tower) to the GPU
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+void main()
+{
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+}
+);
 
-    //TOWER: draw Bush (5)
-    model = glm::translate(glm::vec3(-0.5f, -0.3f, 1.7f)) * glm::scale(gBushScale);
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
-    // Activate the Bush VAO 
-    glBindVertexArray(gMesh.vao[7]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bushTextureId);
+/* Profiler Overlay Shader Source Code*/
+const GLchar* overlayVertexShaderSource = GLSL(440,
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+    layout(location = 0) in vec2 position; // Corner of the unit quad
 
-    //TOWER: draw Bush (6)
-    model = glm::translate(glm::vec3(0.5f, -0.3f, 1.7f)) * glm::scale(gBushScale);
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+uniform vec4 rect; // x, y, width, height in normalized device coordinates
 
-    // Activate the Bush VAO 
-    glBindVertexArray(gMesh.vao[7]);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bushTextureId);
+void main()
+{
+    gl_Position = vec4(rect.xy + position * rect.zw, 0.0f, 1.0f);
+}
+);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+const GLchar* overlayFragmentShaderSource = GLSL(440,
 
-    
-    glUseProgram(gLampProgramId);
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+    out vec4 fragmentColor;
 
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+uniform vec3 objectColor;
 
-    // Draws the triangles
-    //glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices[7]);
+void main()
+{
+    fragmentColor = vec4(objectColor, 1.0f);
+}
+);
 
-    // Deactivate the Vertex Array Object and shader program
-    glBindVertexArray(0);
-    glUseProgram(0);
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
-}
 
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh& mesh)
+int main(int argc, char* argv[])
 {
+    // Texture source images
+    const char* glassOneFilename = "../../resources/textures/Glass.jpg";
+    const char* glassTwoFilename = "../../resources/textures/GlassTwo.jpg";
+    const char* groundFilename = "../../resources/textures/natural-stone-aged-paviment.jpg";
+    const char* skyFilename = "../../resources/textures/Sky3.jpg";
+    const char* bushFilename = "../../resources/textures/Bush.jpg";
 
-    // Ground
-    GLfloat groundVerts[] = {
-    //Positions          //Normals         //Texture Coords.
-    // ------------------------------------------------------
-    -1.0f, -0.1f, 1.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
-    1.0f, -0.1f, -1.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
-    -1.0f, -0.1f, -1.0f, 0.0f, 1.0f, 0.0f,  0.0f, 1.0f,
-    -1.0f, -0.1f, 1.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
-    1.0f, -0.1f, -1.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
-    1.0f, -0.1f, 1.0f,   0.0f, 1.0f, 0.0f,  1.0f, 0.0f
-    };
+    // Command line: every flag is read in this one loop, and unknown arguments or invalid values stop the program
+    bool cook = false;
+    const char* benchPathFilename = nullptr;
+    bool benchFramesGiven = false;
+    const char* traceFilename = nullptr;
+    std::vector<const char*> meshFiles;
+    gBench.nFrames = BENCH_DEFAULT_FRAMES;
+    gBench.stressSeed = 1;
+    gMeshArena.format = VERTEX_FORMAT_COMPACT;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* flag = argv[i];
+        const bool hasValue = i + 1 < argc;
+        // Optional values are only taken when the next argument is not another flag
+        const bool hasOptionalValue = hasValue && strncmp(argv[i + 1], "--", 2) != 0;
+        bool valid = true;
+
+        // Offline step (--cook): compress every texture with its mip chain into the texture cache, then exit
+        if (strcmp(flag, "--cook") == 0)
+        {
+            cook = true;
+        }
+        // Headless benchmark (--bench [frames] [--bench-path file]): renders offscreen along a camera path and reports timings.
+        // --stress [count,count,...] [--seed n] [--stress-out file.csv] sweeps generated scenes over every render path instead.
+        else if (strcmp(flag, "--bench") == 0)
+        {
+            gBench.enabled = true;
+            if (hasOptionalValue)
+            {
+                valid = UParseInt(argv[++i], 1, gBench.nFrames);
+                benchFramesGiven = true;
+            }
+        }
+        else if (strcmp(flag, "--bench-path") == 0 && hasValue)
+        {
+            benchPathFilename = argv[++i];
+        }
+        else if (strcmp(flag, "--stress") == 0)
+        {
+            gBench.enabled = true;
+            if (hasOptionalValue)
+                valid = UParseCountList(argv[++i], gBench.stressCounts);
+            else
+                gBench.stressCounts.assign(STRESS_DEFAULT_COUNTS, STRESS_DEFAULT_COUNTS + sizeof(STRESS_DEFAULT_COUNTS) / sizeof(STRESS_DEFAULT_COUNTS[0]));
+        }
+        else if (strcmp(flag, "--seed") == 0 && hasValue)
+        {
+            int seed = 0;
+            valid = UParseInt(argv[++i], 0, seed);
+            gBench.stressSeed = (unsigned int)seed;
+        }
+        else if (strcmp(flag, "--stress-out") == 0 && hasValue)
+        {
+            gBench.stressOutFilename = argv[++i];
+        }
+        // Vertex layout of the meshes (--vertex-format compact|float)
+        else if (strcmp(flag, "--vertex-format") == 0 && hasValue)
+        {
+            const char* format = argv[++i];
+            if (strcmp(format, "float") == 0)
+                gMeshArena.format = VERTEX_FORMAT_FLOAT;
+            else if (strcmp(format, "compact") == 0)
+                gMeshArena.format = VERTEX_FORMAT_COMPACT;
+            else
+                valid = false;
+        }
+        // Extra meshes to import and show next to the towers (--mesh file, repeatable)
+        else if (strcmp(flag, "--mesh") == 0 && hasValue)
+        {
+            meshFiles.push_back(argv[++i]);
+        }
+        else if (strcmp(flag, "--mesh-report") == 0)
+        {
+            gMeshReport = true;
+        }
+        // Point lights scattered around the scene (--lights n), shaded through the light clusters
+        else if (strcmp(flag, "--lights") == 0 && hasValue)
+        {
+            valid = UParseInt(argv[++i], 0, gLightCount);
+        }
+        // Start with deferred shading (--deferred), so the benchmark can compare it with forward shading
+        else if (strcmp(flag, "--deferred") == 0)
+        {
+            gShadingMode = SHADING_DEFERRED;
+        }
+        // Start with the depth pre-pass (--depth-prepass), so the benchmark can measure what it saves
+        else if (strcmp(flag, "--depth-prepass") == 0)
+        {
+            gDepthPrepass = true;
+        }
+        // Start with another lighting model (--lighting phong|blinn-phong|unlit) or without textures (--untextured)
+        else if (strcmp(flag, "--lighting") == 0 && hasValue)
+        {
+            const char* name = argv[++i];
+            valid = false;
+            for (int model = 0; model < LIGHTING_MODEL_COUNT; ++model)
+            {
+                if (strcmp(name, LIGHTING_MODEL_NAMES[model]) == 0)
+                {
+                    gLightingModel = (LightingModel)model;
+                    valid = true;
+                }
+            }
+        }
+        else if (strcmp(flag, "--untextured") == 0)
+        {
+            gTextured = false;
+        }
+        // Frame profiler trace (--trace frames.csv or --trace frames.json)
+        else if (strcmp(flag, "--trace") == 0 && hasValue)
+        {
+            traceFilename = argv[++i];
+        }
+        else
+        {
+            cout << "Unknown argument or missing value: " << flag << endl;
+            return EXIT_FAILURE;
+        }
 
-    // Sky
-    GLfloat skyVerts[] = {
-        //Positions          //Normals         //Texture Coords.
-        // ------------------------------------------------------
-        -3.0f, -0.3f, 3.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
-        3.0f, -0.3f, -3.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
-        -3.0f, -0.3f, -3.0f, 0.0f, 1.0f, 0.0f,  0.0f, 1.0f,
-        -3.0f, -0.3f, 3.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
-        3.0f, -0.3f, -3.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
-        3.0f, -0.3f, 3.0f,   0.0f, 1.0f, 0.0f,  1.0f, 0.0f
-    };
+        if (!valid)
+        {
+            cout << "Invalid value " << argv[i] << " for " << flag << endl;
+            return EXIT_FAILURE;
+        }
+    }
 
-    // Tower Tall Wide  
-    GLfloat towerWideVerts[] = {
-    //Positions          //Normals         //Texture Coords.
-    // ------------------------------------------------------
-    //Back Face          //Negative Z Normal 
-    -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-    0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-    0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-    0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-    -0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-    -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    if (cook)
+    {
+        const char* filenames[] = { glassOneFilename, glassTwoFilename, groundFilename, skyFilename, bushFilename };
 
-    //Front Face         //Positive Z Normal
-    -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-    0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-    0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-    0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-    -0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-    -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+        bool cooked = true;
+        for (const char* filename : filenames)
+            cooked = UCookTexture(filename) && cooked;
 
-    //Left Face           //Negative X Normal
-     -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-     -0.5f,  2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-     -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-     -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-     -0.5f, -2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-     -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        return cooked ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    //Right Face         //Positive X Normal
-     0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-     0.5f,  2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-     0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-     0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-     0.5f, -2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-     0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    if (!gBench.stressCounts.empty() && !benchFramesGiven)
+        gBench.nFrames = STRESS_DEFAULT_FRAMES;
 
-    //Bottom Face        //Negative Y Normal
-    -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-     0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-     0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-     0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-    -0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+    if (benchPathFilename)
+    {
+        if (!ULoadCameraPath(benchPathFilename, gBench.path))
+            return EXIT_FAILURE;
+    }
+    else
+    {
+        gBench.path.assign(gDefaultCameraPath, gDefaultCameraPath + sizeof(gDefaultCameraPath) / sizeof(gDefaultCameraPath[0]));
+    }
 
-    //Top Face           //Positive Y Normal
-   -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-    0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-    0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-    0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-   -0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-   -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-    };
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
 
-    // Tower Skinny 
-    GLfloat towerSkinnyVerts[] = {
-        //Positions          //Normals         //Texture Coords.
-        // ------------------------------------------------------
-        //Back Face          //Negative Z Normal 
-        -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-        0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-        0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        -0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-        -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    // Create the mesh
+    UCreateMesh(gMeshArena, meshFiles); // Calls the function to create the Vertex Buffer Object
 
-        //Front Face         //Positive Z Normal
-        -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-        0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-        0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-        0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-        -0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-        -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+    // Build the scene graph and upload the per-instance transforms for the repeated objects
+    UCreateScene(gScene, gMeshArena);
+    UCreateInstances(gMeshArena, gScene);
 
-        //Left Face           //Negative X Normal
-         -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-         -0.5f,  4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-         -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-         -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-         -0.5f, -4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-         -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    // Create the shader programs. Scene variants are compiled on first use; building the default one here
+    // still fails startup on a broken shader.
+    if (UGetSceneProgram(SHADER_INPUT_NODE, SHADER_OUTPUT_FORWARD) == nullptr)
+        return EXIT_FAILURE;
 
-         //Right Face         //Positive X Normal
-          0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-          0.5f,  4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-          0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-          0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-          0.5f, -4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgram))
+        return EXIT_FAILURE;
+
+    if (!UCreateShaderProgram(overlayVertexShaderSource, overlayFragmentShaderSource, gOverlayProgram))
+        return EXIT_FAILURE;
+
+    if (!UCreateLightClusters(gLightClusters))
+        return EXIT_FAILURE;
+
+    // Deferred shading: the G-buffer; its geometry and lighting variants come from the variant cache
+    UCreateGBuffer(gGBuffer);
+
+    // Frame profiler, optionally writing every frame to a trace file
+    if (!UCreateProfiler(gProfiler, traceFilename))
+        return EXIT_FAILURE;
+
+    // The indirect path reads gl_BaseInstanceARB; without it the render queue paths are used
+    gIndirectSupported = GLEW_ARB_shader_draw_parameters &&
+        UGetSceneProgram(SHADER_INPUT_INDIRECT, SHADER_OUTPUT_FORWARD) != nullptr;
+    if (!gIndirectSupported)
+        cout << "INFO: GL_ARB_shader_draw_parameters unavailable, multi-draw indirect path disabled" << endl;
+
+    // The GPU-culled path draws with the same extension, from the buffers the culling compute shader fills
+    gGpuCullingSupported = gIndirectSupported &&
+        UGetSceneProgram(SHADER_INPUT_GPU_CULLED, SHADER_OUTPUT_FORWARD) != nullptr &&
+        UCreateGpuCulling(gGpuCulling) && UCreateHiZ(gHiZ);
+    if (gIndirectSupported && !gGpuCullingSupported)
+        cout << "INFO: culling compute shader unavailable, GPU-culled path disabled" << endl;
+
+    // Load texture: decoding happens on worker threads, so each call returns a placeholder layer right away
+    UCreateTextureArrays(gMaterialTextures, MATERIAL_COUNT);
+    UCreateTextureLoader(gTextureLoader);
+
+    if (!UCreateTexture(glassOneFilename, glassOneTextureId))
+    {
+        cout << "Failed to load texture " << glassOneFilename << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!UCreateTexture(glassTwoFilename, glassTwoTextureId))
+    {
+        cout << "Failed to load texture " << glassOneFilename << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!UCreateTexture(groundFilename, groundTextureId)) {
+        cout << "Failed to load texture " << groundFilename << endl;
+        system("PAUSE");
+        return EXIT_FAILURE;
+    }
+
+    if (!UCreateTexture(skyFilename, skyTextureId)) {
+        cout << "Failed to load texture " << skyFilename << endl;
+        system("PAUSE");
+        return EXIT_FAILURE;
+    }
+
+    if (!UCreateTexture(bushFilename, bushTextureId)) {
+        cout << "Failed to load texture " << bushFilename << endl;
+        system("PAUSE");
+        return EXIT_FAILURE;
+    }
+
+    // Materials pair each loaded texture with the UV scale it is drawn with
+    gMaterials[MATERIAL_GROUND] = { groundTextureId, &gGROUNDUVScale };
+    gMaterials[MATERIAL_SKY] = { skyTextureId, &gSKYUVScale };
+    gMaterials[MATERIAL_GLASS_ONE] = { glassOneTextureId, &gUVScale };
+    gMaterials[MATERIAL_GLASS_TWO] = { glassTwoTextureId, &gUVScale };
+    gMaterials[MATERIAL_BUSH] = { bushTextureId, &gUVScale };
+
+    // The scene variants point their samplers at their texture units when they are compiled
+    if (gIndirectSupported)
+    {
+        // Build the indirect commands once the materials know their textures
+        UCreateIndirectDraws(gIndirectDraws);
+        UBuildIndirectDraws(gIndirectDraws, gScene, gMeshArena);
+    }
+    if (gGpuCullingSupported)
+    {
+        UBuildGpuCulling(gGpuCulling, gScene, gMeshArena);
+    }
+
+    // Sets the background color of the window to black (it will be implicitely used by glClear)
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    int exitCode = EXIT_SUCCESS;
+    if (gBench.enabled && !URunBenchmark(gBench))
+        exitCode = EXIT_FAILURE;
+
+    // render loop
+    // -----------
+    while (!gBench.enabled && !glfwWindowShouldClose(gWindow))
+    {
+        // per-frame timing
+        // --------------------
+        float currentFrame = glfwGetTime();
+        gDeltaTime = currentFrame - gLastFrame;
+        gLastFrame = currentFrame;
+
+        UBeginProfilerFrame(gProfiler);
+
+        // input
+        // -----
+        UProcessInput(gWindow);
+
+        // Stream any textures the workers have finished decoding
+        int streamingScope = UBeginProfileScope(gProfiler, "texture streaming");
+        UUpdateTextureLoader(gTextureLoader, gMaterialTextures);
+        UEndProfileScope(gProfiler, streamingScope);
+
+        // Render this frame
+        URender();
+
+        UEndProfilerFrame(gProfiler, gWindow);
+
+        glfwPollEvents();
+    }
+
+    // Release mesh data
+    UDestroyMesh(gMeshArena);
+
+    // Release texture
+    UDestroyTextureLoader(gTextureLoader);
+    UDestroyTextureArrays(gMaterialTextures);
+    
+    // Release shader programs
+    UDestroyShaderVariants(gShaderVariants);
+    UDestroyGBuffer(gGBuffer);
+    if (gIndirectSupported)
+    {
+        UDestroyIndirectDraws(gIndirectDraws);
+    }
+    if (gGpuCullingSupported)
+    {
+        UDestroyGpuCulling(gGpuCulling);
+        UDestroyHiZ(gHiZ);
+    }
+    UDestroyShaderProgram(gLampProgram);
+    UDestroyShaderProgram(gOverlayProgram);
+    UDestroyLightClusters(gLightClusters);
+
+    // Release the profiler (closes the trace file)
+    UDestroyProfiler(gProfiler);
+
+    exit(exitCode); // Terminates the program successfully
+}
+
+
+// Initialize GLFW, GLEW, and create a window
+bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+{
+    // GLFW: initialize and configure
+    // ------------------------------
+#if defined(GLFW_PLATFORM_NULL) && defined(__linux__)
+    // Without a display server the benchmark runs on GLFW's null platform (OSMesa context below)
+    if (gBench.enabled && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY"))
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+
+#endif
+
+    // GLFW: window creation
+    // ---------------------
+    // The benchmark renders offscreen, so its window only provides the context and stays hidden
+    if (gBench.enabled)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+#ifdef GLFW_OSMESA_CONTEXT_API
+    // No usable GPU context (e.g. a CI box): fall back to Mesa's software renderer through OSMesa
+    if (*window == NULL && gBench.enabled)
+    {
+        cout << "INFO: No native OpenGL context, retrying with OSMesa" << endl;
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+        *window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    }
+#endif
+    if (*window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(*window);
+    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+    glfwSetCursorPosCallback(*window, UMousePositionCallback);
+    glfwSetScrollCallback(*window, UMouseScrollCallback);
+    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+
+    // tell GLFW to capture our mouse
+    if (!gBench.enabled)
+        glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    // GLEW: initialize
+    // ----------------
+    // Note: if using GLEW version 1.13 or earlier
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLX-built GLEW reports this under OSMesa after the core entry points are already loaded
+    if (GlewInitResult == GLEW_ERROR_NO_GLX_DISPLAY && gBench.enabled)
+        GlewInitResult = GLEW_OK;
+#endif
+
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    // Displays GPU OpenGL version
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+
+    return true;
+}
+
+
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+void UProcessInput(GLFWwindow* window)
+{
+    static const float cameraSpeed = 2.5f;
+
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(UP, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
+        isPerspective = false;
+    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
+        isPerspective = true;
+    if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS)
+        gRenderPath = RENDER_PATH_INSTANCED;
+    if (glfwGetKey(window, GLFW_KEY_U) == GLFW_PRESS)
+        gRenderPath = RENDER_PATH_NAIVE;
+    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS && gIndirectSupported)
+        gRenderPath = RENDER_PATH_INDIRECT;
+    if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS && gGpuCullingSupported)
+        gRenderPath = RENDER_PATH_GPU_CULLED;
+    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS)
+        gUseCulling = true;
+    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS)
+        gUseCulling = false;
+    if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS)
+        gShadingMode = SHADING_FORWARD;
+    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS)
+        gShadingMode = SHADING_DEFERRED;
+    if (glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS)
+        gUseOcclusion = true;
+    if (glfwGetKey(window, GLFW_KEY_X) == GLFW_PRESS)
+        gUseOcclusion = false;
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS)
+        gDepthPrepass = true;
+    if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS)
+        gDepthPrepass = false;
+    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
+        gLightingModel = LIGHTING_PHONG;
+    if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
+        gLightingModel = LIGHTING_BLINN_PHONG;
+    if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS)
+        gLightingModel = LIGHTING_UNLIT;
+    if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS)
+        gTextured = true;
+    if (glfwGetKey(window, GLFW_KEY_Y) == GLFW_PRESS)
+        gTextured = false;
+    if (glfwGetKey(window, GLFW_KEY_F1) == GLFW_PRESS)
+        gProfiler.showOverlay = true;
+    if (glfwGetKey(window, GLFW_KEY_F2) == GLFW_PRESS)
+        gProfiler.showOverlay = false;
+
+    // F5 prints the camera pose as a --bench-path line, for recording benchmark paths
+    static bool recordKeyDown = false;
+    bool recordKey = glfwGetKey(window, GLFW_KEY_F5) == GLFW_PRESS;
+    if (recordKey && !recordKeyDown)
+    {
+        cout << gCamera.Position.x << " " << gCamera.Position.y << " " << gCamera.Position.z << " "
+            << gCamera.Yaw << " " << gCamera.Pitch << endl;
+    }
+    recordKeyDown = recordKey;
+
+    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+    {
+        gUVScale += 0.1f;
+        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+    {
+        gUVScale -= 0.1f;
+        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+    }
+
+}
+
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+}
+
+
+// glfw: whenever the mouse moves, this callback is called
+// -------------------------------------------------------
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (gFirstMouse)
+    {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
+    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+
+    gLastX = xpos;
+    gLastY = ypos;
+
+    gCamera.ProcessMouseMovement(xoffset, yoffset);
+}
+
+
+// glfw: whenever the mouse scroll wheel scrolls, this callback is called
+// ----------------------------------------------------------------------
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    gCamera.ProcessMouseScroll(yoffset);
+}
+
+// glfw: handle mouse button events
+// --------------------------------
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button)
+    {
+    case GLFW_MOUSE_BUTTON_LEFT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Left mouse button pressed" << endl;
+        else
+            cout << "Left mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Middle mouse button pressed" << endl;
+        else
+            cout << "Middle mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_RIGHT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Right mouse button pressed" << endl;
+        else
+            cout << "Right mouse button released" << endl;
+    }
+    break;
+
+    default:
+        cout << "Unhandled mouse button event" << endl;
+        break;
+    }
+}
+
+
+// Functioned called to render a frame
+void URender()
+{
+    // Enable z-depth
+    glEnable(GL_DEPTH_TEST);
+
+    // Clear the frame and z buffers
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    int sceneScope = UBeginProfileScope(gProfiler, "scene update");
+
+    // Recompute the world transforms and bounds of moved nodes
+    bool transformsChanged = UUpdateScene(gScene, gMeshArena);
+
+    // camera/view transformation
+    glm::mat4 view = gCamera.GetViewMatrix();
+
+    // Creates a projection
+    glm::mat4 projection;
+
+    // Check for isPerspective / Toggle with P/O for Perspective, Ortho 
+    if (isPerspective) {
+        projection = glm::perspective(glm::radians(gCamera.Zoom),
+            (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, NEAR_PLANE, FAR_PLANE);
+    }
+    else {
+        projection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, NEAR_PLANE, FAR_PLANE);
+    }
+
+    const glm::vec3 cameraPosition = gCamera.Position;
+
+    // Lights are placed around the nodes, so they follow the scene when it changes
+    if (transformsChanged)
+        UCreateLights(gLightClusters, gScene, gLightCount, LIGHT_SEED);
+
+    // The indirect and GPU-culled object data covers every node and carries texture layers, so it is only rebuilt
+    // when nodes move or textures move between arrays, and stays current whichever path is picked
+    if (transformsChanged || gMaterialTextures.slotsChanged)
+    {
+        if (gIndirectSupported)
+            UBuildIndirectDraws(gIndirectDraws, gScene, gMeshArena);
+        if (gGpuCullingSupported)
+            UBuildGpuCulling(gGpuCulling, gScene, gMeshArena);
+    }
+
+    if (gRenderPath == RENDER_PATH_GPU_CULLED || gRenderPath == RENDER_PATH_INDIRECT)
+    {
+        // Culling and detail levels run on the GPU, or not at all on the indirect path, so the per-frame CPU cost
+        // does not grow with the node count. The CPU draw lists catch up when another path is picked.
+        gCpuDrawsStale |= transformsChanged || gMaterialTextures.slotsChanged;
+
+        // Last frame's depth shows nodes that may have moved away; the pyramid is only built on the GPU-culled path
+        if (transformsChanged || gRenderPath == RENDER_PATH_INDIRECT)
+            gHiZ.valid = false;
+    }
+    else
+    {
+        gHiZ.valid = false;
+
+        // Reject nodes outside the view frustum and pick the detail levels, then refresh the instance buffers if
+        // their contents changed
+        bool visibilityChanged = UCullScene(gScene, UExtractFrustum(projection * view));
+        visibilityChanged |= USelectLods(gScene, gMeshArena, projection, cameraPosition);
+        visibilityChanged |= gCpuDrawsStale;
+        if (transformsChanged || visibilityChanged)
+            UUpdateInstances(gMeshArena, gScene);
+        gCpuDrawsStale = false;
+    }
+    gMaterialTextures.slotsChanged = false;
+
+    UEndProfileScope(gProfiler, sceneScope);
+
+    // Per-cluster light lists for this view, read by every Phong draw
+    int lightScope = UBeginProfileScope(gProfiler, "light clusters");
+    UUpdateLightClusters(gLightClusters, view, projection);
+    UEndProfileScope(gProfiler, lightScope);
+
+    // Deferred shading draws the opaque pass into the G-buffer instead
+    if (gShadingMode == SHADING_DEFERRED)
+        UBindGBuffer(gGBuffer);
+
+    if (gRenderPath == RENDER_PATH_GPU_CULLED)
+    {
+        // A compute pass fills the command buffer, then the multi-draws of both passes consume it. Occlusion needs
+        // last frame's pyramid from a nearby view; after a camera cut the frame is only frustum culled.
+        const bool useOcclusion = gUseOcclusion && gHiZ.valid && !UIsCameraCut(gHiZ, view, projection, cameraPosition);
+        UCullSceneGpu(gGpuCulling, gHiZ, useOcclusion, view, projection, cameraPosition);
+    }
+    else if (gRenderPath != RENDER_PATH_INDIRECT)
+    {
+        // Collect this frame's draws and sort them by state, so they are submitted with redundant binds skipped
+        UBuildRenderQueue(gRenderQueue, gScene, cameraPosition);
+    }
+
+    // The pre-pass lays down the final depth with the cheapest shaders, then the opaque pass shades only the
+    // fragments that match it, once per pixel
+    if (gDepthPrepass)
+    {
+        int prepassScope = UBeginProfileScope(gProfiler, "depth prepass");
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        USubmitOpaque(true, view, projection, cameraPosition);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+        UEndProfileScope(gProfiler, prepassScope);
+    }
+
+    int opaqueScope = UBeginProfileScope(gProfiler, "opaque");
+    USubmitOpaque(false, view, projection, cameraPosition);
+    UEndProfileScope(gProfiler, opaqueScope);
+
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+
+    // Light every covered pixel once, back in the frame's own framebuffer
+    if (gShadingMode == SHADING_DEFERRED)
+    {
+        int lightingScope = UBeginProfileScope(gProfiler, "deferred lighting");
+        ULightGBuffer(gGBuffer, view, projection, cameraPosition);
+        UEndProfileScope(gProfiler, lightingScope);
+    }
+
+    // This frame's depth holds the occluders of the next one
+    if (gRenderPath == RENDER_PATH_GPU_CULLED)
+    {
+        int hiZScope = UBeginProfileScope(gProfiler, "hi-z build");
+        UBuildHiZ(gHiZ, view, projection, cameraPosition);
+        UEndProfileScope(gProfiler, hiZScope);
+    }
+
+    glUseProgram(gLampProgram.id);
+
+    // Pass matrix data to the Lamp Shader program's matrix uniforms
+    glm::mat4 model = glm::translate(gLightPosition) * glm::scale(gLightScale);
+    glUniformMatrix4fv(gLampProgram.model, 1, GL_FALSE, glm::value_ptr(model));
+    glUniformMatrix4fv(gLampProgram.view, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(gLampProgram.projection, 1, GL_FALSE, glm::value_ptr(projection));
+
+    // Draws the triangles
+    //glDrawElementsBaseVertex(...);
+
+    // Timing bars of the last resolved frame
+    UDrawProfilerOverlay(gProfiler);
+
+    // Deactivate the Vertex Array Object and shader program
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    // The benchmark renders into its own framebuffer and never presents
+    // The swap mostly waits on vsync, which is not GPU work, so it is timed on the CPU only
+    if (!gBench.enabled)
+    {
+        int presentScope = UBeginProfileScope(gProfiler, "present", false);
+        glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+        UEndProfileScope(gProfiler, presentScope);
+    }
+}
+
+
+// Draws the opaque scene with the current render path, shaded or, with depthOnly, for the depth pre-pass
+void USubmitOpaque(bool depthOnly, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    if (gRenderPath == RENDER_PATH_INDIRECT)
+    {
+        // The whole scene comes from the command buffer: one call per texture array, whatever the object count
+        USubmitIndirectDraws(gIndirectDraws, gMeshArena, depthOnly, view, projection, cameraPosition);
+    }
+    else if (gRenderPath == RENDER_PATH_GPU_CULLED)
+        USubmitGpuCulledDraws(gGpuCulling, gMeshArena, depthOnly, view, projection, cameraPosition);
+    else if (depthOnly)
+        USubmitDepthPrepass(gRenderQueue, gScene, gMeshArena, view, projection);
+    else
+        USubmitRenderQueue(gRenderQueue, gScene, gMeshArena, view, projection, cameraPosition);
+}
+
+
+// Packs the state of a draw into a sort key: program, then texture array, then mesh, then front-to-back depth
+uint64_t UMakeDrawKey(GLuint program, GLuint texture, GLuint mesh, float depth)
+{
+    uint64_t depthBits = (uint64_t)(glm::clamp(depth / FAR_PLANE, 0.0f, 1.0f) * 0xFFFFFF);
+
+    return ((uint64_t)(program & 0xF) << 56)
+        | ((uint64_t)(texture & 0xFFFF) << 40)
+        | ((uint64_t)(mesh & 0xFFFF) << 24)
+        | depthBits;
+}
+
+
+// Collects one draw per single node and one per instance batch, then sorts them by key
+void UBuildRenderQueue(RenderQueue& queue, const Scene& scene, glm::vec3 cameraPosition)
+{
+    queue.items.clear();
+
+    for (size_t i = 0; i < scene.nodes.size(); ++i)
+    {
+        const SceneNode& node = scene.nodes[i];
+        if ((gRenderPath == RENDER_PATH_INSTANCED && node.instanced) || !scene.visible[i])
+            continue;
+
+        float depth = glm::length(glm::vec3(node.world[3]) - cameraPosition);
+
+        DrawItem item;
+        item.key = UMakeDrawKey(PROGRAM_TOWER, gMaterialTextures.slots[gMaterials[node.material].texture].array, node.mesh, depth);
+        item.node = (int)i;
+        item.batch = -1;
+        queue.items.push_back(item);
+    }
+
+    if (gRenderPath == RENDER_PATH_INSTANCED)
+    {
+        for (size_t i = 0; i < scene.batches.size(); ++i)
+        {
+            const InstanceBatch& batch = scene.batches[i];
+            if (batch.visibleCount == 0)
+                continue;
+
+            // A batch sorts by its nearest visible instance
+            float depth = 1e30f;
+            for (int nodeIndex : batch.nodes)
+            {
+                if (scene.visible[nodeIndex])
+                    depth = std::min(depth, glm::length(glm::vec3(scene.nodes[nodeIndex].world[3]) - cameraPosition));
+            }
+
+            DrawItem item;
+            item.key = UMakeDrawKey(PROGRAM_INSTANCED, gMaterialTextures.slots[gMaterials[batch.material].texture].array, batch.mesh, depth);
+            item.node = -1;
+            item.batch = (int)i;
+            queue.items.push_back(item);
+        }
+    }
+
+    std::sort(queue.items.begin(), queue.items.end(),
+        [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+
+    // The depth pre-pass only binds its program, so it skips the texture and mesh order and draws nearest first
+    queue.frontToBack.resize(queue.items.size());
+    for (size_t i = 0; i < queue.items.size(); ++i)
+        queue.frontToBack[i] = (int)i;
+
+    std::sort(queue.frontToBack.begin(), queue.frontToBack.end(), [&queue](int a, int b)
+    {
+        const uint64_t keyA = queue.items[a].key;
+        const uint64_t keyB = queue.items[b].key;
+        return (keyA >> 56) != (keyB >> 56) ? keyA < keyB : (keyA & 0xFFFFFF) < (keyB & 0xFFFFFF);
+    });
+}
+
+
+// Draws the depth of the queue's items with the depth-only programs, nearest first, so later draws fail the early
+// depth test wherever nearer ones already covered the screen
+void USubmitDepthPrepass(const RenderQueue& queue, const Scene& scene, const MeshArena& arena, const glm::mat4& view, const glm::mat4& projection)
+{
+    const GLProgram* currentProgram = nullptr;
+
+    const GLProgram* slotPrograms[PROGRAM_COUNT];
+    for (int slot = 0; slot < PROGRAM_COUNT; ++slot)
+        slotPrograms[slot] = UGetOpaqueProgram(PROGRAM_SLOT_INPUTS[slot], true);
+
+    glBindVertexArray(arena.vao);
+
+    for (int index : queue.frontToBack)
+    {
+        const DrawItem& item = queue.items[index];
+        const GLProgram* program = slotPrograms[item.key >> 56];
+        if (program == nullptr)
+            continue;
+
+        if (program != currentProgram)
+        {
+            glUseProgram(program->id);
+            glUniformMatrix4fv(program->view, 1, GL_FALSE, glm::value_ptr(view));
+            glUniformMatrix4fv(program->projection, 1, GL_FALSE, glm::value_ptr(projection));
+            currentProgram = program;
+        }
+
+        UDrawQueueItem(item, scene, arena, *program);
+    }
+}
+
+
+// Issues the sorted draws, binding program, texture array, layer and UV scale only when they change
+void USubmitRenderQueue(RenderQueue& queue, const Scene& scene, const MeshArena& arena, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    const GLProgram* currentProgram = nullptr;
+    int groupScope = -1;    // Profiler scope of the current program's draws
+    int currentTextureArray = -1;
+    int currentLayer = -1;
+    const glm::vec2* currentUVScale = nullptr;
+
+    queue.nDraws = 0;
+    queue.nProgramBinds = 0;
+    queue.nTextureBinds = 0;
+    queue.nVaoBinds = 0;
+
+    // This frame's variant of each slot, compiled the first time the settings ask for it
+    const GLProgram* slotPrograms[PROGRAM_COUNT];
+    for (int slot = 0; slot < PROGRAM_COUNT; ++slot)
+        slotPrograms[slot] = UGetOpaqueProgram(PROGRAM_SLOT_INPUTS[slot], false);
+
+    // Every draw samples texture unit 0 and reads from the mesh arena
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(arena.vao);
+    queue.nVaoBinds = 1;
+
+    for (const DrawItem& item : queue.items)
+    {
+        const int materialId = item.node >= 0 ? scene.nodes[item.node].material : scene.batches[item.batch].material;
+        const Material& material = gMaterials[materialId];
+        const TextureSlot& texture = gMaterialTextures.slots[material.texture];
+        const GLProgram* program = slotPrograms[item.key >> 56];
+        if (program == nullptr)
+            continue;
+
+        if (program != currentProgram)
+        {
+            UEndProfileScope(gProfiler, groupScope);
+            groupScope = UBeginProfileScope(gProfiler, PROGRAM_SLOT_NAMES[item.key >> 56]);
+
+            glUseProgram(program->id);
+            USetFrameUniforms(*program, view, projection, cameraPosition);
+            currentProgram = program;
+            currentUVScale = nullptr; // uniform state is per program
+            currentLayer = -1;
+            ++queue.nProgramBinds;
+        }
+
+        if (texture.array != currentTextureArray)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, gMaterialTextures.ids[texture.array]);
+            currentTextureArray = texture.array;
+            ++queue.nTextureBinds;
+        }
+
+        if (texture.layer != currentLayer)
+        {
+            glUniform1i(program->textureLayer, texture.layer);
+            currentLayer = texture.layer;
+        }
+
+        if (material.uvScale != currentUVScale)
+        {
+            glUniform2fv(program->uvScale, 1, glm::value_ptr(*material.uvScale));
+            currentUVScale = material.uvScale;
+        }
+
+        queue.nDraws += UDrawQueueItem(item, scene, arena, *program);
+    }
+
+    UEndProfileScope(gProfiler, groupScope);
+}
+
+
+// Issues the draw calls of one queue item with the bound program: the node's model matrix and one draw, or one
+// instanced draw per detail level of the batch. Returns the number of draw calls.
+int UDrawQueueItem(const DrawItem& item, const Scene& scene, const MeshArena& arena, const GLProgram& program)
+{
+    if (item.node >= 0)
+    {
+        const GLMesh& mesh = arena.meshes[scene.nodes[item.node].mesh];
+        const int lod = scene.lod[item.node];
+        glm::mat4 model = scene.nodes[item.node].world * mesh.dequantize;
+        glUniformMatrix4fv(program.model, 1, GL_FALSE, glm::value_ptr(model));
+        glUniformMatrix3x4fv(program.normalMatrix, 1, GL_FALSE, glm::value_ptr(scene.normalMatrices[item.node]));
+        glDrawElementsBaseVertex(GL_TRIANGLES, mesh.lodIndexCount[lod], GL_UNSIGNED_INT,
+            (const void*)(sizeof(GLuint) * mesh.lodFirstIndex[lod]), mesh.baseVertex);
+        return 1;
+    }
+
+    // One instanced draw per detail level in use; the batch instances are packed in level order
+    const InstanceBatch& batch = scene.batches[item.batch];
+    const GLMesh& mesh = arena.meshes[batch.mesh];
+    GLuint firstInstance = batch.firstInstance;
+    int nDraws = 0;
+    for (int lod = 0; lod < mesh.nLods; ++lod)
+    {
+        if (batch.lodCounts[lod] == 0)
+            continue;
+
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, mesh.lodIndexCount[lod], GL_UNSIGNED_INT,
+            (const void*)(sizeof(GLuint) * mesh.lodFirstIndex[lod]), batch.lodCounts[lod], mesh.baseVertex, firstInstance);
+        firstInstance += batch.lodCounts[lod];
+        ++nDraws;
+    }
+
+    return nDraws;
+}
+
+
+// Passes the transform, color, light, and camera data shared by every draw of the frame
+void USetFrameUniforms(const GLProgram& program, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    glUniformMatrix4fv(program.view, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(program.projection, 1, GL_FALSE, glm::value_ptr(projection));
+    glUniform3f(program.objectColor, gObjectColor.r, gObjectColor.g, gObjectColor.b);
+    glUniform3f(program.lightColor, gLightColor.r, gLightColor.g, gLightColor.b);
+    glUniform3f(program.lightPos, gLightPosition.x, gLightPosition.y, gLightPosition.z);
+    glUniform3f(program.viewPosition, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    glUniform4fv(program.clusterScale, 1, glm::value_ptr(gLightClusters.scale));
+    glUniform3i(program.clusterCount, CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+    glUniform1f(program.ambientStrength, gAmbientStrength);
+    glUniform1f(program.specularIntensity, gSpecularIntensity);
+    glUniform1f(program.highlightSize, gHighlightSize);
+}
+
+
+// Creates the indirect command buffer and the per-object storage buffer
+void UCreateIndirectDraws(IndirectDraws& draws)
+{
+    glGenBuffers(1, &draws.commandBuffer);
+    glGenBuffers(1, &draws.objectBuffer);
+}
+
+
+// Rebuilds the indirect commands and object data from every node, at full detail. Nothing here depends on the view,
+// so it only runs when nodes or textures change; the GPU-culled path is the one that culls and picks detail levels.
+// Objects are ordered by texture array then mesh, so nodes sharing both collapse into one instanced command
+// (the layer is per object, so different materials of one format still share a command).
+void UBuildIndirectDraws(IndirectDraws& draws, const Scene& scene, const MeshArena& arena)
+{
+    std::vector<int> order(scene.nodes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = (int)i;
+
+    std::sort(order.begin(), order.end(), [&scene](int a, int b)
+        {
+            const SceneNode& nodeA = scene.nodes[a];
+            const SceneNode& nodeB = scene.nodes[b];
+            int arrayA = gMaterialTextures.slots[gMaterials[nodeA.material].texture].array;
+            int arrayB = gMaterialTextures.slots[gMaterials[nodeB.material].texture].array;
+            if (arrayA != arrayB)
+                return arrayA < arrayB;
+            return nodeA.mesh < nodeB.mesh;
+        });
+
+    draws.commands.clear();
+    draws.objects.clear();
+    draws.groups.clear();
+
+    for (int nodeIndex : order)
+    {
+        const SceneNode& node = scene.nodes[nodeIndex];
+        const Material& material = gMaterials[node.material];
+        const TextureSlot& texture = gMaterialTextures.slots[material.texture];
+        const GLMesh& mesh = arena.meshes[node.mesh];
+
+        if (draws.groups.empty() || draws.groups.back().textureArray != texture.array)
+            draws.groups.push_back({ texture.array, (GLsizei)draws.commands.size(), 0 });
+
+        IndirectGroup& group = draws.groups.back();
+        DrawElementsIndirectCommand* last = group.nCommands > 0 ? &draws.commands.back() : nullptr;
+
+        // Extend the previous command when this node draws the same mesh
+        if (last != nullptr && last->firstIndex == mesh.lodFirstIndex[0] && last->baseVertex == mesh.baseVertex)
+        {
+            ++last->instanceCount;
+        }
+        else
+        {
+            DrawElementsIndirectCommand command;
+            command.count = (GLuint)mesh.lodIndexCount[0];
+            command.instanceCount = 1;
+            command.firstIndex = mesh.lodFirstIndex[0];
+            command.baseVertex = mesh.baseVertex;
+            command.baseInstance = (GLuint)draws.objects.size();
+            draws.commands.push_back(command);
+            ++group.nCommands;
+        }
+
+        IndirectObject object;
+        object.model = node.world * mesh.dequantize;
+        object.normalMatrix = scene.normalMatrices[nodeIndex];
+        object.material = glm::vec4(material.uvScale->x, material.uvScale->y, (float)texture.layer, 0.0f);
+        draws.objects.push_back(object);
+    }
+
+    // Buffers are respecified (orphaned) so a rebuild never waits on frames still reading them
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draws.commandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * draws.commands.size(), draws.commands.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, draws.objectBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(IndirectObject) * draws.objects.size(), draws.objects.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+// Draws the whole scene from the indirect command buffer, one multi-draw per texture array. With depthOnly, the
+// depth pre-pass draws every command in one call, as it samples no texture.
+void USubmitIndirectDraws(const IndirectDraws& draws, const MeshArena& arena, bool depthOnly, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    const GLProgram* variant = UGetOpaqueProgram(SHADER_INPUT_INDIRECT, depthOnly);
+    if (variant == nullptr)
+        return;
+
+    const GLProgram& program = *variant;
+    glUseProgram(program.id);
+    USetFrameUniforms(program, view, projection, cameraPosition);
+
+    // The per-object UV scale is applied in the vertex shader
+    glUniform2f(program.uvScale, 1.0f, 1.0f);
+
+    glBindVertexArray(arena.vao);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, draws.objectBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, draws.commandBuffer);
+    glActiveTexture(GL_TEXTURE0);
+
+    if (depthOnly)
+    {
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, (GLsizei)draws.commands.size(), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        return;
+    }
+
+    for (const IndirectGroup& group : draws.groups)
+    {
+        int groupScope = UBeginProfileScope(gProfiler, "indirect draws");
+        glBindTexture(GL_TEXTURE_2D_ARRAY, gMaterialTextures.ids[group.textureArray]);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+            (const void*)(sizeof(DrawElementsIndirectCommand) * group.firstCommand), group.nCommands, 0);
+        UEndProfileScope(gProfiler, groupScope);
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+
+void UDestroyIndirectDraws(IndirectDraws& draws)
+{
+    glDeleteBuffers(1, &draws.commandBuffer);
+    glDeleteBuffers(1, &draws.objectBuffer);
+}
+
+
+// Compiles the culling compute shader and creates its buffers. Returns false when the shader does not build.
+bool UCreateGpuCulling(GpuCulling& culling)
+{
+    if (!UCreateComputeProgram(cullComputeShaderSource, culling.program))
+        return false;
+
+    culling.frustumPlanes = glGetUniformLocation(culling.program, "frustumPlanes");
+    culling.cameraPosition = glGetUniformLocation(culling.program, "cameraPosition");
+    culling.projectionScale = glGetUniformLocation(culling.program, "projectionScale");
+    culling.perspective = glGetUniformLocation(culling.program, "perspective");
+    culling.lodScreenSizes = glGetUniformLocation(culling.program, "lodScreenSizes");
+    culling.lodHysteresis = glGetUniformLocation(culling.program, "lodHysteresis");
+    culling.objectCount = glGetUniformLocation(culling.program, "objectCount");
+    culling.useCulling = glGetUniformLocation(culling.program, "useCulling");
+    culling.useOcclusion = glGetUniformLocation(culling.program, "useOcclusion");
+    culling.previousViewProjection = glGetUniformLocation(culling.program, "previousViewProjection");
+    culling.depthSize = glGetUniformLocation(culling.program, "depthSize");
+    culling.hiZ = glGetUniformLocation(culling.program, "hiZ");
+
+    // Constant for the whole run; the depth pyramid is read from texture unit 1
+    glUseProgram(culling.program);
+    glUniform3fv(culling.lodScreenSizes, 1, LOD_SCREEN_SIZES);
+    glUniform1f(culling.lodHysteresis, LOD_HYSTERESIS);
+    glUniform1i(culling.hiZ, 1);
+
+    glGenBuffers(1, &culling.objectBuffer);
+    glGenBuffers(1, &culling.commandTemplate);
+    glGenBuffers(1, &culling.commandBuffer);
+    glGenBuffers(1, &culling.visibleBuffer);
+    glGenBuffers(1, &culling.readbackBuffer);
+    for (GLsync& fence : culling.readbackFences)
+        fence = 0;
+    culling.readbackFrame = 0;
+    culling.nObjects = 0;
+    culling.visibleCount = 0;
+
+    return true;
+}
+
+
+// Uploads every node as a culling object, with the commands they can be appended to.
+// Objects are ordered by texture array then mesh, so the commands of one texture array form one multi-draw group.
+void UBuildGpuCulling(GpuCulling& culling, const Scene& scene, const MeshArena& arena)
+{
+    std::vector<int> order(scene.nodes.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = (int)i;
+
+    auto textureArray = [](const SceneNode& node) { return gMaterialTextures.slots[gMaterials[node.material].texture].array; };
+    std::sort(order.begin(), order.end(), [&scene, &textureArray](int a, int b)
+        {
+            const SceneNode& nodeA = scene.nodes[a];
+            const SceneNode& nodeB = scene.nodes[b];
+            if (textureArray(nodeA) != textureArray(nodeB))
+                return textureArray(nodeA) < textureArray(nodeB);
+            return nodeA.mesh < nodeB.mesh;
+        });
+
+    std::vector<GpuCullObject> objects(order.size());
+    culling.commands.clear();
+    culling.groups.clear();
+    GLuint nSlots = 0;
+
+    for (size_t first = 0; first < order.size();)
+    {
+        const SceneNode& firstNode = scene.nodes[order[first]];
+        const int array = textureArray(firstNode);
+        const GLMesh& mesh = arena.meshes[firstNode.mesh];
+
+        size_t last = first + 1;
+        while (last < order.size() && scene.nodes[order[last]].mesh == firstNode.mesh && textureArray(scene.nodes[order[last]]) == array)
+            ++last;
+
+        if (culling.groups.empty() || culling.groups.back().textureArray != array)
+            culling.groups.push_back({ array, (GLsizei)culling.commands.size(), 0 });
+
+        // Any node may pick any level, so every level's range holds all the nodes of the run
+        const GLuint firstCommand = (GLuint)culling.commands.size();
+        for (int lod = 0; lod < mesh.nLods; ++lod)
+        {
+            DrawElementsIndirectCommand command;
+            command.count = (GLuint)mesh.lodIndexCount[lod];
+            command.instanceCount = 0;
+            command.firstIndex = mesh.lodFirstIndex[lod];
+            command.baseVertex = mesh.baseVertex;
+            command.baseInstance = nSlots;
+            culling.commands.push_back(command);
+            ++culling.groups.back().nCommands;
+            nSlots += (GLuint)(last - first);
+        }
+
+        for (size_t i = first; i < last; ++i)
+        {
+            const int nodeIndex = order[i];
+            const SceneNode& node = scene.nodes[nodeIndex];
+            const Material& material = gMaterials[node.material];
+
+            GpuCullObject& object = objects[i];
+            object.model = node.world * mesh.dequantize;
+            object.normalMatrix = scene.normalMatrices[nodeIndex];
+            object.sphere = glm::vec4(scene.boundsX[nodeIndex], scene.boundsY[nodeIndex], scene.boundsZ[nodeIndex], scene.boundsRadius[nodeIndex]);
+            object.material = glm::vec4(material.uvScale->x, material.uvScale->y, (float)gMaterialTextures.slots[material.texture].layer, 0.0f);
+            object.firstCommand = firstCommand;
+            object.nLods = (GLuint)mesh.nLods;
+            object.lod = scene.lod[nodeIndex];
+            object.pad = 0;
+        }
+
+        first = last;
+    }
+
+    culling.nObjects = (GLuint)objects.size();
+    const GLsizeiptr commandsSize = sizeof(DrawElementsIndirectCommand) * culling.commands.size();
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.objectBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GpuCullObject) * objects.size(), objects.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.commandTemplate);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, commandsSize, culling.commands.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, commandsSize, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, culling.visibleBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * nSlots, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // Copies of the old layout mean nothing any more
+    glBindBuffer(GL_COPY_WRITE_BUFFER, culling.readbackBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, commandsSize * GPU_CULL_READBACK_FRAMES, NULL, GL_STREAM_READ);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    for (GLsync& fence : culling.readbackFences)
+    {
+        glDeleteSync(fence);
+        fence = 0;
+    }
+}
+
+
+// Culls the scene on the GPU into the command buffer, drawn afterwards by USubmitGpuCulledDraws.
+// The compute pass appends each visible node to the command of its detail level, so nothing per node comes back to
+// the CPU; only a delayed copy of the commands is read for the visible count. With useOcclusion, nodes hidden
+// behind the depth in hiZ are dropped as well.
+void UCullSceneGpu(GpuCulling& culling, const HiZBuffer& hiZ, bool useOcclusion, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    if (culling.nObjects == 0)
+        return;
+
+    int cullScope = UBeginProfileScope(gProfiler, "gpu culling");
+    const GLsizeiptr commandsSize = sizeof(DrawElementsIndirectCommand) * culling.commands.size();
+
+    // Every frame starts from commands with no instances
+    glBindBuffer(GL_COPY_READ_BUFFER, culling.commandTemplate);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, culling.commandBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, commandsSize);
+
+    const Frustum frustum = UExtractFrustum(projection * view);
+    glm::vec4 planes[6];
+    for (int p = 0; p < 6; ++p)
+        planes[p] = glm::vec4(frustum.a[p], frustum.b[p], frustum.c[p], frustum.d[p]);
+
+    glUseProgram(culling.program);
+    glUniform4fv(culling.frustumPlanes, 6, glm::value_ptr(planes[0]));
+    glUniform3f(culling.cameraPosition, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    glUniform1f(culling.projectionScale, 0.5f * projection[1][1]); // As in USelectLods
+    glUniform1i(culling.perspective, projection[3][3] == 0.0f);
+    glUniform1ui(culling.objectCount, culling.nObjects);
+    glUniform1i(culling.useCulling, gUseCulling);
+    glUniform1i(culling.useOcclusion, useOcclusion);
+    if (useOcclusion)
+    {
+        glUniformMatrix4fv(culling.previousViewProjection, 1, GL_FALSE, glm::value_ptr(hiZ.viewProjection));
+        glUniform2i(culling.depthSize, hiZ.width, hiZ.height);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, hiZ.pyramid);
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, culling.objectBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culling.commandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, culling.visibleBuffer);
+    glDispatchCompute((culling.nObjects + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+
+    // The draws read the commands as indirect parameters and the visible list from the vertex shader, the
+    // statistics copy reads the commands
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    UReadGpuCullingStats(culling);
+    UEndProfileScope(gProfiler, cullScope);
+}
+
+
+// Draws the commands of the last UCullSceneGpu, one multi-draw per texture array. With depthOnly, the depth pre-pass
+// draws every command in one call; both passes read the same culling results.
+void USubmitGpuCulledDraws(const GpuCulling& culling, const MeshArena& arena, bool depthOnly, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    if (culling.nObjects == 0)
+        return;
+
+    const GLProgram* variant = UGetOpaqueProgram(SHADER_INPUT_GPU_CULLED, depthOnly);
+    if (variant == nullptr)
+        return;
+
+    const GLProgram& program = *variant;
+    glUseProgram(program.id);
+    USetFrameUniforms(program, view, projection, cameraPosition);
+
+    // The per-object UV scale is applied in the vertex shader
+    glUniform2f(program.uvScale, 1.0f, 1.0f);
+
+    // The culling pass left the object and visible buffers bound at 0 and 2
+    glBindVertexArray(arena.vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culling.commandBuffer);
+    glActiveTexture(GL_TEXTURE0);
+
+    if (depthOnly)
+    {
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, (GLsizei)culling.commands.size(), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+        return;
+    }
+
+    for (const IndirectGroup& group : culling.groups)
+    {
+        int groupScope = UBeginProfileScope(gProfiler, "gpu-culled draws");
+        glBindTexture(GL_TEXTURE_2D_ARRAY, gMaterialTextures.ids[group.textureArray]);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+            (const void*)(sizeof(DrawElementsIndirectCommand) * group.firstCommand), group.nCommands, 0);
+        UEndProfileScope(gProfiler, groupScope);
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+
+// Copies this frame's culled commands into the next readback slot. The slot's previous copy is summed into
+// visibleCount first, but only when its fence has already passed, so the CPU never waits for the GPU.
+void UReadGpuCullingStats(GpuCulling& culling)
+{
+    const GLsizeiptr commandsSize = sizeof(DrawElementsIndirectCommand) * culling.commands.size();
+    const int slot = culling.readbackFrame++ % GPU_CULL_READBACK_FRAMES;
+    GLsync& fence = culling.readbackFences[slot];
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, culling.readbackBuffer);
+    if (fence)
+    {
+        const GLenum status = glClientWaitSync(fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+        {
+            std::vector<DrawElementsIndirectCommand> commands(culling.commands.size());
+            glGetBufferSubData(GL_COPY_WRITE_BUFFER, commandsSize * slot, commandsSize, commands.data());
+
+            culling.visibleCount = 0;
+            for (const DrawElementsIndirectCommand& command : commands)
+                culling.visibleCount += command.instanceCount;
+        }
+        glDeleteSync(fence);
+    }
+
+    glBindBuffer(GL_COPY_READ_BUFFER, culling.commandBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, commandsSize * slot, commandsSize);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+
+void UDestroyGpuCulling(GpuCulling& culling)
+{
+    for (GLsync fence : culling.readbackFences)
+        glDeleteSync(fence);
+
+    glDeleteProgram(culling.program);
+    glDeleteBuffers(1, &culling.objectBuffer);
+    glDeleteBuffers(1, &culling.commandTemplate);
+    glDeleteBuffers(1, &culling.commandBuffer);
+    glDeleteBuffers(1, &culling.visibleBuffer);
+    glDeleteBuffers(1, &culling.readbackBuffer);
+}
+
+
+// Compiles the depth reduction shader; the textures are made by UBuildHiZ once the framebuffer size is known
+bool UCreateHiZ(HiZBuffer& hiZ)
+{
+    if (!UCreateComputeProgram(hiZComputeShaderSource, hiZ.program))
+        return false;
+
+    hiZ.sourceLevel = glGetUniformLocation(hiZ.program, "sourceLevel");
+    glUseProgram(hiZ.program);
+    glUniform1i(glGetUniformLocation(hiZ.program, "source"), 1);
+
+    hiZ.depthTexture = 0;
+    hiZ.pyramid = 0;
+    hiZ.width = 0;
+    hiZ.height = 0;
+    hiZ.nLevels = 0;
+    hiZ.valid = false;
+
+    return true;
+}
+
+
+// Copies the depth buffer of the frame just drawn and reduces it into the pyramid, one dispatch per level.
+// Records the view it was drawn with, for the occlusion test and the camera cut check of the next frame.
+void UBuildHiZ(HiZBuffer& hiZ, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // Textures follow the framebuffer size
+    if (viewport[2] != hiZ.width || viewport[3] != hiZ.height)
+    {
+        glDeleteTextures(1, &hiZ.depthTexture);
+        glDeleteTextures(1, &hiZ.pyramid);
+
+        hiZ.width = viewport[2];
+        hiZ.height = viewport[3];
+        const int levelWidth = std::max(hiZ.width / 2, 1);
+        const int levelHeight = std::max(hiZ.height / 2, 1);
+        hiZ.nLevels = (int)std::floor(std::log2((float)std::max(levelWidth, levelHeight))) + 1;
+
+        glGenTextures(1, &hiZ.depthTexture);
+        glBindTexture(GL_TEXTURE_2D, hiZ.depthTexture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, hiZ.width, hiZ.height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        glGenTextures(1, &hiZ.pyramid);
+        glBindTexture(GL_TEXTURE_2D, hiZ.pyramid);
+        glTexStorage2D(GL_TEXTURE_2D, hiZ.nLevels, GL_R32F, levelWidth, levelHeight);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    // Reads the depth of the bound read framebuffer (the window, or the benchmark target)
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, hiZ.depthTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], hiZ.width, hiZ.height);
+
+    glUseProgram(hiZ.program);
+    for (int level = 0; level < hiZ.nLevels; ++level)
+    {
+        // Level 0 reduces the depth copy, the others the level below them
+        glBindTexture(GL_TEXTURE_2D, level == 0 ? hiZ.depthTexture : hiZ.pyramid);
+        glUniform1i(hiZ.sourceLevel, level == 0 ? 0 : level - 1);
+        glBindImageTexture(0, hiZ.pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+        const int levelWidth = std::max((hiZ.width / 2) >> level, 1);
+        const int levelHeight = std::max((hiZ.height / 2) >> level, 1);
+        glDispatchCompute((levelWidth + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, (levelHeight + HIZ_GROUP_SIZE - 1) / HIZ_GROUP_SIZE, 1);
+
+        // The next level and the culling pass read what was just stored through texelFetch
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+
+    hiZ.valid = true;
+    hiZ.viewProjection = projection * view;
+    hiZ.projection = projection;
+    hiZ.cameraPosition = cameraPosition;
+    hiZ.cameraFront = -glm::vec3(view[0][2], view[1][2], view[2][2]);
+}
+
+
+// True when the view jumped too far from the one the pyramid was built from for its depth to stand in for this
+// frame's: a long move, a sharp turn, or a different projection (zoom, perspective / ortho)
+bool UIsCameraCut(const HiZBuffer& hiZ, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    const glm::vec3 front = -glm::vec3(view[0][2], view[1][2], view[2][2]);
+
+    return projection != hiZ.projection
+        || glm::length(cameraPosition - hiZ.cameraPosition) > HIZ_CUT_DISTANCE
+        || glm::dot(front, hiZ.cameraFront) < std::cos(glm::radians(HIZ_CUT_ANGLE));
+}
+
+
+void UDestroyHiZ(HiZBuffer& hiZ)
+{
+    glDeleteProgram(hiZ.program);
+    glDeleteTextures(1, &hiZ.depthTexture);
+    glDeleteTextures(1, &hiZ.pyramid);
+}
+
+
+// Compiles the light assignment shader and creates the light, grid and index buffers (sized for every cluster)
+bool UCreateLightClusters(LightClusters& clusters)
+{
+    // The grid, per-cluster limit and depth range are defined from the constants the lookup side uses, so the
+    // assignment and the lighting shaders always agree on the cluster layout
+    char defines[512];
+    snprintf(defines, sizeof(defines),
+        "#version 440 core\n"
+        "#define CLUSTER_X %d\n#define CLUSTER_Y %d\n#define CLUSTER_Z %d\n"
+        "#define CLUSTER_MAX_LIGHTS %d\n#define CLUSTER_GROUP_SIZE %d\n"
+        "#define CLUSTER_NEAR %.9g\n#define CLUSTER_FAR %.9g\n",
+        CLUSTER_X, CLUSTER_Y, CLUSTER_Z, CLUSTER_MAX_LIGHTS, CLUSTER_GROUP_SIZE, NEAR_PLANE, FAR_PLANE);
+
+    const std::string source = std::string(defines) + lightClusterComputeShaderSource;
+    if (!UCreateComputeProgram(source.c_str(), clusters.program))
+        return false;
+
+    clusters.view = glGetUniformLocation(clusters.program, "view");
+    clusters.inverseProjection = glGetUniformLocation(clusters.program, "inverseProjection");
+    clusters.perspective = glGetUniformLocation(clusters.program, "perspective");
+    clusters.lightCount = glGetUniformLocation(clusters.program, "lightCount");
+
+    const GLsizeiptr nClusters = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+    glGenBuffers(1, &clusters.lightBuffer);
+    glGenBuffers(1, &clusters.gridBuffer);
+    glGenBuffers(1, &clusters.indexBuffer);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.gridBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2 * nClusters, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.indexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * CLUSTER_MAX_LIGHTS * nClusters, NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    clusters.lightsChanged = true;
+    clusters.scale = glm::vec4(0.0f);
+
+    return true;
+}
+
+
+// Scatters count point lights around the scene's buildings and bushes: each one floats just outside a random node
+// (never the ground or sky), reaches LIGHT_RANGE_SCALE times the node's radius, and has a warm street lamp or a cool
+// window tint
+void UCreateLights(LightClusters& clusters, const Scene& scene, int count, unsigned int seed)
+{
+    std::vector<int> anchors;
+    for (size_t i = 0; i < scene.nodes.size(); ++i)
+    {
+        if (scene.nodes[i].mesh != MESH_GROUND && scene.nodes[i].mesh != MESH_SKY)
+            anchors.push_back((int)i);
+    }
+
+    clusters.lights.clear();
+    clusters.lightsChanged = true;
+    if (anchors.empty())
+        return;
+
+    std::mt19937 rng(seed);
+    for (int i = 0; i < count; ++i)
+    {
+        const int node = anchors[rng() % anchors.size()];
+        const glm::vec3 center(scene.boundsX[node], scene.boundsY[node], scene.boundsZ[node]);
+        const float radius = scene.boundsRadius[node];
+
+        glm::vec3 direction(URandom01(rng) * 2.0f - 1.0f, URandom01(rng) * 2.0f - 1.0f, URandom01(rng) * 2.0f - 1.0f);
+        direction = glm::length(direction) > 1e-3f ? glm::normalize(direction) : glm::vec3(0.0f, 1.0f, 0.0f);
+
+        const glm::vec3 tint = URandom01(rng) < 0.5f ? glm::vec3(1.0f, 0.7f, 0.35f) : glm::vec3(0.55f, 0.7f, 1.0f);
+        const float intensity = 0.5f + 0.5f * URandom01(rng);
+
+        PointLight light;
+        light.positionRange = glm::vec4(center + direction * radius * (1.0f + 0.2f * URandom01(rng)), radius * LIGHT_RANGE_SCALE);
+        light.color = glm::vec4(tint * intensity, 1.0f);
+        clusters.lights.push_back(light);
+    }
+}
+
+
+// Uploads the lights if they changed, then rebuilds every cluster's light list for the view and binds the light
+// buffers for the Phong shader
+void UUpdateLightClusters(LightClusters& clusters, const glm::mat4& view, const glm::mat4& projection)
+{
+    if (clusters.lightsChanged)
+    {
+        // Never empty, so the buffer always has storage to bind
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.lightBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(PointLight) * std::max(clusters.lights.size(), (size_t)1), NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(PointLight) * clusters.lights.size(), clusters.lights.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        clusters.lightsChanged = false;
+    }
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    // Slices are spaced exponentially in view depth, so near clusters stay small on screen in every direction
+    const float logDepthRange = std::log(FAR_PLANE / NEAR_PLANE);
+    clusters.scale = glm::vec4((float)CLUSTER_X / viewport[2], (float)CLUSTER_Y / viewport[3],
+        CLUSTER_Z / logDepthRange, -CLUSTER_Z * std::log(NEAR_PLANE) / logDepthRange);
+
+    glUseProgram(clusters.program);
+    glUniformMatrix4fv(clusters.view, 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(clusters.inverseProjection, 1, GL_FALSE, glm::value_ptr(glm::inverse(projection)));
+    glUniform1i(clusters.perspective, projection[3][3] == 0.0f);
+    glUniform1ui(clusters.lightCount, (GLuint)clusters.lights.size());
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, clusters.lightBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, clusters.gridBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, clusters.indexBuffer);
+    glDispatchCompute((CLUSTER_X * CLUSTER_Y * CLUSTER_Z + CLUSTER_GROUP_SIZE - 1) / CLUSTER_GROUP_SIZE, 1, 1);
+
+    // The fragment shaders read the lists as storage buffers
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+
+void UDestroyLightClusters(LightClusters& clusters)
+{
+    glDeleteProgram(clusters.program);
+    glDeleteBuffers(1, &clusters.lightBuffer);
+    glDeleteBuffers(1, &clusters.gridBuffer);
+    glDeleteBuffers(1, &clusters.indexBuffer);
+}
+
+
+// Creates the G-buffer framebuffer. The textures are made by UBindGBuffer once the framebuffer size is known.
+void UCreateGBuffer(GBuffer& gBuffer)
+{
+    glGenFramebuffers(1, &gBuffer.fbo);
+    glGenVertexArrays(1, &gBuffer.emptyVao);
+    gBuffer.albedo = 0;
+    gBuffer.normal = 0;
+    gBuffer.depth = 0;
+    gBuffer.width = 0;
+    gBuffer.height = 0;
+    gBuffer.target = 0;
+}
+
+
+// Makes the G-buffer the render target and clears it, remembering the framebuffer the lighting pass returns to.
+// The textures follow the viewport size.
+void UBindGBuffer(GBuffer& gBuffer)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &gBuffer.target);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.fbo);
+
+    if (viewport[2] != gBuffer.width || viewport[3] != gBuffer.height)
+    {
+        glDeleteTextures(1, &gBuffer.albedo);
+        glDeleteTextures(1, &gBuffer.normal);
+        glDeleteTextures(1, &gBuffer.depth);
+
+        gBuffer.width = viewport[2];
+        gBuffer.height = viewport[3];
+
+        const GLenum formats[3] = { GL_RGBA8, GL_RG16F, GL_DEPTH_COMPONENT24 };
+        GLuint* textures[3] = { &gBuffer.albedo, &gBuffer.normal, &gBuffer.depth };
+        const GLenum attachments[3] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_DEPTH_ATTACHMENT };
+        for (int i = 0; i < 3; ++i)
+        {
+            glGenTextures(1, textures[i]);
+            glBindTexture(GL_TEXTURE_2D, *textures[i]);
+            glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], gBuffer.width, gBuffer.height);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, *textures[i], 0);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        const GLenum drawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, drawBuffers);
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "G-buffer framebuffer is incomplete" << endl;
+    }
+
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+
+// Returns to the frame's framebuffer and lights every covered pixel once with a full-screen triangle, using the
+// lighting variant of the current settings. The scene depth is written back as well, so passes after this one see it.
+void ULightGBuffer(GBuffer& gBuffer, const glm::mat4& view, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, gBuffer.target);
+
+    const GLProgram* program = UGetSceneProgram(SHADER_INPUT_NODE, SHADER_OUTPUT_DEFERRED_LIGHTING);
+    if (program == nullptr)
+        return;
+
+    glUseProgram(program->id);
+    USetFrameUniforms(*program, view, projection, cameraPosition);
+    glUniformMatrix4fv(program->inverseViewProjection, 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * view)));
+
+    const GLuint textures[3] = { gBuffer.albedo, gBuffer.normal, gBuffer.depth };
+    for (int i = 0; i < 3; ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+    }
+
+    glDepthFunc(GL_ALWAYS);
+    glBindVertexArray(gBuffer.emptyVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glDepthFunc(GL_LESS);
+
+    for (int i = 2; i >= 0; --i)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+}
+
+
+void UDestroyGBuffer(GBuffer& gBuffer)
+{
+    glDeleteFramebuffers(1, &gBuffer.fbo);
+    glDeleteVertexArrays(1, &gBuffer.emptyVao);
+    glDeleteTextures(1, &gBuffer.albedo);
+    glDeleteTextures(1, &gBuffer.normal);
+    glDeleteTextures(1, &gBuffer.depth);
+}
+
+
+// Creates the timestamp queries, the overlay quad and, when a filename is given, the trace file
+// (JSON in the Chrome trace event format when the name ends in .json, CSV otherwise)
+bool UCreateProfiler(Profiler& profiler, const char* traceFilename)
+{
+    for (ProfilerFrame& frame : profiler.frames)
+    {
+        glGenQueries(PROFILER_MAX_SCOPES * 2, &frame.queries[0][0]);
+        frame.pending = false;
+        frame.frameNumber = 0;
+    }
+    profiler.current = -1;
+    profiler.next = 0;
+    profiler.frameNumber = 0;
+    profiler.untimedFrames = 0;
+    profiler.lastReport = glfwGetTime();
+    profiler.showOverlay = false;
+
+    profiler.traceJson = false;
+    profiler.traceHasEvents = false;
+    profiler.traceCpuEpoch = -1.0;
+    profiler.traceGpuEpoch = 0;
+    if (traceFilename)
+    {
+        profiler.trace.open(traceFilename);
+        if (!profiler.trace)
+        {
+            cout << "Failed to open trace file " << traceFilename << endl;
+            return false;
+        }
+
+        const std::string name = traceFilename;
+        profiler.traceJson = name.size() >= 5 && name.compare(name.size() - 5, 5, ".json") == 0;
+        if (profiler.traceJson)
+            profiler.trace << "[\n";
+        else
+            profiler.trace << "frame,scope,depth,cpu_ms,gpu_ms\n";
+    }
+
+    // Unit quad, scaled and placed per bar by the overlay shader
+    const GLfloat quad[] = { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+    glGenVertexArrays(1, &profiler.overlayVao);
+    glBindVertexArray(profiler.overlayVao);
+    glGenBuffers(1, &profiler.overlayVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, profiler.overlayVbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+
+    profiler.overlayRect = glGetUniformLocation(gOverlayProgram.id, "rect");
+
+    return true;
+}
+
+
+// Reads back every query set the GPU is done with, oldest first, and opens the frame scope in the next free set.
+// A set is never reused before its results are read; when all of them are still in flight the frame is not timed.
+void UBeginProfilerFrame(Profiler& profiler)
+{
+    for (int i = 0; i < PROFILER_QUERY_FRAMES; ++i)
+    {
+        ProfilerFrame& frame = profiler.frames[(profiler.next + i) % PROFILER_QUERY_FRAMES];
+        if (!frame.pending)
+            continue;
+
+        // The frame scope's end is the last query of the set, so once it is available all of them are.
+        // The GPU finishes frames in order, so the later sets are not ready either.
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[0][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        UResolveProfilerFrame(profiler, frame);
+    }
+
+    profiler.openScopes.clear();
+    const long long frameNumber = profiler.frameNumber++;
+
+    ProfilerFrame& frame = profiler.frames[profiler.next];
+    if (frame.pending)
+    {
+        profiler.current = -1;
+        ++profiler.untimedFrames;
+        return;
+    }
+
+    profiler.current = profiler.next;
+    profiler.next = (profiler.next + 1) % PROFILER_QUERY_FRAMES;
+    frame.scopes.clear();
+    frame.frameNumber = frameNumber;
+
+    UBeginProfileScope(profiler, "frame");
+}
+
+
+// Closes the frame scope and, with the overlay on, reports the statistics in the window title
+void UEndProfilerFrame(Profiler& profiler, GLFWwindow* window)
+{
+    if (profiler.current >= 0)
+    {
+        UEndProfileScope(profiler, 0);
+        profiler.frames[profiler.current].pending = true;
+    }
+
+    double now = glfwGetTime();
+    if (now - profiler.lastReport < PROFILER_REPORT_INTERVAL || profiler.cpuHistory.empty())
+        return;
+    profiler.lastReport = now;
+
+    if (!profiler.showOverlay)
+    {
+        glfwSetWindowTitle(window, WINDOW_TITLE);
+        profiler.passStats.clear();
+        return;
+    }
+
+    std::vector<float> cpu(profiler.cpuHistory.begin(), profiler.cpuHistory.end());
+    std::vector<float> gpu(profiler.gpuHistory.begin(), profiler.gpuHistory.end());
+    float cpuAverage = 0.0f, gpuAverage = 0.0f;
+    for (size_t i = 0; i < cpu.size(); ++i)
+    {
+        cpuAverage += cpu[i] / cpu.size();
+        gpuAverage += gpu[i] / gpu.size();
+    }
+
+    char text[512];
+    int length = snprintf(text, sizeof(text), "%s | CPU %.2f ms (min %.2f, p99 %.2f) | GPU %.2f ms (min %.2f, p99 %.2f) |",
+        WINDOW_TITLE, cpuAverage, *std::min_element(cpu.begin(), cpu.end()), UPercentile(cpu, 99.0f),
+        gpuAverage, *std::min_element(gpu.begin(), gpu.end()), UPercentile(gpu, 99.0f));
+
+    // Per-pass averages since the last report, as CPU / GPU milliseconds
+    for (const ProfilePassStats& pass : profiler.passStats)
+    {
+        if (length < (int)sizeof(text))
+            length += snprintf(text + length, sizeof(text) - length, " %s %.2f/%.2f", pass.name, pass.cpuMs / pass.count, pass.gpuMs / pass.count);
+    }
+
+    if (profiler.untimedFrames > 0 && length < (int)sizeof(text))
+        snprintf(text + length, sizeof(text) - length, " | %d untimed", profiler.untimedFrames);
+
+    glfwSetWindowTitle(window, text);
+    profiler.passStats.clear();
+}
+
+
+// Starts a CPU timer and, unless gpuTimed is false, issues the opening GPU timestamp. Returns the scope to pass to
+// UEndProfileScope, -1 when the frame is out of scopes or not timed. Scopes nest and must be closed in reverse order.
+int UBeginProfileScope(Profiler& profiler, const char* name, bool gpuTimed)
+{
+    if (profiler.current < 0)
+        return -1;
+
+    ProfilerFrame& frame = profiler.frames[profiler.current];
+    if ((int)frame.scopes.size() == PROFILER_MAX_SCOPES)
+        return -1;
+
+    const int scope = (int)frame.scopes.size();
+
+    ProfileScope record;
+    record.name = name;
+    record.depth = (int)profiler.openScopes.size();
+    record.cpuBegin = glfwGetTime();
+    record.cpuMs = 0.0;
+    record.gpuBegin = 0;
+    record.gpuMs = 0.0;
+    record.gpuTimed = gpuTimed;
+    frame.scopes.push_back(record);
+    profiler.openScopes.push_back(scope);
+
+    if (gpuTimed)
+        glQueryCounter(frame.queries[scope][0], GL_TIMESTAMP);
+
+    return scope;
+}
+
+
+void UEndProfileScope(Profiler& profiler, int scope)
+{
+    if (scope < 0)
+        return;
+
+    ProfilerFrame& frame = profiler.frames[profiler.current];
+    if (frame.scopes[scope].gpuTimed)
+        glQueryCounter(frame.queries[scope][1], GL_TIMESTAMP);
+
+    frame.scopes[scope].cpuMs = (glfwGetTime() - frame.scopes[scope].cpuBegin) * 1000.0;
+    profiler.openScopes.pop_back();
+}
+
+
+// Reads the GPU times of a finished query set and adds the frame to the statistics and the trace
+void UResolveProfilerFrame(Profiler& profiler, ProfilerFrame& frame)
+{
+    double gpuBusy = 0.0;
+    for (size_t i = 0; i < frame.scopes.size(); ++i)
+    {
+        ProfileScope& scope = frame.scopes[i];
+        if (scope.gpuTimed)
+        {
+            GLuint64 begin = 0, end = 0;
+            glGetQueryObjectui64v(frame.queries[i][0], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(frame.queries[i][1], GL_QUERY_RESULT, &end);
+            scope.gpuBegin = begin;
+            scope.gpuMs = (end - begin) / 1.0e6;
+        }
+
+        if (scope.depth != 1)
+            continue;
+
+        // The frame scope spans the swap, so GPU time is counted from the passes only; CPU-only scopes add nothing
+        gpuBusy += scope.gpuMs;
+
+        auto pass = std::find_if(profiler.passStats.begin(), profiler.passStats.end(),
+            [&scope](const ProfilePassStats& stats) { return strcmp(stats.name, scope.name) == 0; });
+        if (pass == profiler.passStats.end())
+        {
+            profiler.passStats.push_back({ scope.name, 0.0, 0.0, 0 });
+            pass = profiler.passStats.end() - 1;
+        }
+        pass->cpuMs += scope.cpuMs;
+        pass->gpuMs += scope.gpuMs;
+        ++pass->count;
+    }
+
+    profiler.cpuHistory.push_back((float)frame.scopes[0].cpuMs);
+    profiler.gpuHistory.push_back((float)gpuBusy);
+    if ((int)profiler.cpuHistory.size() > PROFILER_HISTORY)
+    {
+        profiler.cpuHistory.pop_front();
+        profiler.gpuHistory.pop_front();
+    }
+
+    profiler.lastScopes = frame.scopes;
+
+    if (profiler.trace.is_open())
+        UWriteProfilerTrace(profiler, frame);
+
+    frame.pending = false;
+}
+
+
+// Appends a resolved frame to the trace: one CSV row per scope, or per scope one CPU event and, when GPU-timed, one GPU event in JSON
+void UWriteProfilerTrace(Profiler& profiler, const ProfilerFrame& frame)
+{
+    if (!profiler.traceJson)
+    {
+        // CPU-only scopes leave gpu_ms empty
+        for (const ProfileScope& scope : frame.scopes)
+        {
+            profiler.trace << frame.frameNumber << ',' << scope.name << ',' << scope.depth << ',' << scope.cpuMs << ',';
+            if (scope.gpuTimed)
+                profiler.trace << scope.gpuMs;
+            profiler.trace << '\n';
+        }
+        return;
+    }
+
+    // Timestamps are relative to the first traced frame, in microseconds; CPU events go on thread 1, GPU events on thread 2
+    if (profiler.traceCpuEpoch < 0.0)
+    {
+        profiler.traceCpuEpoch = frame.scopes[0].cpuBegin;
+        profiler.traceGpuEpoch = frame.scopes[0].gpuBegin;
+    }
+
+    for (const ProfileScope& scope : frame.scopes)
+    {
+        const double cpuTs = (scope.cpuBegin - profiler.traceCpuEpoch) * 1.0e6;
+        const double gpuTs = (double)(long long)(scope.gpuBegin - profiler.traceGpuEpoch) / 1.0e3;
+
+        profiler.trace << (profiler.traceHasEvents ? ",\n" : "")
+            << "{\"name\":\"" << scope.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << cpuTs << ",\"dur\":" << scope.cpuMs * 1.0e3
+            << ",\"args\":{\"frame\":" << frame.frameNumber << "}}";
+        if (scope.gpuTimed)
+            profiler.trace << ",\n"
+                << "{\"name\":\"" << scope.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":" << gpuTs << ",\"dur\":" << scope.gpuMs * 1.0e3
+                << ",\"args\":{\"frame\":" << frame.frameNumber << "}}";
+        profiler.traceHasEvents = true;
+    }
+}
+
+
+// Draws the last resolved frame as two stacked bars (CPU on top, GPU below), one colored segment per pass.
+// The bars span PROFILER_OVERLAY_BUDGET_MS; the white tick marks 16.7 ms.
+void UDrawProfilerOverlay(const Profiler& profiler)
+{
+    if (!profiler.showOverlay || profiler.lastScopes.empty())
+        return;
+
+    static const glm::vec3 passColors[] = {
+        glm::vec3(0.9f, 0.3f, 0.2f), glm::vec3(0.2f, 0.7f, 0.3f), glm::vec3(0.2f, 0.4f, 0.9f),
+        glm::vec3(0.9f, 0.8f, 0.2f), glm::vec3(0.7f, 0.3f, 0.8f), glm::vec3(0.2f, 0.8f, 0.8f)
+    };
+    const int nColors = sizeof(passColors) / sizeof(passColors[0]);
+
+    const float left = -0.95f, width = 0.8f, barHeight = 0.03f;
+    const float rows[2] = { -0.86f, -0.9f };   // CPU, GPU
+
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(gOverlayProgram.id);
+    glBindVertexArray(profiler.overlayVao);
+
+    // Background
+    glUniform3f(gOverlayProgram.objectColor, 0.1f, 0.1f, 0.1f);
+    glUniform4f(profiler.overlayRect, left, rows[1], width, rows[0] + barHeight - rows[1]);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    for (int row = 0; row < 2; ++row)
+    {
+        float x = left;
+        int color = 0;
+        for (const ProfileScope& scope : profiler.lastScopes)
+        {
+            if (scope.depth != 1)
+                continue;
+
+            const double ms = row == 0 ? scope.cpuMs : scope.gpuMs;
+            const float segment = std::min((float)ms / PROFILER_OVERLAY_BUDGET_MS * width, left + width - x);
+            const glm::vec3& c = passColors[color++ % nColors];
+
+            glUniform3f(gOverlayProgram.objectColor, c.r, c.g, c.b);
+            glUniform4f(profiler.overlayRect, x, rows[row], segment, barHeight);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+            x += segment;
+        }
+    }
+
+    glUniform3f(gOverlayProgram.objectColor, 1.0f, 1.0f, 1.0f);
+    glUniform4f(profiler.overlayRect, left + 16.7f / PROFILER_OVERLAY_BUDGET_MS * width, rows[1], 0.003f, rows[0] + barHeight - rows[1]);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    glEnable(GL_DEPTH_TEST);
+}
+
+
+void UDestroyProfiler(Profiler& profiler)
+{
+    // Frame numbers in the trace skip the untimed frames, so report how many there were
+    if (profiler.untimedFrames > 0)
+        cout << "Profiler: " << profiler.untimedFrames << " of " << profiler.frameNumber << " frames untimed, every query set was still in flight" << endl;
+
+    for (ProfilerFrame& frame : profiler.frames)
+        glDeleteQueries(PROFILER_MAX_SCOPES * 2, &frame.queries[0][0]);
+
+    glDeleteVertexArrays(1, &profiler.overlayVao);
+    glDeleteBuffers(1, &profiler.overlayVbo);
+
+    if (profiler.trace.is_open())
+    {
+        if (profiler.traceJson)
+            profiler.trace << "\n]\n";
+        profiler.trace.close();
+    }
+}
+
+
+// Returns the given percentile (0-100) of the values, nearest rank
+float UPercentile(std::vector<float> values, float percentile)
+{
+    if (values.empty())
+        return 0.0f;
+
+    size_t rank = (size_t)std::ceil(percentile / 100.0f * values.size());
+    rank = std::min(std::max(rank, (size_t)1), values.size()) - 1;
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+
+    return values[rank];
+}
+
+
+// Reads a camera path: one "x y z yaw pitch" control point per line, '#' starts a comment line
+bool ULoadCameraPath(const char* filename, std::vector<CameraKey>& path)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        cout << "Failed to open camera path " << filename << endl;
+        return false;
+    }
+
+    path.clear();
+    std::string line;
+    while (std::getline(file, line))
+    {
+        CameraKey key;
+        if (line.empty() || line[0] == '#')
+            continue;
+        if (sscanf(line.c_str(), "%f %f %f %f %f", &key.position.x, &key.position.y, &key.position.z, &key.yaw, &key.pitch) == 5)
+            path.push_back(key);
+    }
+
+    if (path.size() < 2)
+    {
+        cout << "Camera path " << filename << " needs at least two control points" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Samples the path at t in [0, 1] with a Catmull-Rom spline through the control points
+CameraKey USampleCameraPath(const std::vector<CameraKey>& path, float t)
+{
+    const int nSegments = (int)path.size() - 1;
+    float u = glm::clamp(t, 0.0f, 1.0f) * nSegments;
+    int segment = std::min((int)u, nSegments - 1);
+    u -= segment;
+
+    // End segments repeat their outer control point
+    const CameraKey& p0 = path[std::max(segment - 1, 0)];
+    const CameraKey& p1 = path[segment];
+    const CameraKey& p2 = path[segment + 1];
+    const CameraKey& p3 = path[std::min(segment + 2, nSegments)];
+
+    const float u2 = u * u, u3 = u2 * u;
+    const float w0 = -0.5f * u3 + u2 - 0.5f * u;
+    const float w1 = 1.5f * u3 - 2.5f * u2 + 1.0f;
+    const float w2 = -1.5f * u3 + 2.0f * u2 + 0.5f * u;
+    const float w3 = 0.5f * u3 - 0.5f * u2;
+
+    CameraKey key;
+    key.position = w0 * p0.position + w1 * p1.position + w2 * p2.position + w3 * p3.position;
+    key.yaw = w0 * p0.yaw + w1 * p1.yaw + w2 * p2.yaw + w3 * p3.yaw;
+    key.pitch = w0 * p0.pitch + w1 * p1.pitch + w2 * p2.pitch + w3 * p3.pitch;
+
+    return key;
+}
+
+
+void UApplyCameraKey(Camera& camera, const CameraKey& key)
+{
+    camera.Position = key.position;
+    camera.Yaw = key.yaw;
+    camera.Pitch = key.pitch;
+    camera.ProcessMouseMovement(0.0f, 0.0f); // Recomputes the camera vectors
+}
+
+
+// Creates the offscreen framebuffer the benchmark renders into, the same size as the window
+bool UCreateBenchmarkTarget(Benchmark& bench)
+{
+    glGenRenderbuffers(1, &bench.colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, bench.colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, WINDOW_WIDTH, WINDOW_HEIGHT);
+
+    glGenRenderbuffers(1, &bench.depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, bench.depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, WINDOW_WIDTH, WINDOW_HEIGHT);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &bench.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, bench.fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, bench.colorBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, bench.depthBuffer);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "Benchmark framebuffer is incomplete" << endl;
+        return false;
+    }
+
+    glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+
+    return true;
+}
+
+
+// Benchmarks the scene along the camera path, or runs the stress sweep, then prints the results
+bool URunBenchmark(Benchmark& bench)
+{
+    cout << "INFO: Benchmark on " << glGetString(GL_RENDERER) << ", " << bench.nFrames << " frames" << endl;
+
+    if (!UCreateBenchmarkTarget(bench))
+        return false;
+
+    // Finish streaming first so every measured frame samples the final textures
+    while (!UTextureLoaderIdle(gTextureLoader))
+    {
+        UUpdateTextureLoader(gTextureLoader, gMaterialTextures);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    glFinish();
+
+    bool succeeded = true;
+    if (bench.stressCounts.empty())
+    {
+        const double seconds = UBenchmarkFrames(bench);
+        const char* pathNames[] = { "naive", "instanced", "indirect", "gpu-culled" };
+
+        cout << "BENCH renderer=\"" << glGetString(GL_RENDERER) << "\" path=" << pathNames[gRenderPath] << " shading=" << SHADING_MODE_NAMES[gShadingMode]
+            << " prepass=" << (gDepthPrepass ? "on" : "off") << " lighting=" << LIGHTING_MODEL_NAMES[gLightingModel] << " textured=" << (gTextured ? "on" : "off")
+            << " frames=" << bench.nFrames << " seconds=" << seconds << " fps=" << bench.nFrames / seconds << endl;
+        UPrintBenchmarkStats("frame_ms", bench.frameMs);
+        UPrintBenchmarkStats("latency_ms", bench.latencyMs);
+    }
+    else
+    {
+        succeeded = URunStressBenchmark(bench);
+    }
+
+    UDestroyBenchmarkTarget(bench);
+
+    return succeeded;
+}
+
+
+// Renders BENCH_WARMUP_FRAMES + nFrames frames along the camera path, filling frameMs and latencyMs.
+// Returns the wall time of the measured frames in seconds.
+// Latency is measured from the start of a frame to when the CPU sees its fence signaled, which happens
+// BENCH_FRAMES_IN_FLIGHT frames later, so it is an upper bound at frame granularity.
+double UBenchmarkFrames(Benchmark& bench)
+{
+    GLsync fences[BENCH_FRAMES_IN_FLIGHT] = {};
+    double frameBegins[BENCH_FRAMES_IN_FLIGHT] = {};
+    int fenceFrames[BENCH_FRAMES_IN_FLIGHT] = {};
+    const int nTotal = BENCH_WARMUP_FRAMES + bench.nFrames;
+    double runBegin = 0.0;
+    double previousBegin = 0.0;
+    double visibleSum = 0.0;
+
+    bench.frameMs.clear();
+    bench.latencyMs.clear();
+
+    for (int frame = 0; frame <= nTotal; ++frame)
+    {
+        // Wait for the frame that used this slot; the extra iteration drains the last one
+        const int slot = frame % BENCH_FRAMES_IN_FLIGHT;
+        for (int i = 0; i < BENCH_FRAMES_IN_FLIGHT; ++i)
+        {
+            if (!fences[i] || (i != slot && frame < nTotal))
+                continue;
+
+            glClientWaitSync(fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            if (fenceFrames[i] >= BENCH_WARMUP_FRAMES)
+                bench.latencyMs.push_back((float)((glfwGetTime() - frameBegins[i]) * 1000.0));
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+
+        if (frame == nTotal)
+            break;
+
+        const double begin = glfwGetTime();
+        if (frame == BENCH_WARMUP_FRAMES)
+            runBegin = begin;
+        else if (frame > BENCH_WARMUP_FRAMES)
+            bench.frameMs.push_back((float)((begin - previousBegin) * 1000.0));
+        previousBegin = begin;
+
+        // Warm-up frames hold the first pose
+        const int measured = std::max(frame - BENCH_WARMUP_FRAMES, 0);
+        UApplyCameraKey(gCamera, USampleCameraPath(bench.path, bench.nFrames > 1 ? (float)measured / (bench.nFrames - 1) : 0.0f));
+        gDeltaTime = BENCH_DELTA_TIME;
+
+        UBeginProfilerFrame(gProfiler);
+        URender();
+        UEndProfilerFrame(gProfiler, gWindow);
+
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        frameBegins[slot] = begin;
+        fenceFrames[slot] = frame;
+        glFlush();
+
+        // Only the CPU paths update scene.visible: the GPU-culled count comes from the delayed command readback, and
+        // the indirect path draws every node
+        if (frame >= BENCH_WARMUP_FRAMES)
+        {
+            if (gRenderPath == RENDER_PATH_GPU_CULLED)
+                visibleSum += gGpuCulling.visibleCount;
+            else if (gRenderPath == RENDER_PATH_INDIRECT)
+                visibleSum += gIndirectDraws.objects.size();
+            else
+                visibleSum += std::count(gScene.visible.begin(), gScene.visible.end(), 1);
+        }
+
+        glfwPollEvents();
+    }
+
+    bench.visibleObjects = bench.nFrames > 0 ? visibleSum / bench.nFrames : 0.0;
+
+    return glfwGetTime() - runBegin;
+}
+
+
+// Replaces the scene with generated grids of each size and benchmarks every render path on each.
+// Prints one STRESS line per measurement and, with --stress-out, writes the same data as CSV.
+bool URunStressBenchmark(Benchmark& bench)
+{
+    std::ofstream csv;
+    if (!bench.stressOutFilename.empty())
+    {
+        csv.open(bench.stressOutFilename);
+        if (!csv)
+        {
+            cout << "Failed to open " << bench.stressOutFilename << endl;
+            return false;
+        }
+        csv << "path,objects,visible,frames,seconds,fps,avg_ms,p50_ms,p95_ms,p99_ms,max_ms,shading,prepass,lighting,textured\n";
+    }
+
+    const RenderPath paths[] = { RENDER_PATH_NAIVE, RENDER_PATH_INSTANCED, RENDER_PATH_INDIRECT, RENDER_PATH_GPU_CULLED };
+    const char* pathNames[] = { "naive", "instanced", "indirect", "gpu-culled" };
+
+    UMakeStressCameraPath(bench.path);
+
+    for (int count : bench.stressCounts)
+    {
+        UCreateStressScene(gScene, gMeshArena, count, bench.stressSeed);
+        UCreateInstances(gMeshArena, gScene);
+        if (gIndirectSupported)
+            UBuildIndirectDraws(gIndirectDraws, gScene, gMeshArena);
+        if (gGpuCullingSupported)
+            UBuildGpuCulling(gGpuCulling, gScene, gMeshArena);
+        gHiZ.valid = false;
+
+        for (RenderPath path : paths)
+        {
+            if ((path == RENDER_PATH_INDIRECT && !gIndirectSupported) || (path == RENDER_PATH_GPU_CULLED && !gGpuCullingSupported))
+                continue;
+
+            gRenderPath = path;
+            const double seconds = UBenchmarkFrames(bench);
+
+            float average = 0.0f;
+            for (float ms : bench.frameMs)
+                average += ms / bench.frameMs.size();
+            const float maxMs = bench.frameMs.empty() ? 0.0f : *std::max_element(bench.frameMs.begin(), bench.frameMs.end());
+
+            cout << "STRESS path=" << pathNames[path] << " shading=" << SHADING_MODE_NAMES[gShadingMode] << " prepass=" << (gDepthPrepass ? "on" : "off")
+                << " lighting=" << LIGHTING_MODEL_NAMES[gLightingModel] << " textured=" << (gTextured ? "on" : "off") << " objects=" << count << " visible=" << (long long)bench.visibleObjects
+                << " fps=" << bench.nFrames / seconds << " frame_ms avg=" << average << " p50=" << UPercentile(bench.frameMs, 50.0f)
+                << " p95=" << UPercentile(bench.frameMs, 95.0f) << " p99=" << UPercentile(bench.frameMs, 99.0f) << " max=" << maxMs << endl;
+
+            if (csv.is_open())
+            {
+                csv << pathNames[path] << ',' << count << ',' << (long long)bench.visibleObjects << ',' << bench.nFrames << ',' << seconds << ','
+                    << bench.nFrames / seconds << ',' << average << ',' << UPercentile(bench.frameMs, 50.0f) << ','
+                    << UPercentile(bench.frameMs, 95.0f) << ',' << UPercentile(bench.frameMs, 99.0f) << ',' << maxMs << ','
+                    << SHADING_MODE_NAMES[gShadingMode] << ',' << (gDepthPrepass ? "on" : "off") << ','
+                    << LIGHTING_MODEL_NAMES[gLightingModel] << ',' << (gTextured ? "on" : "off") << '\n';
+                csv.flush(); // Keep finished points if a large run is interrupted
+            }
+        }
+    }
+
+    return true;
+}
+
+
+// Fills the scene with count towers and bushes on a square grid fitted into STRESS_FOOTPRINT.
+// Each node copies the mesh and material of a tower or bush of the real scene, so the texture arrays are used the
+// same way. That choice, scale, rotation and a jitter inside the grid cell all come from a generator seeded with
+// seed, so a seed always produces the same scene.
+void UCreateStressScene(Scene& scene, const MeshArena& arena, int count, unsigned int seed)
+{
+    std::vector<const SceneObjectDesc*> props;
+    for (const SceneObjectDesc& object : gSceneObjects)
+    {
+        if (object.mesh != MESH_GROUND && object.mesh != MESH_SKY)
+            props.push_back(&object);
+    }
+
+    scene.nodes.clear();
+    scene.boundsX.clear();
+    scene.boundsY.clear();
+    scene.boundsZ.clear();
+    scene.boundsRadius.clear();
+    scene.visible.clear();
+    scene.lod.clear();
+    scene.normalMatrices.clear();
+
+    std::mt19937 rng(seed);
+    const int side = (int)std::ceil(std::sqrt((double)count));
+    const float spacing = STRESS_FOOTPRINT / side;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const SceneObjectDesc& prop = *props[rng() % props.size()];
+        const int mesh = prop.mesh;
+        const int material = prop.material;
+        const float scale = spacing * (0.2f + 0.3f * URandom01(rng));
+        const float yaw = 360.0f * URandom01(rng);
+
+        // Cell center plus jitter, resting on y = 0
+        glm::vec3 position;
+        position.x = (i % side + 0.25f + 0.5f * URandom01(rng)) * spacing - 0.5f * STRESS_FOOTPRINT;
+        position.z = (i / side + 0.25f + 0.5f * URandom01(rng)) * spacing - 0.5f * STRESS_FOOTPRINT;
+        position.y = -arena.meshes[mesh].boundsMin.y * scale;
+
+        UAddSceneNode(scene, -1, mesh, material, position, glm::vec3(0.0f, yaw, 0.0f), glm::vec3(scale));
+    }
+}
+
+
+// Parses a comma-separated list of positive counts, such as "1000,10000". Returns false on anything else.
+bool UParseCountList(const char* text, std::vector<int>& counts)
+{
+    counts.clear();
+
+    const char* cursor = text;
+    for (;;)
+    {
+        char* end;
+        errno = 0;
+        const long count = strtol(cursor, &end, 10);
+        if (end == cursor || errno == ERANGE || count <= 0 || count > INT_MAX || (*end != ',' && *end != '\0'))
+            return false;
+
+        counts.push_back((int)count);
+        if (*end == '\0')
+            return true;
+        cursor = end + 1;
+    }
+}
+
+
+// Parses a whole argument as an integer of at least minimum. Returns false, leaving value alone, on anything else.
+bool UParseInt(const char* text, int minimum, int& value)
+{
+    char* end;
+    errno = 0;
+    const long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < minimum || parsed > INT_MAX)
+        return false;
+
+    value = (int)parsed;
+    return true;
+}
+
+
+// Orbit around the stress grid, looking down at its center
+void UMakeStressCameraPath(std::vector<CameraKey>& path)
+{
+    const int nKeys = 8;
+
+    path.clear();
+    for (int i = 0; i <= nKeys; ++i)
+    {
+        const float angle = 360.0f * i / nKeys;
+
+        CameraKey key;
+        key.position = glm::vec3(STRESS_CAMERA_RADIUS * std::cos(glm::radians(angle)), STRESS_CAMERA_HEIGHT,
+            STRESS_CAMERA_RADIUS * std::sin(glm::radians(angle)));
+        key.yaw = angle + 180.0f;   // Toward the center
+        key.pitch = -glm::degrees(std::atan(STRESS_CAMERA_HEIGHT / STRESS_CAMERA_RADIUS));
+        path.push_back(key);
+    }
+}
+
+
+// Uniform float in [0, 1) from the raw generator output; unlike std::uniform_real_distribution
+// this gives the same sequence with every standard library
+float URandom01(std::mt19937& rng)
+{
+    return (rng() >> 8) * (1.0f / 16777216.0f);
+}
+
+
+// Prints one "BENCH <label> avg= p50= p95= p99= max=" line
+void UPrintBenchmarkStats(const char* label, const std::vector<float>& values)
+{
+    if (values.empty())
+        return;
+
+    float average = 0.0f;
+    for (float value : values)
+        average += value / values.size();
+
+    cout << "BENCH " << label << " avg=" << average << " p50=" << UPercentile(values, 50.0f) << " p95=" << UPercentile(values, 95.0f)
+        << " p99=" << UPercentile(values, 99.0f) << " max=" << *std::max_element(values.begin(), values.end()) << endl;
+}
+
+
+void UDestroyBenchmarkTarget(Benchmark& bench)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &bench.fbo);
+    glDeleteRenderbuffers(1, &bench.colorBuffer);
+    glDeleteRenderbuffers(1, &bench.depthBuffer);
+}
+
+
+// Implements the UCreateMesh function
+void UCreateMesh(MeshArena& arena, const std::vector<const char*>& meshFiles)
+{
+
+    // Ground
+    GLfloat groundVerts[] = {
+    //Positions          //Normals         //Texture Coords.
+    // ------------------------------------------------------
+    -1.0f, -0.1f, 1.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
+    1.0f, -0.1f, -1.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
+    -1.0f, -0.1f, -1.0f, 0.0f, 1.0f, 0.0f,  0.0f, 1.0f,
+    -1.0f, -0.1f, 1.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
+    1.0f, -0.1f, -1.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
+    1.0f, -0.1f, 1.0f,   0.0f, 1.0f, 0.0f,  1.0f, 0.0f
+    };
+
+    // Sky
+    GLfloat skyVerts[] = {
+        //Positions          //Normals         //Texture Coords.
+        // ------------------------------------------------------
+        -3.0f, -0.3f, 3.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
+        3.0f, -0.3f, -3.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
+        -3.0f, -0.3f, -3.0f, 0.0f, 1.0f, 0.0f,  0.0f, 1.0f,
+        -3.0f, -0.3f, 3.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f,
+        3.0f, -0.3f, -3.0f,  0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
+        3.0f, -0.3f, 3.0f,   0.0f, 1.0f, 0.0f,  1.0f, 0.0f
+    };
+
+    // Tower Tall Wide  
+    GLfloat towerWideVerts[] = {
+    //Positions          //Normals         //Texture Coords.
+    // ------------------------------------------------------
+    //Back Face          //Negative Z Normal 
+    -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+    0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+    0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+    -0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+    -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+    //Front Face         //Positive Z Normal
+    -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+    0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+    0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+    0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+    -0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+    -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+    //Left Face           //Negative X Normal
+     -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+     -0.5f,  2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+     -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+     -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+     -0.5f, -2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+     -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+    //Right Face         //Positive X Normal
+     0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+     0.5f,  2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+     0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+     0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+     0.5f, -2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+     0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+    //Bottom Face        //Negative Y Normal
+    -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+     0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+     0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+     0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+    -0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+    //Top Face           //Positive Y Normal
+   -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+    0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+    0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+    0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+   -0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+   -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    // Tower Skinny 
+    GLfloat towerSkinnyVerts[] = {
+        //Positions          //Normals         //Texture Coords.
+        // ------------------------------------------------------
+        //Back Face          //Negative Z Normal 
+        -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+        0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+        0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+        0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+        -0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+        -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+        //Front Face         //Positive Z Normal
+        -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+        0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+        0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+        0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+        -0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+        -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+        //Left Face           //Negative X Normal
+         -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+         -0.5f,  4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+         -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+         -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+         -0.5f, -4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+         -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+         //Right Face         //Positive X Normal
+          0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+          0.5f,  4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+          0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+          0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+          0.5f, -4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
           0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
 
-          //Bottom Face        //Negative Y Normal
-          -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-           0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-           0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-           0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-          -0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-          -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+          //Bottom Face        //Negative Y Normal
+          -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+           0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+           0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+           0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+          -0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+          -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+          //Top Face           //Positive Y Normal
+         -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+          0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+          0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+          0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+         -0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+         -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    // Tower Tall Skinny 
+    GLfloat towerTallSkinnyVerts[] = {
+            //Positions          //Normals         //Texture Coords.
+            // ------------------------------------------------------
+            //Back Face          //Negative Z Normal 
+            -0.5f, -6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+            0.5f, -6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+            0.5f,  6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+            0.5f,  6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+            -0.5f,  6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+            -0.5f, -6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+            //Front Face         //Positive Z Normal
+            -0.5f, -6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+            0.5f, -6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+            0.5f,  6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+            0.5f,  6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+            -0.5f,  6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+            -0.5f, -6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+            //Left Face           //Negative X Normal
+             -0.5f,  6.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+             -0.5f,  6.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+             -0.5f, -6.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+             -0.5f, -6.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+             -0.5f, -6.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+             -0.5f,  6.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+             //Right Face         //Positive X Normal
+              0.5f,  6.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+              0.5f,  6.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+              0.5f, -6.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+              0.5f, -6.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+              0.5f, -6.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+              0.5f,  6.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+              //Bottom Face        //Negative Y Normal
+              -0.5f, -6.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+               0.5f, -6.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+               0.5f, -6.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+               0.5f, -6.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+              -0.5f, -6.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+              -0.5f, -6.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+              //Top Face           //Positive Y Normal
+             -0.5f,  6.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+              0.5f,  6.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+              0.5f,  6.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+              0.5f,  6.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+             -0.5f,  6.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+             -0.5f,  6.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    // Tower with Cap 
+    GLfloat towerCapVerts[] = {
+    //Positions          //Normals         //Texture Coords.
+    // ------------------------------------------------------
+    // Tower Body
+    //Back Face          //Negative Z Normal 
+    -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+    0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+    0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+    -0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+    -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+    //Front Face         //Positive Z Normal
+    -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+    0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+    0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+    0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+    -0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+    -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+    //Left Face           //Negative X Normal
+    -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f,  4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+    -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+    -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+    -0.5f, -4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+    -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+    //Right Face         //Positive X Normal
+    0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    0.5f,  4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+    0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+    0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+    0.5f, -4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+    0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+    //Bottom Face        //Negative Y Normal
+    -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+    0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+    0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+    0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+    -0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+    //Top Face           //Positive Y Normal
+    -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+    0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+    0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+    0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+    -0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+    -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+
+    // Tower Top
+    // Front
+    -0.5f, 4.5f, 0.5f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 5.5f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
+    0.5f, 4.5f, 0.5f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+
+    // Back
+    -0.5f, 4.5f, -0.5f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+     0.0f, 5.5f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
+    0.5f, 4.5f, -0.5f, 0.0f, 0.0f, -1.0f, 1.0f, 0.0f,
+
+    // Right
+   0.5f, 4.5f, -0.5f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    0.5f, 4.5f, 0.5f, 0.0f, 1.0f, 0.0f, 1.0f, 0.0f,
+     0.0f, 5.5f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+
+    // Left
+   -0.5f, 4.5f, 0.5f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -0.5f, 4.5f, -0.5f, -1.0f, 0.0f, 0.0f, 1.0f, 0.0f,
+     0.0f, 5.5f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f
+
+};
+
+    // Small tower
+    GLfloat towerSmallVerts[] = {
+        //Positions          //Normals         //Texture Coords.
+        // ------------------------------------------------------
+        //Back Face          //Negative Z Normal 
+        -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+        0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
+        0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+        0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
+        -0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
+        -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+
+        //Front Face         //Positive Z Normal
+        -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+        0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+        0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+        0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+        -0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+        -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+        //Left Face           //Negative X Normal
+         -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+         -0.5f,  2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+         -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+         -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+         -0.5f, -2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+         -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+         //Right Face         //Positive X Normal
+          0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+          0.5f,  2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
+          0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+          0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
+          0.5f, -2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
+          0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+
+          //Bottom Face        //Negative Y Normal
+          -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+           0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+           0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+           0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+          -0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+          -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+          //Top Face           //Positive Y Normal
+         -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+          0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+          0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+          0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+         -0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+         -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    // Bush
+    GLfloat bushVerts[] = {
+    //Positions          //Normals         //Texture Coords.
+    // ------------------------------------------------------
+    // Base 
+    -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    -0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+
+    // Side #1
+    -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -1.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    -0.7f, 1.0f, -0.7f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -0.7f, 0.0f, -0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    -0.7f, 1.0f, -0.7f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+
+    // Side #2
+    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+    -0.7f, 1.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, -1.0f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, -1.0f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+
+    // Side #3
+    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
+    0.7f, 1.0f, -0.7f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+    0.7f, 0.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
+    0.7f, 1.0f, -0.7f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+
+    // Side #4
+    0.7f, 0.0f, -0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.7f, 1.0f, -0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    0.7f, 0.0f, -0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+
+    // Side #5
+    1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.7f, 1.0f, 0.7f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    0.7f, 0.0f, 0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    0.7f, 1.0f, 0.7f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+
+    // Side #6
+    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+    0.7f, 1.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+
+    // Side #7
+    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
+    -0.7f, 1.0f, 0.7f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+    -0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
+    -0.7f, 1.0f, 0.7f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+
+    // Side #8
+    -0.7f, 0.0f, 0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -0.7f, 1.0f, 0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    -1.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    -0.7f, 0.0f, 0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+    -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
+    -1.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+
+    // Top 
+    -1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    -0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    -0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, -1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    0.0f, 1.0f, -1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    -0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+    -0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
+    -1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
+  
+};
+        
+    const GLuint floatsPerVertex = 3;
+    const GLuint floatsPerNormal = 3;
+    const GLuint floatsPerUV = 2;
+
+    const GLuint floatsPerVertexTotal = floatsPerVertex + floatsPerNormal + floatsPerUV;
+
+    // Add the meshes in MeshId order so each arena index matches its enum value
+    UAddMesh(arena, groundVerts, sizeof(groundVerts) / (sizeof(groundVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, towerWideVerts, sizeof(towerWideVerts) / (sizeof(towerWideVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, towerSkinnyVerts, sizeof(towerSkinnyVerts) / (sizeof(towerSkinnyVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, towerTallSkinnyVerts, sizeof(towerTallSkinnyVerts) / (sizeof(towerTallSkinnyVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, towerCapVerts, sizeof(towerCapVerts) / (sizeof(towerCapVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, towerSmallVerts, sizeof(towerSmallVerts) / (sizeof(towerSmallVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, skyVerts, sizeof(skyVerts) / (sizeof(skyVerts[0]) * floatsPerVertexTotal));
+    UAddMesh(arena, bushVerts, sizeof(bushVerts) / (sizeof(bushVerts[0]) * floatsPerVertexTotal));
+
+    // Imported meshes follow the built-in ones
+    for (const char* filename : meshFiles)
+    {
+        if (!UImportMesh(arena, filename))
+            cout << "Skipping mesh " << filename << endl;
+    }
+
+    UUploadMeshArena(arena);
+}
+
+
+// Deduplicates a triangle-soup vertex array into an indexed mesh appended to the arena.
+// Returns the index of the new mesh.
+int UAddMesh(MeshArena& arena, const GLfloat* verts, GLuint nVertices)
+{
+    const GLuint floatsPerVertexTotal = 8;
+
+    GLMesh mesh;
+    mesh.baseVertex = (GLint)(arena.vertices.size() / floatsPerVertexTotal);
+    mesh.firstIndex = (GLuint)arena.indices.size();
+    mesh.nIndices = (GLsizei)nVertices;
+    mesh.imported = false;
+
+    // Indices are relative to the mesh base vertex, so meshes can be drawn with glDraw*BaseVertex
+    std::vector<GLfloat> vertices;
+    std::vector<GLuint> indices;
+    mesh.nVertices = UIndexVertices(verts, nVertices, vertices, indices);
+    UOptimizeMesh(vertices, indices, "mesh " + std::to_string(arena.meshes.size()), gMeshReport);
+
+    arena.vertices.insert(arena.vertices.end(), vertices.begin(), vertices.end());
+    arena.indices.insert(arena.indices.end(), indices.begin(), indices.end());
+
+    // Built-in meshes have a single detail level
+    mesh.nLods = 1;
+    mesh.lodFirstIndex[0] = mesh.firstIndex;
+    mesh.lodIndexCount[0] = mesh.nIndices;
+
+    // Bounding volumes used by frustum culling
+    UComputeMeshBounds(mesh, vertices.data(), mesh.nVertices);
+    mesh.dequantize = glm::mat4(1.0f); // Set by UUploadMeshArena for compact vertices
+
+    arena.meshes.push_back(mesh);
+
+    return (int)arena.meshes.size() - 1;
+}
+
+
+// Appends the unique vertices of a triangle soup to vertices and one index per soup vertex to indices.
+// Indices are relative to the first appended vertex. Returns the number of unique vertices.
+GLuint UIndexVertices(const GLfloat* verts, GLuint nVertices, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices)
+{
+    const GLuint floatsPerVertexTotal = 8;
+
+    GLuint nUnique = 0;
+    std::unordered_map<PackedVertex, GLuint, PackedVertexHash> uniqueVertices;
+    for (GLuint i = 0; i < nVertices; ++i)
+    {
+        PackedVertex vertex;
+        memcpy(vertex.data, verts + i * floatsPerVertexTotal, sizeof(vertex.data));
+
+        auto found = uniqueVertices.find(vertex);
+        if (found == uniqueVertices.end())
+        {
+            found = uniqueVertices.emplace(vertex, nUnique++).first;
+            vertices.insert(vertices.end(), vertex.data, vertex.data + floatsPerVertexTotal);
+        }
+
+        indices.push_back(found->second);
+    }
+
+    return nUnique;
+}
+
+
+// Sets the local-space bounding box and bounding sphere of a mesh from its vertices
+void UComputeMeshBounds(GLMesh& mesh, const GLfloat* vertices, GLuint nVertices)
+{
+    const GLuint floatsPerVertexTotal = 8;
+
+    glm::vec3 boundsMin(1e30f);
+    glm::vec3 boundsMax(-1e30f);
+
+    for (GLuint i = 0; i < nVertices; ++i)
+    {
+        const GLfloat* v = vertices + i * floatsPerVertexTotal;
+        boundsMin = glm::min(boundsMin, glm::vec3(v[0], v[1], v[2]));
+        boundsMax = glm::max(boundsMax, glm::vec3(v[0], v[1], v[2]));
+    }
+
+    // Sphere around the box center, grown to the farthest vertex (tighter than the box corner)
+    glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+    float radius = 0.0f;
+    for (GLuint i = 0; i < nVertices; ++i)
+    {
+        const GLfloat* v = vertices + i * floatsPerVertexTotal;
+        radius = std::max(radius, glm::length(glm::vec3(v[0], v[1], v[2]) - center));
+    }
+
+    mesh.boundsMin = boundsMin;
+    mesh.boundsMax = boundsMax;
+    mesh.boundingSphere = glm::vec4(center, radius);
+}
+
+
+// Sends the arena vertices and indices to the GPU and describes them with one VAO.
+// Imported meshes are copied from their mapped cache entries, which are released afterwards.
+void UUploadMeshArena(MeshArena& arena)
+{
+    const GLuint floatsPerVertex = 3;
+    const GLuint floatsPerNormal = 3;
+    const GLuint floatsPerUV = 2;
+
+    const GLMesh& last = arena.meshes.back();
+    const GLsizeiptr vertexSize = arena.format == VERTEX_FORMAT_COMPACT ? sizeof(CompactVertex) : sizeof(GLfloat) * 8;
+    const GLsizeiptr nVertices = last.baseVertex + last.nVertices;
+    const GLsizeiptr nIndices = last.firstIndex + last.nIndices;
+
+    glGenVertexArrays(1, &arena.vao);
+    glBindVertexArray(arena.vao);
+
+    glGenBuffers(1, &arena.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, arena.vbo); // Activates the buffer
+    glBufferData(GL_ARRAY_BUFFER, vertexSize * nVertices, NULL, GL_STATIC_DRAW);
+
+    glGenBuffers(1, &arena.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.ebo); // Recorded in the VAO
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * nIndices, NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLuint) * arena.indices.size(), arena.indices.data());
+
+    if (arena.format == VERTEX_FORMAT_COMPACT)
+    {
+        std::vector<CompactVertex> compact;
+        UEncodeCompactVertices(arena, compact);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(CompactVertex) * compact.size(), compact.data());
+
+        // Normalized attributes are expanded to floats by the vertex fetch, so the shaders are unchanged
+        const GLsizei compactStride = sizeof(CompactVertex);
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, compactStride, (void*)offsetof(CompactVertex, position));
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, compactStride, (void*)offsetof(CompactVertex, normal));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, compactStride, (void*)offsetof(CompactVertex, textureCoordinate));
+        glEnableVertexAttribArray(2);
+    }
+    else
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * arena.vertices.size(), arena.vertices.data()); // Sends vertex or coordinate data to the GPU
+
+        // Strides between vertex coordinates is 8 (x, y, z, nx, ny, nz, u, v). A tightly packed stride is 0.
+        GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+
+        // Create Vertex Attribute Pointers
+        glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+        glEnableVertexAttribArray(2);
+    }
+
+    // Imported meshes go straight from the mapped cache entries to the buffers
+    for (ImportedMesh& imported : arena.imported)
+    {
+        const GLMesh& mesh = arena.meshes[imported.mesh];
+        glBufferSubData(GL_ARRAY_BUFFER, vertexSize * mesh.baseVertex, vertexSize * mesh.nVertices, imported.vertices);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * mesh.firstIndex, sizeof(GLuint) * mesh.nIndices, imported.indices);
+        UUnmapFile(imported.file);
+    }
+    arena.imported.clear();
+
+    glBindVertexArray(0);
+}
+
+
+// Encodes the arena vertices as CompactVertex and sets each mesh's dequantize matrix.
+// Positions are stored relative to the mesh bounding box, so the model matrix gets the box scale and offset.
+// That scale would also reach the normals through the normal matrix, so normals are stored pre-multiplied by it:
+// inverse(transpose(W * D)) * (D * n) = inverse(transpose(W)) * n for the diagonal box scale D.
+void UEncodeCompactVertices(MeshArena& arena, std::vector<CompactVertex>& compact)
+{
+    const GLuint floatsPerVertexTotal = 8;
+
+    compact.resize(arena.vertices.size() / floatsPerVertexTotal);
+
+    for (GLMesh& mesh : arena.meshes)
+    {
+        // Imported meshes were encoded when their cache entry was written
+        if (mesh.imported)
+            continue;
+
+        const glm::vec3 extent = UCompactExtent(mesh);
+        mesh.dequantize = glm::translate(mesh.boundsMin) * glm::scale(extent);
+
+        for (GLuint i = 0; i < mesh.nVertices; ++i)
+            compact[mesh.baseVertex + i] = UEncodeCompactVertex(&arena.vertices[(mesh.baseVertex + i) * floatsPerVertexTotal], mesh.boundsMin, extent);
+    }
+}
+
+
+// Size of the box compact positions are stored in. Flat meshes (ground, sky) keep a tiny extent on their flat axis
+// so the dequantize matrix stays invertible.
+glm::vec3 UCompactExtent(const GLMesh& mesh)
+{
+    return glm::max(mesh.boundsMax - mesh.boundsMin, glm::vec3(1e-4f));
+}
+
+
+// Encodes one interleaved float vertex (see UEncodeCompactVertices)
+CompactVertex UEncodeCompactVertex(const GLfloat* vertex, glm::vec3 boundsMin, glm::vec3 extent)
+{
+    CompactVertex out;
+
+    glm::vec3 position = (glm::vec3(vertex[0], vertex[1], vertex[2]) - boundsMin) / extent;
+    out.position[0] = glm::packUnorm1x16(position.x);
+    out.position[1] = glm::packUnorm1x16(position.y);
+    out.position[2] = glm::packUnorm1x16(position.z);
+    out.position[3] = 0;
+
+    glm::vec3 normal = glm::vec3(vertex[3], vertex[4], vertex[5]) * extent;
+    float length = glm::length(normal);
+    if (length > 0.0f)
+        normal /= length;
+    out.normal = glm::packSnorm3x10_1x2(glm::vec4(normal, 0.0f));
+
+    out.textureCoordinate = glm::packHalf2x16(glm::vec2(vertex[6], vertex[7]));
+
+    return out;
+}
+
+
+// Groups the nodes that share a mesh into instance batches and attaches the instance buffer to the arena VAO (locations 3-9)
+void UCreateInstances(MeshArena& arena, Scene& scene)
+{
+    // A mesh is instanced when more than one node draws it
+    std::vector<int> usage(arena.meshes.size(), 0);
+    for (const SceneNode& node : scene.nodes)
+        ++usage[node.mesh];
+
+    for (SceneNode& node : scene.nodes)
+        node.instanced = usage[node.mesh] > 1;
+
+    // Batches are stored back to back in the instance buffer, one batch per mesh and material
+    scene.batches.clear();
+    GLuint nextInstance = 0;
+    for (int meshId = 0; meshId < (int)arena.meshes.size(); ++meshId)
+    {
+        if (usage[meshId] < 2)
+            continue;
+
+        for (int materialId = 0; materialId < MATERIAL_COUNT; ++materialId)
+        {
+            InstanceBatch batch;
+            batch.mesh = meshId;
+            batch.material = materialId;
+            batch.firstInstance = nextInstance;
+
+            for (size_t i = 0; i < scene.nodes.size(); ++i)
+            {
+                if (scene.nodes[i].mesh == meshId && scene.nodes[i].material == materialId)
+                    batch.nodes.push_back((int)i);
+            }
+
+            batch.count = (GLsizei)batch.nodes.size();
+            if (batch.count == 0)
+                continue;
+
+            nextInstance += batch.count;
+            scene.batches.push_back(batch);
+        }
+    }
+
+    glBindVertexArray(arena.vao);
+
+    // Recreated whenever the scene is rebuilt (stress scenes)
+    glDeleteBuffers(1, &arena.instanceVbo);
+    glGenBuffers(1, &arena.instanceVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, arena.instanceVbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceData) * nextInstance, NULL, GL_DYNAMIC_DRAW);
+
+    // A matrix attribute takes one vec4 location per column (four for the model, three for the normal matrix),
+    // advanced once per instance
+    for (GLuint column = 0; column < 7; ++column)
+    {
+        GLuint location = 3 + column;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(sizeof(glm::vec4) * column));
+        glEnableVertexAttribArray(location);
+        glVertexAttribDivisor(location, 1);
+    }
+
+    glBindVertexArray(0);
+
+    UUpdateScene(scene, arena);
+    UUpdateInstances(arena, scene);
+}
+
+
+// Copies the cached world transforms and normal matrices of the visible instanced nodes into the instance buffers.
+// Visible instances are packed at the front of each batch, grouped by detail level, so culled ones cost nothing
+// to draw and each level is one instanced draw.
+void UUpdateInstances(MeshArena& arena, Scene& scene)
+{
+    std::vector<InstanceData> instances;
+
+    glBindBuffer(GL_ARRAY_BUFFER, arena.instanceVbo);
+
+    for (InstanceBatch& batch : scene.batches)
+    {
+        const GLMesh& mesh = arena.meshes[batch.mesh];
+
+        instances.clear();
+        for (int lod = 0; lod < MESH_MAX_LODS; ++lod)
+        {
+            const size_t first = instances.size();
+            if (lod < mesh.nLods)
+            {
+                for (int nodeIndex : batch.nodes)
+                {
+                    if (scene.visible[nodeIndex] && scene.lod[nodeIndex] == lod)
+                        instances.push_back({ scene.nodes[nodeIndex].world * mesh.dequantize, scene.normalMatrices[nodeIndex] });
+                }
+            }
+            batch.lodCounts[lod] = (GLsizei)(instances.size() - first);
+        }
+
+        batch.visibleCount = (GLsizei)instances.size();
+        if (batch.visibleCount == 0)
+            continue;
+
+        glBufferSubData(GL_ARRAY_BUFFER, sizeof(InstanceData) * batch.firstInstance, sizeof(InstanceData) * batch.visibleCount, instances.data());
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Builds the scene graph from the gSceneObjects table, plus one node per imported mesh
+void UCreateScene(Scene& scene, const MeshArena& arena)
+{
+    scene.nodes.clear();
+    scene.boundsX.clear();
+    scene.boundsY.clear();
+    scene.boundsZ.clear();
+    scene.boundsRadius.clear();
+    scene.visible.clear();
+    scene.lod.clear();
+    scene.normalMatrices.clear();
+
+    for (const SceneObjectDesc& object : gSceneObjects)
+        UAddSceneNode(scene, -1, object.mesh, object.material, object.position, object.rotation, object.scale);
+
+    // Imported meshes stand in a row between the bushes, scaled to a common size and resting on the ground
+    const float groundHeight = gGroundPosition.y - 0.1f * gGroundScale.y;
+    const int nImported = (int)arena.meshes.size() - MESH_COUNT;
+    for (int i = 0; i < nImported; ++i)
+    {
+        const GLMesh& mesh = arena.meshes[MESH_COUNT + i];
+        const float scale = IMPORTED_MESH_SIZE / std::max(mesh.boundingSphere.w, 1e-4f);
+
+        glm::vec3 position;
+        position.x = (i - (nImported - 1) * 0.5f) * IMPORTED_MESH_SIZE * 2.4f - mesh.boundingSphere.x * scale;
+        position.y = groundHeight - mesh.boundsMin.y * scale;
+        position.z = 0.6f - mesh.boundingSphere.z * scale;
+
+        UAddSceneNode(scene, -1, MESH_COUNT + i, MATERIAL_GLASS_TWO, position, glm::vec3(0.0f), glm::vec3(scale));
+    }
+}
+
+
+// Appends a node to the scene and returns its index. The parent must already be in the scene.
+int UAddSceneNode(Scene& scene, int parent, int mesh, int material, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale)
+{
+    SceneNode node;
+    node.parent = parent;
+    node.mesh = mesh;
+    node.material = material;
+    node.instanced = false;
+    node.dirty = true;
+    node.position = position;
+    node.rotation = rotation;
+    node.scale = scale;
+    node.world = glm::mat4(1.0f);
+
+    scene.nodes.push_back(node);
+    scene.boundsX.push_back(0.0f);
+    scene.boundsY.push_back(0.0f);
+    scene.boundsZ.push_back(0.0f);
+    scene.boundsRadius.push_back(0.0f);
+    scene.visible.push_back(1);
+    scene.lod.push_back(0);
+    scene.normalMatrices.push_back(glm::mat3x4(1.0f));
+
+    return (int)scene.nodes.size() - 1;
+}
+
+
+// Moves a node; its world transform (and its children's) is recomputed on the next UUpdateScene
+void USetNodeTransform(Scene& scene, int node, glm::vec3 position, glm::vec3 rotation, glm::vec3 scale)
+{
+    SceneNode& target = scene.nodes[node];
+    target.position = position;
+    target.rotation = rotation;
+    target.scale = scale;
+    target.dirty = true;
+}
+
+
+// Recomputes the world transform, world bounds and normal matrix of every dirty node and of the children of dirty
+// nodes. Returns true when at least one world transform changed.
+bool UUpdateScene(Scene& scene, const MeshArena& arena)
+{
+    bool changed = false;
+    std::vector<int> updated;
+    std::vector<glm::mat4> models;
+
+    // Parents precede children, so one forward pass sees each parent's final transform first
+    for (size_t i = 0; i < scene.nodes.size(); ++i)
+    {
+        SceneNode& node = scene.nodes[i];
+
+        if (node.parent >= 0 && scene.nodes[node.parent].dirty)
+            node.dirty = true;
+
+        if (!node.dirty)
+            continue;
+
+        // Model matrix: transformations are applied right-to-left order
+        glm::mat4 local = glm::translate(node.position)
+            * glm::rotate(glm::radians(node.rotation.z), glm::vec3(0.0f, 0.0f, 1.0f))
+            * glm::rotate(glm::radians(node.rotation.y), glm::vec3(0.0f, 1.0f, 0.0f))
+            * glm::rotate(glm::radians(node.rotation.x), glm::vec3(1.0f, 0.0f, 0.0f))
+            * glm::scale(node.scale);
+
+        node.world = node.parent >= 0 ? scene.nodes[node.parent].world * local : local;
+
+        // Move the mesh bounding sphere to world space; the largest axis scale bounds the radius
+        const glm::vec4& sphere = arena.meshes[node.mesh].boundingSphere;
+        glm::vec4 center = node.world * glm::vec4(glm::vec3(sphere), 1.0f);
+        float maxScale = std::max(glm::length(glm::vec3(node.world[0])),
+            std::max(glm::length(glm::vec3(node.world[1])), glm::length(glm::vec3(node.world[2]))));
+
+        scene.boundsX[i] = center.x;
+        scene.boundsY[i] = center.y;
+        scene.boundsZ[i] = center.z;
+        scene.boundsRadius[i] = sphere.w * maxScale;
+
+        updated.push_back((int)i);
+        models.push_back(node.world * arena.meshes[node.mesh].dequantize);
+        changed = true;
+    }
+
+    // Normal matrices of the moved nodes in one batch, so no vertex shader inverts a matrix
+    std::vector<glm::mat3x4> normalMatrices(models.size());
+    UComputeNormalMatrices(models.data(), normalMatrices.data(), models.size());
+    for (size_t j = 0; j < updated.size(); ++j)
+        scene.normalMatrices[updated[j]] = normalMatrices[j];
+
+    // Clear the flags only after the pass so children could see that their parent moved
+    for (SceneNode& node : scene.nodes)
+        node.dirty = false;
+
+    return changed;
+}
+
+
+// Writes the inverse transpose of the upper 3x3 of each model matrix, the matrix that takes mesh normals to world
+// space. Models built from a rotation and per-axis scales, which covers every node (the compact dequantize scale
+// included), have orthogonal axes a_i, and the inverse transpose then has the axes a_i / dot(a_i, a_i): the first
+// loop applies that to every matrix with no branch or inverse, so the compiler can vectorize it. Sheared models,
+// only possible under a rotated parent with non-uniform scale, are redone with a full inverse afterwards.
+void UComputeNormalMatrices(const glm::mat4* models, glm::mat3x4* normalMatrices, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (int column = 0; column < 3; ++column)
+        {
+            const glm::vec4 axis(glm::vec3(models[i][column]), 0.0f);
+            normalMatrices[i][column] = axis / glm::dot(axis, axis);
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const glm::mat3 m(models[i]);
+        const float shear = std::fabs(glm::dot(m[0], m[1])) + std::fabs(glm::dot(m[0], m[2])) + std::fabs(glm::dot(m[1], m[2]));
+        const float scale = glm::dot(m[0], m[0]) + glm::dot(m[1], m[1]) + glm::dot(m[2], m[2]);
+        if (shear <= NORMAL_MATRIX_SHEAR_TOLERANCE * scale)
+            continue;
+
+        const glm::mat3 inverseTranspose = glm::transpose(glm::inverse(m));
+        for (int column = 0; column < 3; ++column)
+            normalMatrices[i][column] = glm::vec4(inverseTranspose[column], 0.0f);
+    }
+}
+
+
+// Extracts the six frustum planes from a combined projection * view matrix (works for perspective and ortho)
+Frustum UExtractFrustum(const glm::mat4& viewProjection)
+{
+    // Row r of the matrix is (m[0][r], m[1][r], m[2][r], m[3][r]); each plane is row 3 +/- another row
+    const glm::mat4& m = viewProjection;
+    glm::vec4 row[4];
+    for (int r = 0; r < 4; ++r)
+        row[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+
+    const glm::vec4 planes[6] = {
+        row[3] + row[0], // Left
+        row[3] - row[0], // Right
+        row[3] + row[1], // Bottom
+        row[3] - row[1], // Top
+        row[3] + row[2], // Near
+        row[3] - row[2]  // Far
+    };
+
+    Frustum frustum;
+    for (int p = 0; p < 6; ++p)
+    {
+        // Normalize so the plane distance is in world units and can be compared to a radius
+        float invLength = 1.0f / glm::length(glm::vec3(planes[p]));
+        frustum.a[p] = planes[p].x * invLength;
+        frustum.b[p] = planes[p].y * invLength;
+        frustum.c[p] = planes[p].z * invLength;
+        frustum.d[p] = planes[p].w * invLength;
+    }
+
+    return frustum;
+}
+
+
+// Tests every node's world bounding sphere against the frustum and stores the result in scene.visible.
+// Returns true when any node changed visibility.
+bool UCullScene(Scene& scene, const Frustum& frustum)
+{
+    const size_t nNodes = scene.nodes.size();
+    const float* x = scene.boundsX.data();
+    const float* y = scene.boundsY.data();
+    const float* z = scene.boundsZ.data();
+    const float* radius = scene.boundsRadius.data();
+
+    std::vector<unsigned char> visible(nNodes, 1);
+    unsigned char* result = visible.data();
+
+    if (gUseCulling)
+    {
+        // Planes in the outer loop keep the inner loop branch-free over contiguous arrays,
+        // so the compiler can process several spheres per SIMD instruction
+        for (int p = 0; p < 6; ++p)
+        {
+            const float a = frustum.a[p];
+            const float b = frustum.b[p];
+            const float c = frustum.c[p];
+            const float d = frustum.d[p];
+
+            for (size_t i = 0; i < nNodes; ++i)
+            {
+                float distance = a * x[i] + b * y[i] + c * z[i] + d;
+                result[i] &= (unsigned char)(distance >= -radius[i]);
+            }
+        }
+    }
+
+    bool changed = visible != scene.visible;
+    scene.visible.swap(visible);
+
+    return changed;
+}
+
+
+// Picks the detail level of every node from the projected radius of its bounding sphere, as a fraction of the
+// screen height. A node only changes level once its size leaves the hysteresis band around a threshold, so it does
+// not pop back and forth while the camera hovers at that distance. Returns true when any level changed.
+bool USelectLods(Scene& scene, const MeshArena& arena, const glm::mat4& projection, glm::vec3 cameraPosition)
+{
+    const bool perspective = projection[3][3] == 0.0f;
+    bool changed = false;
+
+    for (size_t i = 0; i < scene.nodes.size(); ++i)
+    {
+        const GLMesh& mesh = arena.meshes[scene.nodes[i].mesh];
+        if (mesh.nLods < 2)
+            continue;
+
+        // projection[1][1] is 1 / tan(fovy / 2) in perspective, 2 / height in orthographic projection
+        float size = 0.5f * scene.boundsRadius[i] * projection[1][1];
+        if (perspective)
+            size /= std::max(glm::length(glm::vec3(scene.boundsX[i], scene.boundsY[i], scene.boundsZ[i]) - cameraPosition), 1e-4f);
+
+        int lod = scene.lod[i];
+        while (lod + 1 < mesh.nLods && size < LOD_SCREEN_SIZES[lod] * (1.0f - LOD_HYSTERESIS))
+            ++lod;
+        while (lod > 0 && size > LOD_SCREEN_SIZES[lod - 1] * (1.0f + LOD_HYSTERESIS))
+            --lod;
+
+        if (lod != scene.lod[i])
+        {
+            scene.lod[i] = (unsigned char)lod;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+
+void UDestroyMesh(MeshArena& arena)
+{
+    glDeleteVertexArrays(1, &arena.vao);
+    glDeleteBuffers(1, &arena.vbo);
+    glDeleteBuffers(1, &arena.ebo);
+    glDeleteBuffers(1, &arena.instanceVbo);
+}
+
+
+/*Generate the texture and queue it for loading*/
+// The texture takes a layer of the RGBA8 material array, which shows a placeholder until a worker has decoded the image
+// and the render thread has streamed it in. Returns false when the file cannot be read or has an unsupported format.
+bool UCreateTexture(const char* filename, GLuint& texture)
+{
+    // Only the header is read here, so missing files are still reported before the first frame
+    int width, height, channels;
+    if (!stbi_info(filename, &width, &height, &channels))
+        return false;
+
+    if (channels != 3 && channels != 4)
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        return false;
+    }
+
+    TextureArrays& arrays = gMaterialTextures;
+    if (arrays.nLayers[TEXTURE_ARRAY_RGBA8] == arrays.capacity)
+    {
+        cout << "Material texture array is full (" << arrays.capacity << " layers)" << endl;
+        return false;
+    }
+
+    texture = (GLuint)arrays.slots.size();
+    arrays.slots.push_back({ TEXTURE_ARRAY_RGBA8, arrays.nLayers[TEXTURE_ARRAY_RGBA8]++ });
+
+    TextureJob* job = new TextureJob();
+    job->filename = filename;
+    job->texture = texture;
+    job->width = 0;
+    job->height = 0;
+    job->channels = 0;
+    job->nextRow = 0;
+    job->compressed = false;
+    job->compressedFormat = 0;
+    job->nextLevel = 0;
+    job->layer = -1;
+
+    {
+        std::lock_guard<std::mutex> lock(gTextureLoader.mutex);
+        gTextureLoader.pending.push_back(job);
+    }
+    gTextureLoader.wakeWorkers.notify_one();
+
+    return true;
+}
+
+
+// Creates the RGBA8 material array, with every layer cleared to a mid-grey placeholder.
+// The compressed arrays are created when the first cooked texture of their format arrives.
+void UCreateTextureArrays(TextureArrays& arrays, int capacity)
+{
+    for (int i = 0; i < TEXTURE_ARRAY_COUNT; ++i)
+    {
+        arrays.ids[i] = 0;
+        arrays.nLayers[i] = 0;
+    }
+    arrays.capacity = capacity;
+    arrays.slots.clear();
+    arrays.slotsChanged = false;
+
+    arrays.ids[TEXTURE_ARRAY_RGBA8] = UCreateTextureArray(GL_RGBA8, capacity);
+
+    const unsigned char placeholder[4] = { 128, 128, 128, 255 };
+    for (int level = 0; level < MATERIAL_TEXTURE_LEVELS; ++level)
+        glClearTexImage(arrays.ids[TEXTURE_ARRAY_RGBA8], level, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+}
+
+
+// Allocates an immutable texture array of capacity layers of MATERIAL_TEXTURE_SIZE with a full mip chain
+GLuint UCreateTextureArray(GLenum internalFormat, int capacity)
+{
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, MATERIAL_TEXTURE_LEVELS, internalFormat, MATERIAL_TEXTURE_SIZE, MATERIAL_TEXTURE_SIZE, capacity);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    return id;
+}
+
+
+void UDestroyTextureArrays(TextureArrays& arrays)
+{
+    for (int i = 0; i < TEXTURE_ARRAY_COUNT; ++i)
+    {
+        if (arrays.ids[i])
+            glDeleteTextures(1, &arrays.ids[i]);
+        arrays.ids[i] = 0;
+    }
+    arrays.slots.clear();
+}
+
+
+// Resamples an image to size x size texels (a plain copy when it already has that size). Sources at least twice
+// the size on both axes are first halved with the box filter, so the bilinear pass never skips source texels
+// and large images do not alias. Non-square sources are stretched to the square.
+void UResampleImage(const unsigned char* image, int width, int height, int channels, int size, std::vector<unsigned char>& out)
+{
+    std::vector<unsigned char> reduced, next;
+    while (width >= size * 2 && height >= size * 2)
+    {
+        UDownsampleImage(image, width, height, channels, next);
+        reduced.swap(next);
+        image = reduced.data();
+        width /= 2;
+        height /= 2;
+    }
+
+    out.resize((size_t)size * size * channels);
+
+    if (width == size && height == size)
+    {
+        memcpy(out.data(), image, out.size());
+        return;
+    }
+
+    for (int y = 0; y < size; ++y)
+    {
+        // Output texel centers mapped onto the source image
+        float sy = std::max(0.0f, (y + 0.5f) * height / size - 0.5f);
+        int y0 = std::min((int)sy, height - 1);
+        int y1 = std::min(y0 + 1, height - 1);
+        float fy = sy - y0;
+
+        for (int x = 0; x < size; ++x)
+        {
+            float sx = std::max(0.0f, (x + 0.5f) * width / size - 0.5f);
+            int x0 = std::min((int)sx, width - 1);
+            int x1 = std::min(x0 + 1, width - 1);
+            float fx = sx - x0;
+
+            for (int c = 0; c < channels; ++c)
+            {
+                float top = image[((size_t)y0 * width + x0) * channels + c] * (1.0f - fx) + image[((size_t)y0 * width + x1) * channels + c] * fx;
+                float bottom = image[((size_t)y1 * width + x0) * channels + c] * (1.0f - fx) + image[((size_t)y1 * width + x1) * channels + c] * fx;
+                out[((size_t)y * size + x) * channels + c] = (unsigned char)(top * (1.0f - fy) + bottom * fy + 0.5f);
+            }
+        }
+    }
+}
+
+
+// Next mip level of an image: a 2x2 box filter, repeating the last row / column of odd sizes
+void UDownsampleImage(const unsigned char* image, int width, int height, int channels, std::vector<unsigned char>& out)
+{
+    const int nextWidth = std::max(1, width / 2);
+    const int nextHeight = std::max(1, height / 2);
+    out.resize((size_t)nextWidth * nextHeight * channels);
+
+    for (int y = 0; y < nextHeight; ++y)
+    {
+        for (int x = 0; x < nextWidth; ++x)
+        {
+            int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+            int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+
+            for (int c = 0; c < channels; ++c)
+            {
+                int sum = image[((size_t)y0 * width + x0) * channels + c] + image[((size_t)y0 * width + x1) * channels + c]
+                    + image[((size_t)y1 * width + x0) * channels + c] + image[((size_t)y1 * width + x1) * channels + c];
+                out[((size_t)y * nextWidth + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+
+// Starts the decode workers and maps the upload PBO ring
+void UCreateTextureLoader(TextureLoader& loader)
+{
+    loader.stopping = false;
+    loader.decoding = 0;
+    loader.nextSlot = 0;
+    loader.s3tcSupported = GLEW_EXT_texture_compression_s3tc;
+
+    for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; ++i)
+        loader.slotFences[i] = 0;
+
+    // Immutable storage mapped once for the lifetime of the loader; coherent writes need no explicit flush
+    const GLbitfield mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &loader.pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, loader.pbo);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, TEXTURE_UPLOAD_SLOT_SIZE * TEXTURE_UPLOAD_SLOTS, NULL, mapFlags);
+    loader.mapped = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, TEXTURE_UPLOAD_SLOT_SIZE * TEXTURE_UPLOAD_SLOTS, mapFlags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // Leave one core for the render thread
+    unsigned int nWorkers = std::thread::hardware_concurrency();
+    nWorkers = nWorkers > 1 ? nWorkers - 1 : 1;
+
+    for (unsigned int i = 0; i < nWorkers; ++i)
+        loader.workers.push_back(std::thread(UTextureWorker, &loader));
+}
+
+
+// Worker thread: decodes queued images until the loader stops
+void UTextureWorker(TextureLoader* loader)
+{
+    for (;;)
+    {
+        TextureJob* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            loader->wakeWorkers.wait(lock, [loader] { return loader->stopping || !loader->pending.empty(); });
+
+            if (loader->stopping)
+                return;
+
+            job = loader->pending.front();
+            loader->pending.pop_front();
+            ++loader->decoding;
+        }
+
+        // A cooked copy keyed by the source contents skips both decoding and mipmap generation
+        std::vector<unsigned char> contents;
+        uint64_t hash = UHashFile(job->filename.c_str(), contents);
+        job->compressed = !contents.empty() && ULoadCachedTexture(UTextureCachePath(hash), *job, loader->s3tcSupported);
+
+        // Rows stay in file order (top row first); the upload reverses them, so no flip pass is needed
+        if (!job->compressed && !contents.empty())
+        {
+            int width, height;
+            unsigned char* image = stbi_load_from_memory(contents.data(), (int)contents.size(), &width, &height, &job->channels, 0);
+            if (image)
+            {
+                // Every layer of the material array has the same size
+                UResampleImage(image, width, height, job->channels, MATERIAL_TEXTURE_SIZE, job->pixels);
+                job->width = width;
+                job->height = height;
+                stbi_image_free(image);
+
+                // The mip chain is built here as well, with the box filter of UCookTexture, so the render thread only
+                // copies levels. The layer size is a power of two, so the 2x2 footprints are the same in either row order.
+                job->pixels.reserve(job->pixels.size() * 4 / 3 + (size_t)MATERIAL_TEXTURE_LEVELS * job->channels);
+                std::vector<unsigned char> next;
+                job->levels.clear(); // A cache entry that failed to load may have left some behind
+                int levelSize = MATERIAL_TEXTURE_SIZE;
+                size_t offset = 0;
+                for (int level = 0; level < MATERIAL_TEXTURE_LEVELS; ++level)
+                {
+                    const size_t levelBytes = (size_t)levelSize * levelSize * job->channels;
+                    job->levels.push_back({ offset, levelBytes, levelSize, levelSize });
+
+                    if (level + 1 < MATERIAL_TEXTURE_LEVELS)
+                    {
+                        UDownsampleImage(job->pixels.data() + offset, levelSize, levelSize, job->channels, next);
+                        job->pixels.insert(job->pixels.end(), next.begin(), next.end());
+                    }
+
+                    offset += levelBytes;
+                    levelSize = std::max(1, levelSize / 2);
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->decoded.push_back(job);
+        --loader->decoding;
+    }
+}
+
+
+// Render thread: streams decoded images and their mip chains into their texture array layers through the PBO ring.
+// Never waits on the GPU; if the next slot is still in use the upload continues next frame.
+void UUpdateTextureLoader(TextureLoader& loader, TextureArrays& arrays)
+{
+    {
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        while (!loader.decoded.empty())
+        {
+            loader.uploading.push_back(loader.decoded.front());
+            loader.decoded.pop_front();
+        }
+    }
+
+    int slotsUsed = 0;
+    while (!loader.uploading.empty() && slotsUsed < TEXTURE_UPLOAD_SLOTS_PER_FRAME)
+    {
+        TextureJob* job = loader.uploading.front();
+
+        if (job->pixels.empty() && !job->compressed)
+        {
+            // Error loading the image: keep the placeholder
+            cout << "Failed to load texture " << job->filename << endl;
+            loader.uploading.pop_front();
+            delete job;
+            continue;
+        }
+
+        GLsync& fence = loader.slotFences[loader.nextSlot];
+        if (fence)
+        {
+            GLenum status = glClientWaitSync(fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED)
+                break;
+
+            glDeleteSync(fence);
+            fence = 0;
+        }
+
+        if (job->compressed)
+        {
+            // Cooked textures go to the array of their format, created on first use
+            const int array = (int)(std::find(TEXTURE_ARRAY_FORMATS, TEXTURE_ARRAY_FORMATS + TEXTURE_ARRAY_COUNT, job->compressedFormat) - TEXTURE_ARRAY_FORMATS);
+            if (job->nextLevel == 0)
+            {
+                if (arrays.nLayers[array] == arrays.capacity)
+                {
+                    // Keep the placeholder layer; the RGBA8 array cannot take compressed data
+                    cout << "Compressed texture array is full, dropping " << job->filename << endl;
+                    loader.uploading.pop_front();
+                    delete job;
+                    continue;
+                }
+
+                if (!arrays.ids[array])
+                    arrays.ids[array] = UCreateTextureArray(job->compressedFormat, arrays.capacity);
+                job->layer = arrays.nLayers[array]++;
+            }
+
+            // One mip level per slot; a level larger than a slot goes straight from memory
+            const CompressedLevel& level = job->levels[job->nextLevel];
+            const GLsizeiptr slotOffset = TEXTURE_UPLOAD_SLOT_SIZE * loader.nextSlot;
+            const unsigned char* levelData = job->compressedData.data() + level.offset;
+
+            glBindTexture(GL_TEXTURE_2D_ARRAY, arrays.ids[array]);
+            if ((GLsizeiptr)level.size <= TEXTURE_UPLOAD_SLOT_SIZE)
+            {
+                memcpy(loader.mapped + slotOffset, levelData, level.size);
+
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, loader.pbo);
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, job->nextLevel, 0, 0, job->layer, level.width, level.height, 1,
+                    job->compressedFormat, (GLsizei)level.size, (const void*)slotOffset);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            }
+            else
+            {
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, job->nextLevel, 0, 0, job->layer, level.width, level.height, 1,
+                    job->compressedFormat, (GLsizei)level.size, levelData);
+            }
+
+            fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            loader.nextSlot = (loader.nextSlot + 1) % TEXTURE_UPLOAD_SLOTS;
+            ++slotsUsed;
+
+            if (++job->nextLevel == (int)job->levels.size())
+            {
+                // Switch the material over once every level is in place (its RGBA8 layer stays reserved)
+                arrays.slots[job->texture] = { array, job->layer };
+                arrays.slotsChanged = true;
+
+                loader.uploading.pop_front();
+                delete job;
+            }
+
+            glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            continue;
+        }
+
+        if (job->nextLevel == 0 && job->nextRow == 0 && job->width != job->height)
+            cout << "Texture " << job->filename << " is " << job->width << "x" << job->height << ", stretched to "
+                << MATERIAL_TEXTURE_SIZE << "x" << MATERIAL_TEXTURE_SIZE << endl;
+
+        const GLenum format = job->channels == 3 ? GL_RGB : GL_RGBA;
+        const CompressedLevel& level = job->levels[job->nextLevel];
+        const size_t rowBytes = (size_t)level.width * job->channels;
+        const unsigned char* levelData = job->pixels.data() + level.offset;
+        const int layer = arrays.slots[job->texture].layer;
+
+        glBindTexture(GL_TEXTURE_2D_ARRAY, arrays.ids[TEXTURE_ARRAY_RGBA8]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RGB rows are not 4-byte aligned
+
+        // Copy as many rows of the level as fit in the slot and upload them from the PBO.
+        // Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so texture row t
+        // takes image row (height - 1 - t); copying row by row flips the image for free.
+        int rows = std::min((int)(TEXTURE_UPLOAD_SLOT_SIZE / rowBytes), level.height - job->nextRow);
+        const GLsizeiptr slotOffset = TEXTURE_UPLOAD_SLOT_SIZE * loader.nextSlot;
+
+        for (int row = 0; row < rows; ++row)
+        {
+            const int imageRow = level.height - 1 - (job->nextRow + row);
+            memcpy(loader.mapped + slotOffset + rowBytes * row, levelData + rowBytes * imageRow, rowBytes);
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, loader.pbo);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, job->nextLevel, 0, job->nextRow, layer, level.width, rows, 1, format, GL_UNSIGNED_BYTE, (const void*)slotOffset);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        loader.nextSlot = (loader.nextSlot + 1) % TEXTURE_UPLOAD_SLOTS;
+        ++slotsUsed;
+
+        job->nextRow += rows;
+        if (job->nextRow == level.height)
+        {
+            job->nextRow = 0;
+            if (++job->nextLevel == (int)job->levels.size())
+            {
+                loader.uploading.pop_front();
+                delete job;
+            }
+        }
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+}
+
+
+// True once every queued texture has been decoded and uploaded
+bool UTextureLoaderIdle(TextureLoader& loader)
+{
+    std::lock_guard<std::mutex> lock(loader.mutex);
+    return loader.pending.empty() && loader.decoding == 0 && loader.decoded.empty() && loader.uploading.empty();
+}
+
+
+// Reads a whole file and returns the 64-bit FNV-1a hash of its contents (contents is left empty on failure)
+uint64_t UHashFile(const char* filename, std::vector<unsigned char>& contents)
+{
+    if (!UReadFile(filename, contents))
+        return 0;
+
+    return UHashBytes(contents.data(), contents.size());
+}
+
+
+// Continues a 64-bit FNV-1a hash over a block of bytes
+uint64_t UHashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+    return hash;
+}
+
+
+// Reads a whole file (contents is left empty on failure)
+bool UReadFile(const char* filename, std::vector<unsigned char>& contents)
+{
+    contents.clear();
+
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+
+// Path of the cooked texture for a source file hash
+std::string UTextureCachePath(uint64_t hash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.dds", (unsigned long long)hash);
+
+    return std::string(TEXTURE_CACHE_DIR) + name;
+}
+
+
+// Adds a mesh file (.obj, .gltf or .glb) to the arena. The first run converts it into a cache entry holding the
+// optimized mesh in the arena vertex format and uses that entry from memory; later runs map the cached copy and
+// never parse the source. A cache that cannot be written only costs the conversion on every run.
+bool UImportMesh(MeshArena& arena, const char* filename)
+{
+    const std::string cachePath = UMeshCachePath(filename, arena.format);
+    if (cachePath.empty())
+    {
+        cout << "Mesh file not found: " << filename << endl;
+        return false;
+    }
+
+    MappedFile file;
+    std::vector<unsigned char> entry;
+    if (!UMapFile(cachePath.c_str(), file) || !UCheckMeshCache(file, arena.format))
+    {
+        UUnmapFile(file);
+
+        std::vector<GLfloat> vertices;
+        std::vector<GLuint> indices;
+        if (!ULoadMeshSource(filename, vertices, indices))
+            return false;
+
+        if (indices.size() < 3)
+        {
+            cout << "Mesh has no triangles: " << filename << endl;
+            return false;
+        }
+
+        UOptimizeMesh(vertices, indices, filename, true);
+
+        std::vector<GLuint> lodIndexCounts;
+        UGenerateLods(vertices, indices, lodIndexCounts, filename);
+
+        UBuildMeshCache(arena.format, vertices, indices, lodIndexCounts, entry);
+        const bool cached = UWriteMeshCache(cachePath, entry);
+
+        cout << "Imported " << filename << ": " << lodIndexCounts[0] / 3 << " triangles, " << vertices.size() / 8
+            << " vertices, " << (cached ? "cached as " + cachePath : std::string("not cached")) << endl;
+    }
+
+    const unsigned char* data = entry.empty() ? file.data : entry.data();
+    const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(data);
+
+    // Imported meshes follow every built-in mesh, so they start where the last mesh ends
+    GLMesh mesh;
+    mesh.baseVertex = 0;
+    mesh.firstIndex = 0;
+    if (!arena.meshes.empty())
+    {
+        const GLMesh& last = arena.meshes.back();
+        mesh.baseVertex = last.baseVertex + (GLint)last.nVertices;
+        mesh.firstIndex = last.firstIndex + (GLuint)last.nIndices;
+    }
+    mesh.nIndices = (GLsizei)header->nIndices;
+    mesh.nVertices = header->nVertices;
+    mesh.boundsMin = glm::make_vec3(header->boundsMin);
+    mesh.boundsMax = glm::make_vec3(header->boundsMax);
+    mesh.boundingSphere = glm::make_vec4(header->boundingSphere);
+    mesh.imported = true;
+    mesh.nLods = (int)header->nLods;
+    for (int lod = 0, first = 0; lod < mesh.nLods; first += header->lodIndexCounts[lod++])
+    {
+        mesh.lodFirstIndex[lod] = mesh.firstIndex + first;
+        mesh.lodIndexCount[lod] = (GLsizei)header->lodIndexCounts[lod];
+    }
+    mesh.dequantize = glm::mat4(1.0f);
+    if (arena.format == VERTEX_FORMAT_COMPACT)
+        mesh.dequantize = glm::translate(mesh.boundsMin) * glm::scale(UCompactExtent(mesh));
+
+    ImportedMesh imported;
+    imported.mesh = (int)arena.meshes.size();
+    imported.file = file;
+    imported.vertices = data + sizeof(MeshCacheHeader);
+    imported.indices = reinterpret_cast<const GLuint*>(imported.vertices + (size_t)header->vertexSize * header->nVertices);
+    imported.entry.swap(entry);     // Moves the buffer, so the pointers above stay valid
+
+    arena.meshes.push_back(mesh);
+    arena.imported.push_back(std::move(imported));
+
+    return true;
+}
+
+
+// Path of the cache entry for a mesh source. It is keyed on the source path, size and modification time (so a
+// current entry is found without reading the source), the vertex format and the import pipeline version.
+// Returns an empty string when the source does not exist.
+std::string UMeshCachePath(const char* filename, VertexFormat format)
+{
+    struct stat info;
+    if (stat(filename, &info) != 0)
+        return std::string();
+
+    const uint64_t key[4] = { (uint64_t)info.st_size, (uint64_t)info.st_mtime, (uint64_t)format, MESH_CACHE_VERSION };
+    uint64_t hash = UHashBytes(filename, strlen(filename));
+    hash = UHashBytes(key, sizeof(key), hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long)hash);
+
+    return std::string(MESH_CACHE_DIR) + name;
+}
+
+
+// True when a mapped cache entry is complete and laid out for the given vertex format
+bool UCheckMeshCache(const MappedFile& file, VertexFormat format)
+{
+    if (file.size < sizeof(MeshCacheHeader))
+        return false;
+
+    const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(file.data);
+    const uint32_t vertexSize = format == VERTEX_FORMAT_COMPACT ? sizeof(CompactVertex) : sizeof(GLfloat) * 8;
+
+    if (header->nLods < 1 || header->nLods > (uint32_t)MESH_MAX_LODS)
+        return false;
+
+    size_t nLodIndices = 0;
+    for (uint32_t lod = 0; lod < header->nLods; ++lod)
+        nLodIndices += header->lodIndexCounts[lod];
+
+    return nLodIndices == header->nIndices
+        && header->magic == MESH_CACHE_MAGIC
+        && header->version == MESH_CACHE_VERSION
+        && header->vertexFormat == (uint32_t)format
+        && header->vertexSize == vertexSize
+        && file.size == sizeof(MeshCacheHeader) + (size_t)vertexSize * header->nVertices + sizeof(GLuint) * (size_t)header->nIndices;
+}
+
+
+// Lays out a cache entry in memory: bounds and detail levels, then the vertices encoded in the arena format, then
+// the indices
+void UBuildMeshCache(VertexFormat format, const std::vector<GLfloat>& vertices, const std::vector<GLuint>& indices, const std::vector<GLuint>& lodIndexCounts, std::vector<unsigned char>& entry)
+{
+    const GLuint nVertices = (GLuint)(vertices.size() / 8);
+
+    GLMesh mesh;
+    UComputeMeshBounds(mesh, vertices.data(), nVertices);
+
+    MeshCacheHeader header = {};
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.vertexFormat = (uint32_t)format;
+    header.vertexSize = format == VERTEX_FORMAT_COMPACT ? sizeof(CompactVertex) : sizeof(GLfloat) * 8;
+    header.nVertices = nVertices;
+    header.nIndices = (uint32_t)indices.size();
+    memcpy(header.boundsMin, glm::value_ptr(mesh.boundsMin), sizeof(header.boundsMin));
+    memcpy(header.boundsMax, glm::value_ptr(mesh.boundsMax), sizeof(header.boundsMax));
+    memcpy(header.boundingSphere, glm::value_ptr(mesh.boundingSphere), sizeof(header.boundingSphere));
+    header.nLods = (uint32_t)lodIndexCounts.size();
+    std::copy(lodIndexCounts.begin(), lodIndexCounts.end(), header.lodIndexCounts);
+
+    const size_t vertexBytes = (size_t)header.vertexSize * nVertices;
+    entry.resize(sizeof(header) + vertexBytes + sizeof(GLuint) * indices.size());
+    memcpy(entry.data(), &header, sizeof(header));
+
+    if (format == VERTEX_FORMAT_COMPACT)
+    {
+        const glm::vec3 extent = UCompactExtent(mesh);
+
+        CompactVertex* compact = reinterpret_cast<CompactVertex*>(entry.data() + sizeof(header));
+        for (GLuint i = 0; i < nVertices; ++i)
+            compact[i] = UEncodeCompactVertex(&vertices[i * 8], mesh.boundsMin, extent);
+    }
+    else
+    {
+        memcpy(entry.data() + sizeof(header), vertices.data(), vertexBytes);
+    }
+
+    memcpy(entry.data() + sizeof(header) + vertexBytes, indices.data(), sizeof(GLuint) * indices.size());
+}
+
+
+// Writes a cache entry built by UBuildMeshCache, creating the cache directory on first use
+bool UWriteMeshCache(const std::string& path, const std::vector<unsigned char>& entry)
+{
+    std::ofstream file;
+    if (UCreateCacheDirectory(MESH_CACHE_DIR))
+        file.open(path, std::ios::binary);
+
+    if (file)
+    {
+        file.write(reinterpret_cast<const char*>(entry.data()), entry.size());
+        file.close();
+    }
+
+    if (!file)
+    {
+        cout << "Failed to write mesh cache " << path << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Maps a whole file read-only. The file handle is closed right away; the mapping keeps the contents available.
+bool UMapFile(const char* filename, MappedFile& file)
+{
+    file.data = nullptr;
+    file.size = 0;
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+
+    if (mapping == NULL)
+        return false;
+
+    file.data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+
+    if (file.data == nullptr)
+        return false;
+
+    file.size = (size_t)size.QuadPart;
+#else
+    int handle = open(filename, O_RDONLY);
+    if (handle < 0)
+        return false;
+
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(handle, &info) == 0 && info.st_size > 0)
+        data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+    close(handle);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    file.data = static_cast<const unsigned char*>(data);
+    file.size = (size_t)info.st_size;
+#endif
+
+    return true;
+}
+
+
+// Releases a mapping made by UMapFile (does nothing for an empty one)
+void UUnmapFile(MappedFile& file)
+{
+    if (file.data == nullptr)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(file.data);
+#else
+    munmap(const_cast<unsigned char*>(file.data), file.size);
+#endif
+
+    file.data = nullptr;
+    file.size = 0;
+}
+
+
+// Creates a directory and any missing parents; true when it exists afterwards
+bool UCreateCacheDirectory(const char* path)
+{
+    const std::string directory = path;
+    for (size_t slash = directory.find('/', 1); slash != std::string::npos; slash = directory.find('/', slash + 1))
+    {
+        const std::string parent = directory.substr(0, slash);
+#ifdef _WIN32
+        CreateDirectoryA(parent.c_str(), NULL);
+#else
+        mkdir(parent.c_str(), 0755);
+#endif
+    }
+
+    // stat does not accept a trailing slash everywhere
+    const std::string trimmed = directory.substr(0, directory.find_last_not_of('/') + 1);
+    struct stat info;
+    return stat(trimmed.c_str(), &info) == 0 && (info.st_mode & S_IFDIR) != 0;
+}
+
+
+// Loads a mesh source into interleaved float vertices (position, normal, texture coordinate) and triangle indices
+bool ULoadMeshSource(const char* filename, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices)
+{
+    std::string extension = filename;
+    const size_t dot = extension.find_last_of('.');
+    extension = dot == std::string::npos ? std::string() : extension.substr(dot + 1);
+    for (char& c : extension)
+        c = (char)tolower((unsigned char)c);
+
+    if (extension == "obj")
+    {
+        std::vector<GLfloat> soup;
+        if (!ULoadObj(filename, soup))
+            return false;
+
+        UIndexVertices(soup.data(), (GLuint)(soup.size() / 8), vertices, indices);
+        return true;
+    }
+
+    if (extension == "gltf" || extension == "glb")
+        return ULoadGltf(filename, vertices, indices);
+
+    cout << "Unsupported mesh format (expected .obj, .gltf or .glb): " << filename << endl;
+    return false;
+}
+
+
+// Loads a Wavefront OBJ as a triangle soup (8 floats per corner). Polygons are fanned around their first corner and
+// missing normals are replaced by smooth, area-weighted normals. Materials, groups and other statements are ignored.
+bool ULoadObj(const char* filename, std::vector<GLfloat>& soup)
+{
+    std::vector<unsigned char> contents;
+    if (!UReadFile(filename, contents))
+    {
+        cout << "Failed to read mesh " << filename << endl;
+        return false;
+    }
+    contents.push_back('\0'); // Parsing stops at the terminator
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::ivec3> corners; // Position, texture coordinate and normal index of every triangle corner, -1 if absent
+    std::vector<glm::ivec3> face;
+    bool missingNormals = false;
+
+    const char* p = reinterpret_cast<const char*>(contents.data());
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+
+        char* next = nullptr;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            glm::vec3 position;
+            position.x = strtof(p + 2, &next);
+            position.y = strtof(next, &next);
+            position.z = strtof(next, &next);
+            positions.push_back(position);
+            p = next;
+        }
+        else if (p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            glm::vec2 uv;
+            uv.x = strtof(p + 3, &next);
+            uv.y = strtof(next, &next);
+            uvs.push_back(uv);
+            p = next;
+        }
+        else if (p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            glm::vec3 normal;
+            normal.x = strtof(p + 3, &next);
+            normal.y = strtof(next, &next);
+            normal.z = strtof(next, &next);
+            normals.push_back(normal);
+            p = next;
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            // Corners are v, v/vt, v//vn or v/vt/vn; negative indices count back from the last element
+            face.clear();
+            p += 2;
+            for (;;)
+            {
+                while (*p == ' ' || *p == '\t')
+                    ++p;
+
+                glm::ivec3 corner(-1);
+                corner.x = UObjIndex(strtol(p, &next, 10), positions.size());
+                if (next == p)
+                    break;
+                p = next;
+
+                if (*p == '/')
+                {
+                    ++p;
+                    if (*p != '/')
+                    {
+                        corner.y = UObjIndex(strtol(p, &next, 10), uvs.size());
+                        p = next;
+                    }
+                    if (*p == '/')
+                    {
+                        ++p;
+                        corner.z = UObjIndex(strtol(p, &next, 10), normals.size());
+                        p = next;
+                    }
+                }
+
+                if (corner.x < 0)
+                {
+                    cout << "Invalid face in " << filename << endl;
+                    return false;
+                }
+
+                missingNormals = missingNormals || corner.z < 0;
+                face.push_back(corner);
+            }
+
+            for (size_t i = 2; i < face.size(); ++i)
+            {
+                corners.push_back(face[0]);
+                corners.push_back(face[i - 1]);
+                corners.push_back(face[i]);
+            }
+        }
+
+        // On to the next line
+        while (*p && *p != '\n')
+            ++p;
+        if (*p)
+            ++p;
+    }
+
+    std::vector<glm::vec3> smoothNormals;
+    if (missingNormals)
+    {
+        smoothNormals.assign(positions.size(), glm::vec3(0.0f));
+        for (size_t i = 0; i < corners.size(); i += 3)
+        {
+            const glm::vec3& a = positions[corners[i].x];
+            const glm::vec3& b = positions[corners[i + 1].x];
+            const glm::vec3& c = positions[corners[i + 2].x];
+            const glm::vec3 faceNormal = glm::cross(b - a, c - a); // Length is twice the area
+
+            for (int k = 0; k < 3; ++k)
+                smoothNormals[corners[i + k].x] += faceNormal;
+        }
+
+        for (glm::vec3& normal : smoothNormals)
+        {
+            float length = glm::length(normal);
+            normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    soup.clear();
+    soup.reserve(corners.size() * 8);
+    for (const glm::ivec3& corner : corners)
+    {
+        const glm::vec3& position = positions[corner.x];
+        const glm::vec3& normal = corner.z >= 0 ? normals[corner.z] : smoothNormals[corner.x];
+        const glm::vec2 uv = corner.y >= 0 ? uvs[corner.y] : glm::vec2(0.0f);
+
+        const GLfloat vertex[8] = { position.x, position.y, position.z, normal.x, normal.y, normal.z, uv.x, uv.y };
+        soup.insert(soup.end(), vertex, vertex + 8);
+    }
+
+    return true;
+}
 
-          //Top Face           //Positive Y Normal
-         -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-          0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-          0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-          0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-         -0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-         -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+
+// Converts a 1-based (or negative, relative) OBJ index into an array index. Returns -1 when out of range.
+int UObjIndex(long index, size_t count)
+{
+    long resolved = index > 0 ? index - 1 : (long)count + index;
+
+    return index != 0 && resolved >= 0 && resolved < (long)count ? (int)resolved : -1;
+}
+
+
+// Loads the triangle primitives of a glTF 2.0 file (.gltf with external or embedded buffers, or .glb). The node
+// hierarchy of the default scene is flattened, so every mesh instance is baked in with its node transform.
+bool ULoadGltf(const char* filename, std::vector<GLfloat>& vertices, std::vector<GLuint>& indices)
+{
+    std::vector<unsigned char> contents;
+    if (!UReadFile(filename, contents))
+    {
+        cout << "Failed to read mesh " << filename << endl;
+        return false;
+    }
+
+    const char* json = reinterpret_cast<const char*>(contents.data());
+    size_t jsonSize = contents.size();
+    std::vector<unsigned char> binaryChunk;
+    bool hasBinaryChunk = false;
+
+    uint32_t glbHeader[5] = {};
+    if (contents.size() >= sizeof(glbHeader))
+        memcpy(glbHeader, contents.data(), sizeof(glbHeader));
+
+    if (glbHeader[0] == GLB_MAGIC)
+    {
+        // glbHeader: magic, version, length, then the JSON chunk length and type
+        if (glbHeader[4] != GLB_CHUNK_JSON || sizeof(glbHeader) + glbHeader[3] > contents.size())
+        {
+            cout << "Invalid glb file " << filename << endl;
+            return false;
+        }
+
+        json += sizeof(glbHeader);
+        jsonSize = glbHeader[3];
+
+        uint32_t chunk[2] = {};
+        const size_t binaryOffset = sizeof(glbHeader) + jsonSize;
+        if (binaryOffset + sizeof(chunk) <= contents.size())
+        {
+            memcpy(chunk, contents.data() + binaryOffset, sizeof(chunk));
+            if (chunk[1] == GLB_CHUNK_BIN && binaryOffset + sizeof(chunk) + chunk[0] <= contents.size())
+            {
+                binaryChunk.assign(contents.begin() + binaryOffset + sizeof(chunk), contents.begin() + binaryOffset + sizeof(chunk) + chunk[0]);
+                hasBinaryChunk = true;
+            }
+        }
+    }
+
+    JsonValue gltf;
+    const char* p = json;
+    if (!UParseJson(p, json + jsonSize, gltf) || gltf.type != JsonValue::JSON_OBJECT)
+    {
+        cout << "Failed to parse glTF " << filename << endl;
+        return false;
+    }
+
+    // Buffers: the glb binary chunk, base64 data URIs or files next to the glTF
+    std::string directory = filename;
+    const size_t slash = directory.find_last_of("/\\");
+    directory = slash == std::string::npos ? std::string() : directory.substr(0, slash + 1);
+
+    std::vector<std::vector<unsigned char>> buffers;
+    if (const JsonValue* bufferList = UJsonFind(gltf, "buffers"))
+    {
+        for (const JsonValue& buffer : bufferList->items)
+        {
+            buffers.emplace_back();
+
+            const JsonValue* uri = UJsonFind(buffer, "uri");
+            bool loaded = false;
+            if (uri == nullptr)
+            {
+                loaded = hasBinaryChunk;
+                buffers.back() = binaryChunk;
+            }
+            else if (uri->string.compare(0, 5, "data:") == 0)
+            {
+                const size_t comma = uri->string.find(',');
+                loaded = comma != std::string::npos && uri->string.rfind(";base64", comma) != std::string::npos
+                    && UDecodeBase64(uri->string.c_str() + comma + 1, uri->string.size() - comma - 1, buffers.back());
+            }
+            else
+            {
+                loaded = UReadFile((directory + uri->string).c_str(), buffers.back());
+            }
+
+            if (!loaded)
+            {
+                cout << "Failed to load a buffer of " << filename << endl;
+                return false;
+            }
+        }
+    }
+
+    // Mesh instances with their world transforms. Without a scene, every mesh is taken once, untransformed.
+    std::vector<std::pair<int, glm::mat4>> instances;
+    const JsonValue* nodes = UJsonFind(gltf, "nodes");
+    const JsonValue* scenes = UJsonFind(gltf, "scenes");
+    const JsonValue* meshes = UJsonFind(gltf, "meshes");
+    if (meshes == nullptr)
+    {
+        cout << "glTF has no meshes: " << filename << endl;
+        return false;
+    }
+
+    if (scenes && nodes && !scenes->items.empty())
+    {
+        int scene = (int)UJsonNumber(UJsonFind(gltf, "scene"), 0.0);
+        if (scene < 0 || scene >= (int)scenes->items.size())
+            scene = 0;
+
+        std::vector<std::pair<int, glm::mat4>> pending;
+        if (const JsonValue* roots = UJsonFind(scenes->items[scene], "nodes"))
+        {
+            for (const JsonValue& root : roots->items)
+                pending.push_back(std::make_pair((int)root.number, glm::mat4(1.0f)));
+        }
+
+        // Each node has at most one parent, so a valid file visits every node at most once
+        size_t nVisited = 0;
+        while (!pending.empty() && nVisited++ < nodes->items.size())
+        {
+            const int nodeIndex = pending.back().first;
+            const glm::mat4 parentWorld = pending.back().second;
+            pending.pop_back();
+
+            if (nodeIndex < 0 || nodeIndex >= (int)nodes->items.size())
+                continue;
+
+            const JsonValue& node = nodes->items[nodeIndex];
+            const glm::mat4 world = parentWorld * UGltfNodeTransform(node);
+
+            if (const JsonValue* mesh = UJsonFind(node, "mesh"))
+                instances.push_back(std::make_pair((int)mesh->number, world));
+
+            if (const JsonValue* children = UJsonFind(node, "children"))
+            {
+                for (const JsonValue& child : children->items)
+                    pending.push_back(std::make_pair((int)child.number, world));
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < meshes->items.size(); ++i)
+            instances.push_back(std::make_pair((int)i, glm::mat4(1.0f)));
+    }
+
+    int nSkipped = 0;
+    for (const std::pair<int, glm::mat4>& instance : instances)
+    {
+        if (instance.first < 0 || instance.first >= (int)meshes->items.size())
+            continue;
+
+        const JsonValue* primitives = UJsonFind(meshes->items[instance.first], "primitives");
+        if (primitives == nullptr)
+            continue;
+
+        const glm::mat4& transform = instance.second;
+        const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+        const bool mirrored = glm::determinant(glm::mat3(transform)) < 0.0f;
+
+        for (const JsonValue& primitive : primitives->items)
+        {
+            // Only triangle lists (mode 4, the default) with float positions
+            const JsonValue* attributes = UJsonFind(primitive, "attributes");
+            GltfAccessor position;
+            if ((int)UJsonNumber(UJsonFind(primitive, "mode"), 4.0) != 4 || attributes == nullptr
+                || !UGetGltfAccessor(gltf, buffers, (int)UJsonNumber(UJsonFind(*attributes, "POSITION"), -1.0), position)
+                || position.componentType != GL_FLOAT || position.components != 3)
+            {
+                ++nSkipped;
+                continue;
+            }
+
+            GltfAccessor normal;
+            const bool hasNormals = UGetGltfAccessor(gltf, buffers, (int)UJsonNumber(UJsonFind(*attributes, "NORMAL"), -1.0), normal)
+                && normal.components == 3 && normal.count == position.count;
+
+            GltfAccessor uv;
+            const bool hasUVs = UGetGltfAccessor(gltf, buffers, (int)UJsonNumber(UJsonFind(*attributes, "TEXCOORD_0"), -1.0), uv)
+                && uv.components == 2 && uv.count == position.count;
+
+            GltfAccessor index;
+            const JsonValue* indexAccessor = UJsonFind(primitive, "indices");
+            if (indexAccessor && (!UGetGltfAccessor(gltf, buffers, (int)indexAccessor->number, index) || index.components != 1
+                || (index.componentType != GL_UNSIGNED_BYTE && index.componentType != GL_UNSIGNED_SHORT && index.componentType != GL_UNSIGNED_INT)))
+            {
+                ++nSkipped;
+                continue;
+            }
+
+            const GLuint base = (GLuint)(vertices.size() / 8);
+            const size_t firstIndex = indices.size();
+
+            const size_t nIndices = indexAccessor ? index.count - index.count % 3 : position.count - position.count % 3;
+            for (size_t i = 0; i < nIndices; ++i)
+            {
+                GLuint vertex = indexAccessor ? UGltfIndex(index, i) : (GLuint)i;
+                if (vertex >= position.count)
+                {
+                    cout << "Invalid index in " << filename << endl;
+                    return false;
+                }
+                indices.push_back(base + vertex);
+            }
+
+            // A mirroring transform flips the winding
+            if (mirrored)
+            {
+                for (size_t i = firstIndex; i < indices.size(); i += 3)
+                    std::swap(indices[i + 1], indices[i + 2]);
+            }
+
+            for (size_t i = 0; i < position.count; ++i)
+            {
+                glm::vec3 v = glm::vec3(transform * glm::vec4(UGltfFloat(position, i, 0), UGltfFloat(position, i, 1), UGltfFloat(position, i, 2), 1.0f));
+
+                glm::vec3 n(0.0f);
+                if (hasNormals)
+                {
+                    n = normalMatrix * glm::vec3(UGltfFloat(normal, i, 0), UGltfFloat(normal, i, 1), UGltfFloat(normal, i, 2));
+                    float length = glm::length(n);
+                    if (length > 0.0f)
+                        n /= length;
+                }
+
+                // glTF texture coordinates start at the top of the image, OpenGL's at the bottom
+                glm::vec2 t(0.0f);
+                if (hasUVs)
+                    t = glm::vec2(UGltfFloat(uv, i, 0), 1.0f - UGltfFloat(uv, i, 1));
+
+                const GLfloat vertex[8] = { v.x, v.y, v.z, n.x, n.y, n.z, t.x, t.y };
+                vertices.insert(vertices.end(), vertex, vertex + 8);
+            }
+
+            // Missing normals: smooth, area-weighted normals over the primitive
+            if (!hasNormals)
+            {
+                for (size_t i = firstIndex; i < indices.size(); i += 3)
+                {
+                    GLfloat* a = &vertices[indices[i] * 8];
+                    GLfloat* b = &vertices[indices[i + 1] * 8];
+                    GLfloat* c = &vertices[indices[i + 2] * 8];
+                    const glm::vec3 faceNormal = glm::cross(glm::make_vec3(b) - glm::make_vec3(a), glm::make_vec3(c) - glm::make_vec3(a));
+
+                    for (GLfloat* corner : { a, b, c })
+                    {
+                        corner[3] += faceNormal.x;
+                        corner[4] += faceNormal.y;
+                        corner[5] += faceNormal.z;
+                    }
+                }
+
+                for (size_t i = base; i < vertices.size() / 8; ++i)
+                {
+                    GLfloat* n = &vertices[i * 8 + 3];
+                    float length = glm::length(glm::make_vec3(n));
+                    const glm::vec3 smooth = length > 0.0f ? glm::make_vec3(n) / length : glm::vec3(0.0f, 1.0f, 0.0f);
+                    n[0] = smooth.x;
+                    n[1] = smooth.y;
+                    n[2] = smooth.z;
+                }
+            }
+        }
+    }
+
+    if (nSkipped > 0)
+        cout << "Skipped " << nSkipped << " unsupported primitives in " << filename << endl;
+
+    return true;
+}
+
+
+// Local transform of a glTF node: its matrix, or translation * rotation * scale
+glm::mat4 UGltfNodeTransform(const JsonValue& node)
+{
+    const JsonValue* matrix = UJsonFind(node, "matrix");
+    if (matrix && matrix->items.size() == 16)
+    {
+        // Column-major, like glm
+        glm::mat4 m;
+        for (int i = 0; i < 16; ++i)
+            m[i / 4][i % 4] = (float)matrix->items[i].number;
+        return m;
+    }
+
+    glm::vec3 translation(0.0f);
+    glm::vec4 rotation(0.0f, 0.0f, 0.0f, 1.0f); // Quaternion x, y, z, w
+    glm::vec3 scale(1.0f);
+
+    const JsonValue* value = UJsonFind(node, "translation");
+    if (value && value->items.size() == 3)
+        translation = glm::vec3(value->items[0].number, value->items[1].number, value->items[2].number);
+
+    value = UJsonFind(node, "rotation");
+    if (value && value->items.size() == 4)
+        rotation = glm::vec4(value->items[0].number, value->items[1].number, value->items[2].number, value->items[3].number);
+
+    value = UJsonFind(node, "scale");
+    if (value && value->items.size() == 3)
+        scale = glm::vec3(value->items[0].number, value->items[1].number, value->items[2].number);
+
+    const float x = rotation.x, y = rotation.y, z = rotation.z, w = rotation.w;
+    glm::mat4 r(1.0f);
+    r[0][0] = 1.0f - 2.0f * (y * y + z * z);
+    r[0][1] = 2.0f * (x * y + z * w);
+    r[0][2] = 2.0f * (x * z - y * w);
+    r[1][0] = 2.0f * (x * y - z * w);
+    r[1][1] = 1.0f - 2.0f * (x * x + z * z);
+    r[1][2] = 2.0f * (y * z + x * w);
+    r[2][0] = 2.0f * (x * z + y * w);
+    r[2][1] = 2.0f * (y * z - x * w);
+    r[2][2] = 1.0f - 2.0f * (x * x + y * y);
+
+    return glm::translate(translation) * r * glm::scale(scale);
+}
+
+
+// Resolves a glTF accessor through its buffer view. Fails for missing or out-of-range data and for sparse or
+// buffer-less accessors, which are not supported.
+bool UGetGltfAccessor(const JsonValue& gltf, const std::vector<std::vector<unsigned char>>& buffers, int index, GltfAccessor& accessor)
+{
+    const JsonValue* accessors = UJsonFind(gltf, "accessors");
+    const JsonValue* views = UJsonFind(gltf, "bufferViews");
+    if (accessors == nullptr || views == nullptr || index < 0 || index >= (int)accessors->items.size())
+        return false;
+
+    const JsonValue& desc = accessors->items[index];
+    const int viewIndex = (int)UJsonNumber(UJsonFind(desc, "bufferView"), -1.0);
+    if (viewIndex < 0 || viewIndex >= (int)views->items.size() || UJsonFind(desc, "sparse"))
+        return false;
+
+    accessor.count = (size_t)UJsonNumber(UJsonFind(desc, "count"), 0.0);
+    accessor.componentType = (GLenum)UJsonNumber(UJsonFind(desc, "componentType"), 0.0);
+    accessor.normalized = UJsonNumber(UJsonFind(desc, "normalized"), 0.0) != 0.0;
+
+    const JsonValue* type = UJsonFind(desc, "type");
+    const std::string typeName = type ? type->string : std::string();
+    accessor.components = typeName == "SCALAR" ? 1 : typeName == "VEC2" ? 2 : typeName == "VEC3" ? 3 : typeName == "VEC4" ? 4 : 0;
+
+    size_t componentSize = 0;
+    switch (accessor.componentType)
+    {
+    case GL_BYTE:
+    case GL_UNSIGNED_BYTE:
+        componentSize = 1;
+        break;
+    case GL_SHORT:
+    case GL_UNSIGNED_SHORT:
+        componentSize = 2;
+        break;
+    case GL_UNSIGNED_INT:
+    case GL_FLOAT:
+        componentSize = 4;
+        break;
+    }
+
+    if (accessor.count == 0 || accessor.components == 0 || componentSize == 0)
+        return false;
+
+    const JsonValue& view = views->items[viewIndex];
+    const int bufferIndex = (int)UJsonNumber(UJsonFind(view, "buffer"), -1.0);
+    if (bufferIndex < 0 || bufferIndex >= (int)buffers.size())
+        return false;
+
+    const std::vector<unsigned char>& buffer = buffers[bufferIndex];
+    const size_t viewOffset = (size_t)UJsonNumber(UJsonFind(view, "byteOffset"), 0.0);
+    const size_t viewLength = (size_t)UJsonNumber(UJsonFind(view, "byteLength"), 0.0);
+    const size_t offset = (size_t)UJsonNumber(UJsonFind(desc, "byteOffset"), 0.0);
+    const size_t elementSize = componentSize * accessor.components;
+
+    accessor.stride = (size_t)UJsonNumber(UJsonFind(view, "byteStride"), 0.0);
+    if (accessor.stride == 0)
+        accessor.stride = elementSize;
+
+    const size_t end = offset + accessor.stride * (accessor.count - 1) + elementSize;
+    if (end > viewLength || viewOffset + viewLength > buffer.size())
+        return false;
+
+    accessor.data = buffer.data() + viewOffset + offset;
+    return true;
+}
+
+
+// Reads one component of an accessor element as a float, applying the normalized integer mapping
+float UGltfFloat(const GltfAccessor& accessor, size_t element, int component)
+{
+    const unsigned char* p = accessor.data + accessor.stride * element;
+
+    switch (accessor.componentType)
+    {
+    case GL_FLOAT:
+    {
+        float value;
+        memcpy(&value, p + sizeof(float) * component, sizeof(value));
+        return value;
+    }
+    case GL_UNSIGNED_BYTE:
+        return accessor.normalized ? p[component] / 255.0f : p[component];
+    case GL_BYTE:
+    {
+        const float value = (signed char)p[component];
+        return accessor.normalized ? std::max(value / 127.0f, -1.0f) : value;
+    }
+    case GL_UNSIGNED_SHORT:
+    {
+        uint16_t value;
+        memcpy(&value, p + sizeof(value) * component, sizeof(value));
+        return accessor.normalized ? value / 65535.0f : value;
+    }
+    case GL_SHORT:
+    {
+        int16_t value;
+        memcpy(&value, p + sizeof(value) * component, sizeof(value));
+        return accessor.normalized ? std::max(value / 32767.0f, -1.0f) : value;
+    }
+    default:
+    {
+        uint32_t value;
+        memcpy(&value, p + sizeof(value) * component, sizeof(value));
+        return (float)value;
+    }
+    }
+}
+
+
+// Reads an index from an unsigned byte, short or int scalar accessor
+GLuint UGltfIndex(const GltfAccessor& accessor, size_t element)
+{
+    const unsigned char* p = accessor.data + accessor.stride * element;
+
+    if (accessor.componentType == GL_UNSIGNED_BYTE)
+        return p[0];
+
+    if (accessor.componentType == GL_UNSIGNED_SHORT)
+    {
+        uint16_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+// Recursive-descent JSON parser. Parses one value starting at p (leading whitespace allowed) and advances p past it.
+bool UParseJson(const char*& p, const char* end, JsonValue& value)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+    if (p >= end)
+        return false;
+
+    value.type = JsonValue::JSON_NULL;
+    value.number = 0.0;
+
+    if (*p == '{' || *p == '[')
+    {
+        const bool object = *p == '{';
+        const char close = object ? '}' : ']';
+        value.type = object ? JsonValue::JSON_OBJECT : JsonValue::JSON_ARRAY;
+
+        for (++p; ; )
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                ++p;
+            if (p < end && *p == close && value.items.empty())
+            {
+                ++p;
+                return true;
+            }
+
+            if (object)
+            {
+                JsonValue key;
+                if (!UParseJson(p, end, key) || key.type != JsonValue::JSON_STRING)
+                    return false;
+
+                while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                    ++p;
+                if (p >= end || *p != ':')
+                    return false;
+                ++p;
+
+                value.keys.push_back(key.string);
+            }
+
+            value.items.emplace_back();
+            if (!UParseJson(p, end, value.items.back()))
+                return false;
+
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+                ++p;
+            if (p >= end)
+                return false;
+
+            if (*p == close)
+            {
+                ++p;
+                return true;
+            }
+            if (*p++ != ',')
+                return false;
+        }
+    }
+
+    if (*p == '"')
+    {
+        value.type = JsonValue::JSON_STRING;
+        for (++p; p < end && *p != '"'; ++p)
+        {
+            if (*p != '\\')
+            {
+                value.string += *p;
+                continue;
+            }
+
+            if (++p >= end)
+                return false;
+
+            switch (*p)
+            {
+            case 'b': value.string += '\b'; break;
+            case 'f': value.string += '\f'; break;
+            case 'n': value.string += '\n'; break;
+            case 'r': value.string += '\r'; break;
+            case 't': value.string += '\t'; break;
+            case 'u':
+            {
+                // Encoded as UTF-8; surrogate pairs are kept as two separate code units
+                if (end - p < 5)
+                    return false;
+                const unsigned long code = strtoul(std::string(p + 1, 4).c_str(), nullptr, 16);
+                p += 4;
+
+                if (code < 0x80)
+                {
+                    value.string += (char)code;
+                }
+                else if (code < 0x800)
+                {
+                    value.string += (char)(0xC0 | (code >> 6));
+                    value.string += (char)(0x80 | (code & 0x3F));
+                }
+                else
+                {
+                    value.string += (char)(0xE0 | (code >> 12));
+                    value.string += (char)(0x80 | ((code >> 6) & 0x3F));
+                    value.string += (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default: value.string += *p; break; // \" \\ \/
+            }
+        }
+
+        if (p >= end)
+            return false;
+        ++p;
+        return true;
+    }
+
+    if (end - p >= 4 && strncmp(p, "true", 4) == 0)
+    {
+        value.type = JsonValue::JSON_BOOL;
+        value.number = 1.0;
+        p += 4;
+        return true;
+    }
+
+    if (end - p >= 5 && strncmp(p, "false", 5) == 0)
+    {
+        value.type = JsonValue::JSON_BOOL;
+        p += 5;
+        return true;
+    }
+
+    if (end - p >= 4 && strncmp(p, "null", 4) == 0)
+    {
+        p += 4;
+        return true;
+    }
+
+    // Numbers are copied out so strtod cannot read past the end of the document
+    char number[64];
+    size_t length = 0;
+    while (p + length < end && length + 1 < sizeof(number) && p[length] != '\0' && strchr("+-0123456789.eE", p[length]))
+    {
+        number[length] = p[length];
+        ++length;
+    }
+    if (length == 0)
+        return false;
+
+    number[length] = '\0';
+    value.type = JsonValue::JSON_NUMBER;
+    value.number = strtod(number, nullptr);
+    p += length;
+    return true;
+}
+
+
+// Member of a JSON object, or nullptr
+const JsonValue* UJsonFind(const JsonValue& object, const char* key)
+{
+    if (object.type != JsonValue::JSON_OBJECT)
+        return nullptr;
+
+    for (size_t i = 0; i < object.keys.size(); ++i)
+    {
+        if (object.keys[i] == key)
+            return &object.items[i];
+    }
+
+    return nullptr;
+}
+
+
+// Numeric (or boolean) value, or the fallback when it is missing or of another type
+double UJsonNumber(const JsonValue* value, double fallback)
+{
+    if (value && (value->type == JsonValue::JSON_NUMBER || value->type == JsonValue::JSON_BOOL))
+        return value->number;
+
+    return fallback;
+}
+
+
+// Decodes standard or URL-safe base64, stopping at the first padding character
+bool UDecodeBase64(const char* text, size_t length, std::vector<unsigned char>& bytes)
+{
+    bytes.clear();
+    bytes.reserve(length / 4 * 3);
+
+    uint32_t bits = 0;
+    int nBits = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        const char c = text[i];
+
+        uint32_t value;
+        if (c >= 'A' && c <= 'Z')
+            value = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            value = c - '0' + 52;
+        else if (c == '+' || c == '-')
+            value = 62;
+        else if (c == '/' || c == '_')
+            value = 63;
+        else if (c == '=')
+            break;
+        else if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+            continue;
+        else
+            return false;
+
+        bits = (bits << 6) | value;
+        nBits += 6;
+        if (nBits >= 8)
+        {
+            nBits -= 8;
+            bytes.push_back((unsigned char)(bits >> nBits));
+        }
+    }
+
+    return true;
+}
+
+
+// Reorders an indexed mesh for the GPU: triangles for vertex cache reuse, then clusters of them for less overdraw,
+// then the vertices in the order they are first fetched. Optionally prints the ACMR (transformed vertices per
+// triangle, FIFO cache model) and ATVR (transformed vertices per referenced vertex) before and after.
+void UOptimizeMesh(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices, const std::string& name, bool report)
+{
+    const GLuint nVertices = (GLuint)(vertices.size() / 8);
+    const float acmrBefore = UAnalyzeVertexCache(indices, nVertices);
+
+    // Vertices no triangle uses are never transformed, so ATVR only counts the referenced ones
+    size_t nReferencedBefore = 0;
+    if (report)
+    {
+        std::vector<unsigned char> referenced(nVertices, 0);
+        for (GLuint index : indices)
+        {
+            nReferencedBefore += referenced[index] == 0;
+            referenced[index] = 1;
+        }
+    }
+
+    UOptimizeVertexCache(indices, nVertices);
+    UOptimizeOverdraw(indices, vertices, OVERDRAW_THRESHOLD);
+    UOptimizeVertexFetch(vertices, indices);
+
+    if (report)
+    {
+        // The fetch pass dropped the unreferenced vertices, so every remaining one counts
+        const GLuint nVerticesAfter = (GLuint)(vertices.size() / 8);
+        const float acmrAfter = UAnalyzeVertexCache(indices, nVerticesAfter);
+        const float nTriangles = (float)(indices.size() / 3);
+
+        char line[160];
+        snprintf(line, sizeof(line), "%s: %zu triangles, ACMR %.3f -> %.3f (ATVR %.3f -> %.3f)", name.c_str(), indices.size() / 3,
+            acmrBefore, acmrAfter, acmrBefore * nTriangles / std::max(nReferencedBefore, (size_t)1),
+            acmrAfter * nTriangles / std::max(nVerticesAfter, 1u));
+        cout << line << endl;
+    }
+}
+
+
+// Appends up to MESH_MAX_LODS - 1 simplified levels to the indices of an optimized mesh, each with about
+// LOD_REDUCTION of the triangles of the previous one. lodIndexCounts receives the index count of every level, the
+// full mesh first. The chain stops early once the error limit keeps a level from getting meaningfully smaller.
+void UGenerateLods(const std::vector<GLfloat>& vertices, std::vector<GLuint>& indices, std::vector<GLuint>& lodIndexCounts, const std::string& name)
+{
+    const GLuint nVertices = (GLuint)(vertices.size() / 8);
+
+    GLMesh bounds;
+    UComputeMeshBounds(bounds, vertices.data(), nVertices);
+    const float maxError = LOD_MAX_ERROR * bounds.boundingSphere.w;
+
+    lodIndexCounts.assign(1, (GLuint)indices.size());
+    std::vector<GLuint> level = indices;
+
+    for (int lod = 1; lod < MESH_MAX_LODS; ++lod)
+    {
+        const size_t previousCount = level.size();
+        USimplifyMesh(level, vertices, (size_t)(previousCount / 3 * LOD_REDUCTION) * 3, maxError);
+        if (level.empty() || level.size() > previousCount * 9 / 10)
+            break;
+
+        UOptimizeVertexCache(level, nVertices);
+        UOptimizeOverdraw(level, vertices, OVERDRAW_THRESHOLD);
+
+        lodIndexCounts.push_back((GLuint)level.size());
+        indices.insert(indices.end(), level.begin(), level.end());
+    }
+
+    cout << name << ": detail levels of";
+    for (GLuint count : lodIndexCounts)
+        cout << " " << count / 3;
+    cout << " triangles" << endl;
+}
+
+
+// Quadric error simplification (Garland-Heckbert) restricted to half-edge collapses: a vertex is merged into a
+// neighbour, so the simplified indices still use the original vertices and their attributes. Each pass scores
+// every collapse, then applies the cheapest ones whose neighbourhoods do not overlap, until the index count reaches
+// targetIndexCount or the RMS distance to the merged planes would exceed maxError.
+// Vertices on attribute seams (several vertices at one position) are locked, so seams never tear.
+void USimplifyMesh(std::vector<GLuint>& indices, const std::vector<GLfloat>& vertices, size_t targetIndexCount, float maxError)
+{
+    const GLuint nVertices = (GLuint)(vertices.size() / 8);
+
+    // Seams: vertices sharing a position with another vertex
+    std::vector<unsigned char> locked(nVertices, 0);
+    std::unordered_map<PackedVertex, GLuint, PackedVertexHash> positions;
+    for (GLuint v = 0; v < nVertices; ++v)
+    {
+        PackedVertex key = {};
+        memcpy(key.data, &vertices[v * 8], sizeof(GLfloat) * 3);
+
+        auto inserted = positions.emplace(key, v);
+        if (!inserted.second)
+        {
+            locked[v] = 1;
+            locked[inserted.first->second] = 1;
+        }
+    }
+
+    // Quadrics: the plane of every triangle weighted by its area, and planes through open border edges,
+    // perpendicular to their triangle, so borders only move along themselves
+    std::vector<Quadric> quadrics(nVertices, Quadric());
+    std::unordered_set<uint64_t> directedEdges;
+    for (size_t i = 0; i < indices.size(); i += 3)
+    {
+        for (int k = 0; k < 3; ++k)
+            directedEdges.insert((uint64_t)indices[i + k] << 32 | indices[i + (k + 1) % 3]);
+    }
+
+    for (size_t i = 0; i < indices.size(); i += 3)
+    {
+        const glm::vec3 p[3] = {
+            glm::make_vec3(&vertices[indices[i] * 8]),
+            glm::make_vec3(&vertices[indices[i + 1] * 8]),
+            glm::make_vec3(&vertices[indices[i + 2] * 8])
+        };
+
+        glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+        const float length = glm::length(normal);
+        if (length == 0.0f)
+            continue;
+        normal /= length;
+
+        for (int k = 0; k < 3; ++k)
+            UAddPlaneQuadric(quadrics[indices[i + k]], normal, -glm::dot(normal, p[0]), length * 0.5f);
+
+        for (int k = 0; k < 3; ++k)
+        {
+            const GLuint a = indices[i + k];
+            const GLuint b = indices[i + (k + 1) % 3];
+            if (directedEdges.count((uint64_t)b << 32 | a))
+                continue;
+
+            const glm::vec3 edge = p[(k + 1) % 3] - p[k];
+            glm::vec3 borderNormal = glm::cross(edge, normal);
+            const float borderLength = glm::length(borderNormal);
+            if (borderLength == 0.0f)
+                continue;
+            borderNormal /= borderLength;
+
+            const float weight = LOD_BORDER_WEIGHT * glm::dot(edge, edge);
+            UAddPlaneQuadric(quadrics[a], borderNormal, -glm::dot(borderNormal, p[k]), weight);
+            UAddPlaneQuadric(quadrics[b], borderNormal, -glm::dot(borderNormal, p[k]), weight);
+        }
+    }
+
+    struct Collapse
+    {
+        double error;
+        GLuint from;
+        GLuint to;
     };
 
-    // Tower Tall Skinny 
-    GLfloat towerTallSkinnyVerts[] = {
-            //Positions          //Normals         //Texture Coords.
-            // ------------------------------------------------------
-            //Back Face          //Negative Z Normal 
-            -0.5f, -6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-            0.5f, -6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-            0.5f,  6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-            0.5f,  6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-            -0.5f,  6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-            -0.5f, -6.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+    std::vector<Collapse> collapses;
+    std::vector<GLuint> adjacencyOffset;
+    std::vector<GLuint> adjacency;
+    std::vector<unsigned char> touched;
+    std::vector<GLuint> remap(nVertices);
+    const double maxErrorSquared = (double)maxError * maxError;
+
+    while (indices.size() > targetIndexCount)
+    {
+        const size_t nTriangles = indices.size() / 3;
+
+        // Triangles around every vertex
+        adjacencyOffset.assign(nVertices + 1, 0);
+        for (GLuint index : indices)
+            ++adjacencyOffset[index + 1];
+        for (GLuint v = 0; v < nVertices; ++v)
+            adjacencyOffset[v + 1] += adjacencyOffset[v];
+
+        adjacency.resize(indices.size());
+        std::vector<GLuint> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+        for (size_t t = 0; t < nTriangles; ++t)
+        {
+            for (int k = 0; k < 3; ++k)
+                adjacency[fill[indices[t * 3 + k]]++] = (GLuint)t;
+        }
+
+        // Both directions of every edge, cheapest first. The error is the merged quadric at the kept vertex,
+        // divided by its weight: a mean squared distance to the merged planes.
+        collapses.clear();
+        for (size_t i = 0; i < indices.size(); ++i)
+        {
+            const GLuint from = indices[i];
+            const GLuint to = indices[i - i % 3 + (i % 3 + 1) % 3];
+            for (int direction = 0; direction < 2; ++direction)
+            {
+                const GLuint u = direction == 0 ? from : to;
+                const GLuint v = direction == 0 ? to : from;
+                if (locked[u])
+                    continue;
+
+                Quadric merged = quadrics[u];
+                for (int j = 0; j < 10; ++j)
+                    merged.a[j] += quadrics[v].a[j];
+                merged.weight += quadrics[v].weight;
+
+                const double error = merged.weight > 0.0 ? UQuadricError(merged, glm::make_vec3(&vertices[v * 8])) / merged.weight : 0.0;
+                if (error <= maxErrorSquared)
+                    collapses.push_back({ error, u, v });
+            }
+        }
+
+        std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+        // Apply collapses whose one-rings were not changed yet this pass, so their flip tests stay valid
+        for (GLuint v = 0; v < nVertices; ++v)
+            remap[v] = v;
+        touched.assign(nVertices, 0);
 
-            //Front Face         //Positive Z Normal
-            -0.5f, -6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-            0.5f, -6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-            0.5f,  6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-            0.5f,  6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-            -0.5f,  6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-            -0.5f, -6.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+        const size_t removable = (indices.size() - targetIndexCount) / 3;
+        size_t nRemoved = 0;
+        size_t nApplied = 0;
+        for (const Collapse& collapse : collapses)
+        {
+            if (nRemoved >= removable)
+                break;
+            if (touched[collapse.from] || touched[collapse.to])
+                continue;
+
+            // Moving the vertex must not flip any triangle that survives the collapse
+            const glm::vec3 target = glm::make_vec3(&vertices[collapse.to * 8]);
+            bool flips = false;
+            size_t nDegenerate = 0;
+            for (GLuint j = adjacencyOffset[collapse.from]; j < adjacencyOffset[collapse.from + 1] && !flips; ++j)
+            {
+                const GLuint* triangle = &indices[adjacency[j] * 3];
+                if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+                {
+                    ++nDegenerate;
+                    continue;
+                }
+
+                glm::vec3 before[3];
+                glm::vec3 after[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    before[k] = glm::make_vec3(&vertices[triangle[k] * 8]);
+                    after[k] = triangle[k] == collapse.from ? target : before[k];
+                }
+
+                const glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+                const glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+                flips = glm::dot(normalBefore, normalAfter) <= 0.0f;
+            }
+
+            if (flips)
+                continue;
+
+            remap[collapse.from] = collapse.to;
+            for (int j = 0; j < 10; ++j)
+                quadrics[collapse.to].a[j] += quadrics[collapse.from].a[j];
+            quadrics[collapse.to].weight += quadrics[collapse.from].weight;
+
+            for (GLuint j = adjacencyOffset[collapse.from]; j < adjacencyOffset[collapse.from + 1]; ++j)
+            {
+                for (int k = 0; k < 3; ++k)
+                    touched[indices[adjacency[j] * 3 + k]] = 1;
+            }
+
+            nRemoved += nDegenerate;
+            ++nApplied;
+        }
 
-            //Left Face           //Negative X Normal
-             -0.5f,  6.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-             -0.5f,  6.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-             -0.5f, -6.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-             -0.5f, -6.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-             -0.5f, -6.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-             -0.5f,  6.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        if (nApplied == 0)
+            break;
 
-             //Right Face         //Positive X Normal
-              0.5f,  6.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-              0.5f,  6.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-              0.5f, -6.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-              0.5f, -6.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-              0.5f, -6.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-              0.5f,  6.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        // Rewrite the indices, dropping the triangles that collapsed
+        size_t nKept = 0;
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            const GLuint a = remap[indices[i]];
+            const GLuint b = remap[indices[i + 1]];
+            const GLuint c = remap[indices[i + 2]];
+            if (a == b || b == c || a == c)
+                continue;
+
+            indices[nKept++] = a;
+            indices[nKept++] = b;
+            indices[nKept++] = c;
+        }
+        indices.resize(nKept);
+    }
+}
 
-              //Bottom Face        //Negative Y Normal
-              -0.5f, -6.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-               0.5f, -6.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-               0.5f, -6.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-               0.5f, -6.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-              -0.5f, -6.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-              -0.5f, -6.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
 
-              //Top Face           //Positive Y Normal
-             -0.5f,  6.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-              0.5f,  6.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-              0.5f,  6.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-              0.5f,  6.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-             -0.5f,  6.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-             -0.5f,  6.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-    };
+// Adds the quadric of the plane normal . p + distance = 0, with the given weight
+void UAddPlaneQuadric(Quadric& quadric, glm::vec3 normal, float distance, float weight)
+{
+    const double x = normal.x, y = normal.y, z = normal.z, w = distance;
+
+    quadric.a[0] += weight * x * x;
+    quadric.a[1] += weight * x * y;
+    quadric.a[2] += weight * x * z;
+    quadric.a[3] += weight * x * w;
+    quadric.a[4] += weight * y * y;
+    quadric.a[5] += weight * y * z;
+    quadric.a[6] += weight * y * w;
+    quadric.a[7] += weight * z * z;
+    quadric.a[8] += weight * z * w;
+    quadric.a[9] += weight * w * w;
+    quadric.weight += weight;
+}
 
-    // Tower with Cap 
-    GLfloat towerCapVerts[] = {
-    //Positions          //Normals         //Texture Coords.
-    // ------------------------------------------------------
-    // Tower Body
-    //Back Face          //Negative Z Normal 
-    -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-    0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-    0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-    0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-    -0.5f,  4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-    -0.5f, -4.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
 
-    //Front Face         //Positive Z Normal
-    -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-    0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-    0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-    0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-    -0.5f,  4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-    -0.5f, -4.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+// Weighted sum of squared distances from a position to the planes of a quadric
+double UQuadricError(const Quadric& quadric, glm::vec3 position)
+{
+    const double x = position.x, y = position.y, z = position.z;
+    const double* a = quadric.a;
 
-    //Left Face           //Negative X Normal
-    -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f,  4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-    -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-    -0.5f, -4.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-    -0.5f, -4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-    -0.5f,  4.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    const double error = a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x
+        + a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y
+        + a[7] * z * z + 2.0 * a[8] * z
+        + a[9];
 
-    //Right Face         //Positive X Normal
-    0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-    0.5f,  4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-    0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-    0.5f, -4.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-    0.5f, -4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-    0.5f,  4.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+    return std::max(error, 0.0);
+}
 
-    //Bottom Face        //Negative Y Normal
-    -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-    0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-    0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-    0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-    -0.5f, -4.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f, -4.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
 
-    //Top Face           //Positive Y Normal
-    -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-    0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-    0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-    0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-    -0.5f,  4.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-    -0.5f,  4.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+// Reorders triangles for the post-transform vertex cache (Forsyth's linear-speed optimization). Triangles are
+// emitted greedily by the summed score of their vertices, which favours vertices still in a modelled LRU cache and
+// vertices with few triangles left, so the mesh is covered in compact local patches.
+void UOptimizeVertexCache(std::vector<GLuint>& indices, GLuint nVertices)
+{
+    const size_t nTriangles = indices.size() / 3;
+
+    // Triangles of every vertex, packed; the ones not yet emitted are kept first
+    std::vector<GLuint> adjacencyOffset(nVertices + 1, 0);
+    for (size_t i = 0; i < nTriangles * 3; ++i)
+        ++adjacencyOffset[indices[i] + 1];
+    for (GLuint v = 0; v < nVertices; ++v)
+        adjacencyOffset[v + 1] += adjacencyOffset[v];
+
+    std::vector<GLuint> adjacency(nTriangles * 3);
+    std::vector<GLuint> remaining(nVertices, 0);
+    for (size_t t = 0; t < nTriangles; ++t)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            const GLuint v = indices[t * 3 + k];
+            adjacency[adjacencyOffset[v] + remaining[v]++] = (GLuint)t;
+        }
+    }
 
-    // Tower Top
-    // Front
-    -0.5f, 4.5f, 0.5f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 5.5f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
-    0.5f, 4.5f, 0.5f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+    std::vector<int> cachePosition(nVertices, -1);
+    std::vector<float> score(nVertices);
+    for (GLuint v = 0; v < nVertices; ++v)
+        score[v] = UVertexCacheScore(-1, remaining[v]);
 
-    // Back
-    -0.5f, 4.5f, -0.5f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-     0.0f, 5.5f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
-    0.5f, 4.5f, -0.5f, 0.0f, 0.0f, -1.0f, 1.0f, 0.0f,
+    std::vector<char> emitted(nTriangles, 0);
+    std::vector<GLuint> cache;
+    std::vector<GLuint> nextCache;
+    std::vector<GLuint> output;
+    output.reserve(nTriangles * 3);
 
-    // Right
-   0.5f, 4.5f, -0.5f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    0.5f, 4.5f, 0.5f, 0.0f, 1.0f, 0.0f, 1.0f, 0.0f,
-     0.0f, 5.5f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
+    size_t best = 0;
+    size_t nextUnemitted = 0; // Fallback when no cached vertex has triangles left: the next one in input order
+    while (output.size() < nTriangles * 3)
+    {
+        emitted[best] = 1;
 
-    // Left
-   -0.5f, 4.5f, 0.5f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -0.5f, 4.5f, -0.5f, -1.0f, 0.0f, 0.0f, 1.0f, 0.0f,
-     0.0f, 5.5f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f
+        // The triangle's vertices move to the front of the cache
+        nextCache.clear();
+        for (int k = 0; k < 3; ++k)
+        {
+            const GLuint v = indices[best * 3 + k];
+            output.push_back(v);
+
+            GLuint* triangles = &adjacency[adjacencyOffset[v]];
+            for (GLuint i = 0; i < remaining[v]; ++i)
+            {
+                if (triangles[i] == best)
+                {
+                    triangles[i] = triangles[--remaining[v]];
+                    break;
+                }
+            }
+
+            if (std::find(nextCache.begin(), nextCache.end(), v) == nextCache.end())
+                nextCache.push_back(v);
+        }
 
-};
+        for (GLuint v : cache)
+        {
+            if (std::find(nextCache.begin(), nextCache.end(), v) == nextCache.end())
+                nextCache.push_back(v);
+        }
 
-    // Small tower
-    GLfloat towerSmallVerts[] = {
-        //Positions          //Normals         //Texture Coords.
-        // ------------------------------------------------------
-        //Back Face          //Negative Z Normal 
-        -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-        0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-        0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-        -0.5f,  2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-        -0.5f, -2.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
+        for (size_t i = VERTEX_CACHE_SIZE; i < nextCache.size(); ++i)
+        {
+            cachePosition[nextCache[i]] = -1;
+            score[nextCache[i]] = UVertexCacheScore(-1, remaining[nextCache[i]]);
+        }
+        if (nextCache.size() > (size_t)VERTEX_CACHE_SIZE)
+            nextCache.resize(VERTEX_CACHE_SIZE);
 
-        //Front Face         //Positive Z Normal
-        -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-        0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-        0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-        0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-        -0.5f,  2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-        -0.5f, -2.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+        cache.swap(nextCache);
+        for (size_t i = 0; i < cache.size(); ++i)
+        {
+            cachePosition[cache[i]] = (int)i;
+            score[cache[i]] = UVertexCacheScore((int)i, remaining[cache[i]]);
+        }
 
-        //Left Face           //Negative X Normal
-         -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-         -0.5f,  2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-         -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-         -0.5f, -2.5f, -0.5f, -1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-         -0.5f, -2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-         -0.5f,  2.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        // The next triangle is the best one touching the cache
+        float bestScore = -1.0f;
+        best = nTriangles;
+        for (GLuint v : cache)
+        {
+            const GLuint* triangles = &adjacency[adjacencyOffset[v]];
+            for (GLuint i = 0; i < remaining[v]; ++i)
+            {
+                const size_t t = triangles[i];
+                const float triangleScore = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+                if (triangleScore > bestScore)
+                {
+                    bestScore = triangleScore;
+                    best = t;
+                }
+            }
+        }
 
-         //Right Face         //Positive X Normal
-          0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-          0.5f,  2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, 0.0f,
-          0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-          0.5f, -2.5f, -0.5f,  1.0f,  0.0f,  0.0f,  -1.0f, -1.0f,
-          0.5f, -2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, -1.0f,
-          0.5f,  2.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+        if (best == nTriangles)
+        {
+            while (nextUnemitted < nTriangles && emitted[nextUnemitted])
+                ++nextUnemitted;
+            best = nextUnemitted;
+        }
+    }
 
-          //Bottom Face        //Negative Y Normal
-          -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-           0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-           0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-           0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-          -0.5f, -2.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-          -0.5f, -2.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+    std::copy(output.begin(), output.end(), indices.begin());
+}
 
-          //Top Face           //Positive Y Normal
-         -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-          0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-          0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-          0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-         -0.5f,  2.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-         -0.5f,  2.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+
+// Orders the triangles of a cache-optimized mesh so surfaces facing away from the mesh center come first; drawn
+// front-to-back from most directions, they hide the rest before it is shaded. The index buffer is cut into
+// clusters, at every cache restart (hard boundaries) and inside those wherever the cluster still reaches
+// threshold * its own ACMR (soft boundaries), so cache reuse is kept; clusters are then sorted by how much they
+// face outwards.
+void UOptimizeOverdraw(std::vector<GLuint>& indices, const std::vector<GLfloat>& vertices, float threshold)
+{
+    const GLuint nVertices = (GLuint)(vertices.size() / 8);
+    const size_t nTriangles = indices.size() / 3;
+    if (nTriangles < 2)
+        return;
+
+    // FIFO cache simulation as in UAnalyzeVertexCache; advancing the clock by the cache size empties the cache
+    std::vector<size_t> insertedAt(nVertices, 0);
+    size_t time = VERTEX_FIFO_SIZE + 1;
+    auto triangleMisses = [&](size_t t)
+    {
+        int nMisses = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            const GLuint v = indices[t * 3 + k];
+            if (time - insertedAt[v] > (size_t)VERTEX_FIFO_SIZE)
+            {
+                insertedAt[v] = time++;
+                ++nMisses;
+            }
+        }
+        return nMisses;
     };
 
-    // Bush
-    GLfloat bushVerts[] = {
-    //Positions          //Normals         //Texture Coords.
-    // ------------------------------------------------------
-    // Base 
-    -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    0.7f, 0.0f, -0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    -0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    // Hard boundaries: triangles whose three vertices all miss the cache
+    std::vector<size_t> hardClusters;
+    for (size_t t = 0; t < nTriangles; ++t)
+    {
+        if (triangleMisses(t) == 3 || t == 0)
+            hardClusters.push_back(t);
+    }
+    hardClusters.push_back(nTriangles);
 
-    // Side #1
-    -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -1.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    -0.7f, 1.0f, -0.7f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -0.7f, 0.0f, -0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    -0.7f, 1.0f, -0.7f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    // Soft boundaries: a new cluster starts as soon as the current one is at least as cache friendly as its hard
+    // cluster. Every cluster is simulated from an empty cache, like its triangles will be after sorting.
+    std::vector<size_t> clusters;
+    for (size_t c = 0; c + 1 < hardClusters.size(); ++c)
+    {
+        const size_t first = hardClusters[c];
+        const size_t last = hardClusters[c + 1];
+
+        time += VERTEX_FIFO_SIZE + 1;
+        size_t hardMisses = 0;
+        for (size_t t = first; t < last; ++t)
+            hardMisses += triangleMisses(t);
+        const float clusterThreshold = (float)hardMisses / (last - first) * threshold;
+
+        clusters.push_back(first);
+        time += VERTEX_FIFO_SIZE + 1;
+        size_t start = first;
+        size_t clusterMisses = 0;
+        for (size_t t = first; t + 1 < last; ++t)
+        {
+            clusterMisses += triangleMisses(t);
+            if ((float)clusterMisses / (t + 1 - start) <= clusterThreshold)
+            {
+                clusters.push_back(t + 1);
+                start = t + 1;
+                clusterMisses = 0;
+                time += VERTEX_FIFO_SIZE + 1;
+            }
+        }
+    }
+    clusters.push_back(nTriangles);
 
-    // Side #2
-    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-    -0.7f, 1.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, -1.0f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
-    -0.7f, 0.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, -1.0f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+    // Area-weighted centroid and normal of every cluster, and of the whole mesh
+    const size_t nClusters = clusters.size() - 1;
+    std::vector<glm::vec3> clusterCentroid(nClusters, glm::vec3(0.0f));
+    std::vector<glm::vec3> clusterNormal(nClusters, glm::vec3(0.0f));
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+
+    for (size_t c = 0; c < nClusters; ++c)
+    {
+        float clusterArea = 0.0f;
+        for (size_t t = clusters[c]; t < clusters[c + 1]; ++t)
+        {
+            const glm::vec3 a = glm::make_vec3(&vertices[indices[t * 3] * 8]);
+            const glm::vec3 b = glm::make_vec3(&vertices[indices[t * 3 + 1] * 8]);
+            const glm::vec3 d = glm::make_vec3(&vertices[indices[t * 3 + 2] * 8]);
+            const glm::vec3 normal = glm::cross(b - a, d - a);
+            const float area = glm::length(normal);
+
+            clusterCentroid[c] += (a + b + d) * (area / 3.0f);
+            clusterNormal[c] += normal;
+            clusterArea += area;
+        }
+
+        meshCentroid += clusterCentroid[c];
+        meshArea += clusterArea;
+        if (clusterArea > 0.0f)
+            clusterCentroid[c] /= clusterArea;
+    }
+
+    if (meshArea > 0.0f)
+        meshCentroid /= meshArea;
+
+    std::vector<float> sortKey(nClusters);
+    std::vector<size_t> order(nClusters);
+    for (size_t c = 0; c < nClusters; ++c)
+    {
+        const float length = glm::length(clusterNormal[c]);
+        sortKey[c] = length > 0.0f ? glm::dot(clusterCentroid[c] - meshCentroid, clusterNormal[c] / length) : 0.0f;
+        order[c] = c;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&sortKey](size_t a, size_t b) { return sortKey[a] > sortKey[b]; });
+
+    std::vector<GLuint> sorted;
+    sorted.reserve(nTriangles * 3);
+    for (size_t c : order)
+        sorted.insert(sorted.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+
+    std::copy(sorted.begin(), sorted.end(), indices.begin());
+}
 
-    // Side #3
-    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-    0.0f, 1.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
-    0.7f, 1.0f, -0.7f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
-    0.0f, 0.0f, -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-    0.7f, 0.0f, -0.7f, 0.0f, 0.0f, -1.0f, 0.0f, 1.0f,
-    0.7f, 1.0f, -0.7f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
 
-    // Side #4
-    0.7f, 0.0f, -0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.7f, 1.0f, -0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    0.7f, 0.0f, -0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+// Renumbers the vertices in the order the index buffer first uses them, so vertex fetch walks memory forwards.
+// Vertices no triangle uses are dropped.
+void UOptimizeVertexFetch(std::vector<GLfloat>& vertices, std::vector<GLuint>& indices)
+{
+    const GLuint unused = ~0u;
+    std::vector<GLuint> remap(vertices.size() / 8, unused);
+    std::vector<GLfloat> reordered;
+    reordered.reserve(vertices.size());
 
-    // Side #5
-    1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.7f, 1.0f, 0.7f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    0.7f, 0.0f, 0.7f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    0.7f, 1.0f, 0.7f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+    for (GLuint& index : indices)
+    {
+        if (remap[index] == unused)
+        {
+            remap[index] = (GLuint)(reordered.size() / 8);
+            reordered.insert(reordered.end(), vertices.begin() + index * 8, vertices.begin() + index * 8 + 8);
+        }
+        index = remap[index];
+    }
 
-    // Side #6
-    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-    0.7f, 1.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
-    0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+    vertices.swap(reordered);
+}
 
-    // Side #7
-    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-    0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
-    -0.7f, 1.0f, 0.7f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
-    0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-    -0.7f, 0.0f, 0.7f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f,
-    -0.7f, 1.0f, 0.7f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
 
-    // Side #8
-    -0.7f, 0.0f, 0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -0.7f, 1.0f, 0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    -1.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
-    -0.7f, 0.0f, 0.7f, -1.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-    -1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-    -1.0f, 1.0f, 0.0f, -1.0f, 0.0f, 0.0f, 1.0f, 1.0f,
+// Simulates a FIFO post-transform cache (VERTEX_FIFO_SIZE entries, empty at the start) and returns the ACMR: cache
+// misses per triangle. 0.5 is the best a regular grid can reach, 3 means no reuse at all.
+float UAnalyzeVertexCache(const std::vector<GLuint>& indices, GLuint nVertices)
+{
+    const size_t nTriangles = indices.size() / 3;
+    if (nTriangles == 0)
+        return 0.0f;
 
-    // Top 
-    -1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    -0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    -0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 1.0f, -1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    0.0f, 1.0f, -1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    0.7f, 1.0f, -0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    -0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-    -0.7f, 1.0f, 0.7f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f,
-    -1.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f,
-    0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f,
-  
-};
-        
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    // A vertex is cached while fewer than VERTEX_FIFO_SIZE misses happened since its own
+    std::vector<size_t> insertedAt(nVertices, 0);
+    size_t time = VERTEX_FIFO_SIZE + 1;
+    size_t nMisses = 0;
 
-    mesh.nVertices[0] = sizeof(groundVerts) / (sizeof(groundVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[1] = sizeof(towerWideVerts) / (sizeof(towerWideVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[2] = sizeof(towerSkinnyVerts) / (sizeof(towerSkinnyVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[3] = sizeof(towerTallSkinnyVerts) / (sizeof(towerTallSkinnyVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[4] = sizeof(towerCapVerts) / (sizeof(towerCapVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[5] = sizeof(towerSmallVerts) / (sizeof(towerSmallVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[6] = sizeof(skyVerts) / (sizeof(skyVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nVertices[7] = sizeof(bushVerts) / (sizeof(bushVerts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    
+    for (size_t i = 0; i < nTriangles * 3; ++i)
+    {
+        if (time - insertedAt[indices[i]] > (size_t)VERTEX_FIFO_SIZE)
+        {
+            insertedAt[indices[i]] = time++;
+            ++nMisses;
+        }
+    }
 
-    ////////// Ground Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[0]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[0]);
-    glGenBuffers(1, &mesh.vbo[0]);
+    return (float)nMisses / nTriangles;
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(groundVerts), groundVerts, GL_STATIC_DRAW); // Sendsvertex or coordinate data to the GPU
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+// Forsyth vertex score: position in the modelled cache plus a boost for vertices with few triangles left
+float UVertexCacheScore(int cachePosition, GLuint remainingTriangles)
+{
+    if (remainingTriangles == 0)
+        return -1.0f;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    float score = 0.0f;
+    if (cachePosition >= 0)
+    {
+        // The last triangle's vertices get a fixed score, so the next triangle does not just reuse the same edge
+        if (cachePosition < 3)
+            score = 0.75f;
+        else
+            score = powf(1.0f - (float)(cachePosition - 3) / (VERTEX_CACHE_SIZE - 3), 1.5f);
+    }
 
-    ////////// Sky Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[6]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[6]);
-    glGenBuffers(1, &mesh.vbo[6]);
+    return score + 2.0f / sqrtf((float)remainingTriangles);
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[6]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(skyVerts), skyVerts, GL_STATIC_DRAW); // Sendsvertex or coordinate data to the GPU
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (char*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-
-    ////////// Tower Wide Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[1]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[1]);
-
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo[1]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[1]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(towerWideVerts), towerWideVerts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
-
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+// Loads a cooked DDS (BC1, BC3 or BC7 with its mip chain) into the job. Rows are stored bottom-up (OpenGL order).
+// Returns false when there is no cache entry, its format cannot be used on this GPU, or it does not match the
+// material array layout (stale entries are re-cooked with --cook).
+bool ULoadCachedTexture(const std::string& path, TextureJob& job, bool s3tcSupported)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
 
-    ////////// Tower Skinny Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[2]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[2]);
+    uint32_t magic = 0;
+    DDSHeader header;
+    file.read((char*)&magic, sizeof(magic));
+    file.read((char*)&header, sizeof(header));
+    if (!file || magic != DDS_MAGIC || header.size != sizeof(DDSHeader))
+        return false;
 
+    if (header.width != MATERIAL_TEXTURE_SIZE || header.height != MATERIAL_TEXTURE_SIZE || header.mipMapCount != MATERIAL_TEXTURE_LEVELS)
+        return false;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo[2]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[2]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(towerSkinnyVerts), towerSkinnyVerts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    uint32_t dxgiFormat = 0;
+    if (header.pixelFormat.fourCC == DDS_FOURCC_DX10)
+    {
+        DDSHeaderDX10 headerDX10;
+        file.read((char*)&headerDX10, sizeof(headerDX10));
+        if (!file)
+            return false;
+        dxgiFormat = headerDX10.dxgiFormat;
+    }
+    else if (header.pixelFormat.fourCC == DDS_FOURCC_DXT1)
+        dxgiFormat = DXGI_FORMAT_BC1_UNORM;
+    else if (header.pixelFormat.fourCC == DDS_FOURCC_DXT5)
+        dxgiFormat = DXGI_FORMAT_BC3_UNORM;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-
-    ////////// Tower Tall Skinny Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[3]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[3]);
-
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo[3]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[3]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(towerTallSkinnyVerts), towerTallSkinnyVerts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
-
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    size_t blockSize;
+    switch (dxgiFormat)
+    {
+    case DXGI_FORMAT_BC1_UNORM:
+        if (!s3tcSupported)
+            return false;
+        job.compressedFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        blockSize = 8;
+        break;
+    case DXGI_FORMAT_BC3_UNORM:
+        if (!s3tcSupported)
+            return false;
+        job.compressedFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        blockSize = 16;
+        break;
+    case DXGI_FORMAT_BC7_UNORM:
+        job.compressedFormat = GL_COMPRESSED_RGBA_BPTC_UNORM; // Core since OpenGL 4.2
+        blockSize = 16;
+        break;
+    default:
+        return false;
+    }
 
+    job.compressedData.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    job.levels.clear();
 
-    ////////// Tower Cap Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[4]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[4]);
+    int width = (int)header.width;
+    int height = (int)header.height;
+    size_t offset = 0;
+    const uint32_t nLevels = header.mipMapCount > 0 ? header.mipMapCount : 1;
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo[4]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[4]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(towerCapVerts), towerCapVerts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    for (uint32_t i = 0; i < nLevels; ++i)
+    {
+        CompressedLevel level;
+        level.offset = offset;
+        level.size = (size_t)((width + 3) / 4) * ((height + 3) / 4) * blockSize;
+        level.width = width;
+        level.height = height;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-
-    ////////// Tower Small Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[5]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[5]);
-
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo[5]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[5]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(towerSmallVerts), towerSmallVerts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
-
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-
-    ////////// Bush Mesh ////////////
-    glGenVertexArrays(1, &mesh.vao[7]); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao[7]);
-
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo[7]);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo[7]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(bushVerts), bushVerts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
-
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-    
-    
+        if (offset + level.size > job.compressedData.size())
+            return false;
+
+        job.levels.push_back(level);
+        offset += level.size;
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+
+    job.width = (int)header.width;
+    job.height = (int)header.height;
+
+    return true;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+// Offline cook: decodes a source image, resamples it to the material layer size, builds its mip chain,
+// compresses every level to BC1 (opaque sources) or BC3 (sources with alpha) and writes it to the texture cache under the hash of the source contents
+bool UCookTexture(const char* filename)
 {
-    glDeleteVertexArrays(1, mesh.vao);
-    glDeleteBuffers(1, mesh.vbo);
+    std::vector<unsigned char> contents;
+    uint64_t hash = UHashFile(filename, contents);
+
+    int width, height, channels;
+    unsigned char* image = contents.empty() ? nullptr :
+        stbi_load_from_memory(contents.data(), (int)contents.size(), &width, &height, &channels, 4);
+    if (!image)
+    {
+        cout << "Failed to load texture " << filename << endl;
+        return false;
+    }
+
+    // Decoding to 4 components expands grey to RGB and keeps the alpha of grey+alpha sources, which need BC3 as well
+    const bool withAlpha = channels == 2 || channels == 4;
+
+    if (width != height)
+        cout << "Texture " << filename << " is " << width << "x" << height << ", stretched to "
+            << MATERIAL_TEXTURE_SIZE << "x" << MATERIAL_TEXTURE_SIZE << endl;
+
+    std::vector<unsigned char> resampled;
+    UResampleImage(image, width, height, 4, MATERIAL_TEXTURE_SIZE, resampled);
+    stbi_image_free(image);
+    width = MATERIAL_TEXTURE_SIZE;
+    height = MATERIAL_TEXTURE_SIZE;
+
+    // Level 0 in OpenGL row order (bottom row first), always RGBA to keep the block encoder simple
+    std::vector<unsigned char> level((size_t)width * height * 4);
+    for (int row = 0; row < height; ++row)
+        memcpy(&level[(size_t)row * width * 4], &resampled[(size_t)(height - 1 - row) * width * 4], (size_t)width * 4);
+
+    std::vector<unsigned char> blocks;
+    uint32_t nLevels = 0;
+    int levelWidth = width;
+    int levelHeight = height;
+
+    for (;;)
+    {
+        // Compress the level 4x4 texels at a time; edge blocks repeat the last row / column
+        for (int by = 0; by < levelHeight; by += 4)
+        {
+            for (int bx = 0; bx < levelWidth; bx += 4)
+            {
+                unsigned char rgba[16 * 4];
+                for (int y = 0; y < 4; ++y)
+                {
+                    for (int x = 0; x < 4; ++x)
+                    {
+                        int sx = std::min(bx + x, levelWidth - 1);
+                        int sy = std::min(by + y, levelHeight - 1);
+                        memcpy(&rgba[(y * 4 + x) * 4], &level[((size_t)sy * levelWidth + sx) * 4], 4);
+                    }
+                }
+
+                unsigned char block[16];
+                UCompressBlockBC(rgba, withAlpha, block);
+                blocks.insert(blocks.end(), block, block + (withAlpha ? 16 : 8));
+            }
+        }
+        ++nLevels;
+
+        if (levelWidth == 1 && levelHeight == 1)
+            break;
+
+        // Next level: 2x2 box filter
+        std::vector<unsigned char> next;
+        UDownsampleImage(level.data(), levelWidth, levelHeight, 4, next);
+
+        level.swap(next);
+        levelWidth = std::max(1, levelWidth / 2);
+        levelHeight = std::max(1, levelHeight / 2);
+    }
+
+    DDSHeader header;
+    memset(&header, 0, sizeof(header));
+    header.size = sizeof(DDSHeader);
+    header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000; // CAPS | HEIGHT | WIDTH | PIXELFORMAT | MIPMAPCOUNT | LINEARSIZE
+    header.height = (uint32_t)height;
+    header.width = (uint32_t)width;
+    header.pitchOrLinearSize = (uint32_t)(((width + 3) / 4) * ((height + 3) / 4) * (withAlpha ? 16 : 8));
+    header.mipMapCount = nLevels;
+    header.pixelFormat.size = sizeof(DDSPixelFormat);
+    header.pixelFormat.flags = 0x4; // FOURCC
+    header.pixelFormat.fourCC = withAlpha ? DDS_FOURCC_DXT5 : DDS_FOURCC_DXT1;
+    header.caps = 0x1000 | 0x8 | 0x400000; // TEXTURE | COMPLEX | MIPMAP
+
+    const std::string path = UTextureCachePath(hash);
+    std::ofstream file;
+    if (UCreateCacheDirectory(TEXTURE_CACHE_DIR))
+        file.open(path, std::ios::binary);
+    file.write((const char*)&DDS_MAGIC, sizeof(DDS_MAGIC));
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)blocks.data(), blocks.size());
+
+    if (!file)
+    {
+        cout << "Failed to write " << path << endl;
+        return false;
+    }
+
+    cout << "Cooked " << filename << " -> " << path << " (" << nLevels << " mip levels)" << endl;
+    return true;
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Encodes one 4x4 RGBA block as BC1 (8 bytes) or BC3 (16 bytes: alpha block then color block).
+// Endpoints come from the color bounding box inset by 1/16 of its range; each texel takes the nearest palette entry.
+void UCompressBlockBC(const unsigned char* rgba, bool withAlpha, unsigned char* out)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    if (withAlpha)
     {
-        flipImageVertically(image, width, height, channels);
+        unsigned char alphaMax = 0, alphaMin = 255;
+        for (int i = 0; i < 16; ++i)
+        {
+            alphaMax = std::max(alphaMax, rgba[i * 4 + 3]);
+            alphaMin = std::min(alphaMin, rgba[i * 4 + 3]);
+        }
+
+        // 8-alpha mode (alpha0 > alpha1): palette is alpha0, alpha1, then six interpolated steps
+        int palette[8] = { alphaMax, alphaMin };
+        for (int i = 1; i < 7; ++i)
+            palette[i + 1] = ((7 - i) * alphaMax + i * alphaMin) / 7;
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        uint64_t indices = 0;
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = 256;
+            for (int p = 0; p < 8 && alphaMax != alphaMin; ++p)
+            {
+                int error = std::abs(palette[p] - rgba[i * 4 + 3]);
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint64_t)best << (3 * i);
+        }
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        out[0] = alphaMax;
+        out[1] = alphaMin;
+        for (int i = 0; i < 6; ++i)
+            out[2 + i] = (unsigned char)(indices >> (8 * i));
+        out += 8;
+    }
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+    int colorMin[3] = { 255, 255, 255 }, colorMax[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            colorMin[c] = std::min(colorMin[c], (int)rgba[i * 4 + c]);
+            colorMax[c] = std::max(colorMax[c], (int)rgba[i * 4 + c]);
         }
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+        int inset = (colorMax[c] - colorMin[c]) / 16;
+        colorMin[c] += inset;
+        colorMax[c] -= inset;
+    }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+    uint16_t color0 = (uint16_t)(((colorMax[0] >> 3) << 11) | ((colorMax[1] >> 2) << 5) | (colorMax[2] >> 3));
+    uint16_t color1 = (uint16_t)(((colorMin[0] >> 3) << 11) | ((colorMin[1] >> 2) << 5) | (colorMin[2] >> 3));
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        // 4-color mode needs color0 > color1
+        if (color0 < color1)
+        {
+            std::swap(color0, color1);
+            std::swap(colorMin, colorMax);
+        }
 
-        return true;
+        // Palette from the quantized endpoints, as the GPU will decode them
+        int palette[4][3];
+        for (int c = 0; c < 3; ++c)
+        {
+            const int bits = c == 1 ? 6 : 5;
+            const int shift = c == 0 ? 11 : (c == 1 ? 5 : 0);
+            const int mask = (1 << bits) - 1;
+            int end0 = ((color0 >> shift) & mask) * 255 / mask;
+            int end1 = ((color1 >> shift) & mask) * 255 / mask;
+
+            palette[0][c] = end0;
+            palette[1][c] = end1;
+            palette[2][c] = (2 * end0 + end1) / 3;
+            palette[3][c] = (end0 + 2 * end1) / 3;
+        }
+
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = 1 << 30;
+            for (int p = 0; p < 4; ++p)
+            {
+                int dr = palette[p][0] - rgba[i * 4 + 0];
+                int dg = palette[p][1] - rgba[i * 4 + 1];
+                int db = palette[p][2] - rgba[i * 4 + 2];
+                int error = dr * dr + dg * dg + db * db;
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
     }
 
-    // Error loading the image
-    return false;
+    out[0] = (unsigned char)(color0 & 0xFF);
+    out[1] = (unsigned char)(color0 >> 8);
+    out[2] = (unsigned char)(color1 & 0xFF);
+    out[3] = (unsigned char)(color1 >> 8);
+    for (int i = 0; i < 4; ++i)
+        out[4 + i] = (unsigned char)(indices >> (8 * i));
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Stops the workers and releases the PBO ring and any unfinished jobs
+void UDestroyTextureLoader(TextureLoader& loader)
 {
-    glGenTextures(1, &textureId);
+    {
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.stopping = true;
+    }
+    loader.wakeWorkers.notify_all();
+
+    for (std::thread& worker : loader.workers)
+        worker.join();
+    loader.workers.clear();
+
+    for (std::deque<TextureJob*>* jobs : { &loader.pending, &loader.decoded, &loader.uploading })
+    {
+        for (TextureJob* job : *jobs)
+            delete job;
+        jobs->clear();
+    }
+
+    for (int i = 0; i < TEXTURE_UPLOAD_SLOTS; ++i)
+    {
+        if (loader.slotFences[i])
+            glDeleteSync(loader.slotFences[i]);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, loader.pbo);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &loader.pbo);
 }
 
 
 // Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLProgram& program)
 {
     // Compilation and linkage error reporting
     int success = 0;
     char infoLog[512];
+    GLuint& programId = program.id;
 
     // Create a Shader program object.
     programId = glCreateProgram();
@@ -1486,11 +7989,198 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
 
     glUseProgram(programId);    // Uses the shader program
 
+    // Resolve the uniform table once so the render loop never looks uniforms up by name
+    program.model = glGetUniformLocation(programId, "model");
+    program.normalMatrix = glGetUniformLocation(programId, "normalMatrix");
+    program.view = glGetUniformLocation(programId, "view");
+    program.projection = glGetUniformLocation(programId, "projection");
+    program.objectColor = glGetUniformLocation(programId, "objectColor");
+    program.lightColor = glGetUniformLocation(programId, "lightColor");
+    program.lightPos = glGetUniformLocation(programId, "lightPos");
+    program.viewPosition = glGetUniformLocation(programId, "viewPosition");
+    program.uvScale = glGetUniformLocation(programId, "uvScale");
+    program.textureLayer = glGetUniformLocation(programId, "textureLayer");
+    program.uTexture = glGetUniformLocation(programId, "uTexture");
+    program.clusterScale = glGetUniformLocation(programId, "clusterScale");
+    program.clusterCount = glGetUniformLocation(programId, "clusterCount");
+    program.ambientStrength = glGetUniformLocation(programId, "ambientStrength");
+    program.specularIntensity = glGetUniformLocation(programId, "specularIntensity");
+    program.highlightSize = glGetUniformLocation(programId, "highlightSize");
+    program.inverseViewProjection = glGetUniformLocation(programId, "inverseViewProjection");
+
+    return true;
+}
+
+
+// Compiles and links a program made of a single compute shader
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId)
+{
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+
+    programId = glCreateProgram();
+
+    GLuint computeShaderId = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShaderId, 1, &computeShaderSource, NULL);
+
+    glCompileShader(computeShaderId);
+    glGetShaderiv(computeShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(computeShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
+    glAttachShader(programId, computeShaderId);
+
+    glLinkProgram(programId);
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+
+        return false;
+    }
+
     return true;
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+void UDestroyShaderProgram(GLProgram& program)
+{
+    glDeleteProgram(program.id);
+}
+
+
+// Returns the program of a shader variant, compiling it on first use, or nullptr when it does not build.
+// Features the variant's output does not use are cleared first, so for instance all depth-only variants of an
+// input share one program.
+const GLProgram* UGetShaderVariant(ShaderVariantCache& cache, ShaderVariant variant)
+{
+    if (variant.output == SHADER_OUTPUT_GBUFFER || variant.output == SHADER_OUTPUT_DEPTH)
+    {
+        variant.lighting = LIGHTING_PHONG;
+        variant.pointLights = false;
+    }
+    if (variant.output == SHADER_OUTPUT_DEPTH)
+        variant.textured = false;
+    if (variant.output == SHADER_OUTPUT_DEFERRED_LIGHTING)
+    {
+        variant.input = SHADER_INPUT_NODE;
+        variant.textured = false;
+    }
+
+    const uint32_t key = UShaderVariantKey(variant);
+    auto found = cache.programs.find(key);
+    if (found == cache.programs.end())
+    {
+        std::string vertexSource;
+        std::string fragmentSource;
+        UBuildShaderVariantSources(variant, vertexSource, fragmentSource);
+
+        GLProgram program;
+        if (UCreateShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), program))
+        {
+            // Samplers keep their texture units for the life of the program, which UCreateShaderProgram left in use
+            glUniform1i(program.uTexture, 0);
+            glUniform1i(glGetUniformLocation(program.id, "gAlbedo"), 0);
+            glUniform1i(glGetUniformLocation(program.id, "gNormal"), 1);
+            glUniform1i(glGetUniformLocation(program.id, "gDepth"), 2);
+        }
+        else
+        {
+            cout << "Shader variant " << key << " failed to build" << endl;
+            glDeleteProgram(program.id);
+            program.id = 0;
+        }
+
+        found = cache.programs.emplace(key, program).first;
+    }
+
+    return found->second.id != 0 ? &found->second : nullptr;
+}
+
+
+// Variant drawing the scene with the current lighting model, texturing and point lights
+const GLProgram* UGetSceneProgram(ShaderInput input, ShaderOutput output)
+{
+    ShaderVariant variant;
+    variant.input = input;
+    variant.output = output;
+    variant.lighting = gLightingModel;
+    variant.textured = gTextured;
+    variant.pointLights = gLightCount > 0;
+
+    return UGetShaderVariant(gShaderVariants, variant);
+}
+
+
+// Variant of the opaque pass for the current shading mode, or of its depth pre-pass
+const GLProgram* UGetOpaqueProgram(ShaderInput input, bool depthOnly)
+{
+    if (depthOnly)
+        return UGetSceneProgram(input, SHADER_OUTPUT_DEPTH);
+
+    return UGetSceneProgram(input, gShadingMode == SHADING_DEFERRED ? SHADER_OUTPUT_GBUFFER : SHADER_OUTPUT_FORWARD);
+}
+
+
+// Packs the features of a variant into its cache key
+uint32_t UShaderVariantKey(const ShaderVariant& variant)
+{
+    return (uint32_t)variant.input
+        | ((uint32_t)variant.output << 4)
+        | ((uint32_t)variant.lighting << 8)
+        | ((uint32_t)variant.textured << 12)
+        | ((uint32_t)variant.pointLights << 13);
+}
+
+
+// Assembles the sources of a variant: the version line, the feature defines, then the snippets its input and output
+// are made of. The snippets test the defines in constant expressions, which the GLSL compiler folds away.
+void UBuildShaderVariantSources(const ShaderVariant& variant, std::string& vertexSource, std::string& fragmentSource)
+{
+    const std::string version = "#version 440 core\n";
+    const std::string defines =
+        "#define LIGHTING_PHONG " + std::to_string(LIGHTING_PHONG) + "\n"
+        "#define LIGHTING_BLINN_PHONG " + std::to_string(LIGHTING_BLINN_PHONG) + "\n"
+        "#define LIGHTING_UNLIT " + std::to_string(LIGHTING_UNLIT) + "\n"
+        "#define LIGHTING_MODEL " + std::to_string(variant.lighting) + "\n"
+        "#define TEXTURED " + std::to_string((int)variant.textured) + "\n"
+        "#define POINT_LIGHTS " + std::to_string((int)variant.pointLights) + "\n";
+
+    if (variant.output == SHADER_OUTPUT_DEFERRED_LIGHTING)
+    {
+        vertexSource = version + defines + deferredLightingVertexShaderSource;
+        fragmentSource = version + defines + lightingShaderSource + "\n" + deferredLightingFragmentShaderSource;
+        return;
+    }
+
+    // The buffer-fed inputs index their objects with gl_BaseInstanceARB
+    const bool drawParameters = variant.input == SHADER_INPUT_INDIRECT || variant.input == SHADER_INPUT_GPU_CULLED;
+    vertexSource = version + (drawParameters ? "#extension GL_ARB_shader_draw_parameters : require\n" : "") + defines
+        + SHADER_INPUT_SOURCES[variant.input] + "\n" + towerVertexShaderSource;
+
+    fragmentSource = version + defines;
+    if (variant.output == SHADER_OUTPUT_FORWARD)
+        fragmentSource = fragmentSource + surfaceShaderSource + "\n" + lightingShaderSource + "\n" + towerFragmentShaderSource;
+    else if (variant.output == SHADER_OUTPUT_GBUFFER)
+        fragmentSource = fragmentSource + surfaceShaderSource + "\n" + geometryFragmentShaderSource;
+    else
+        fragmentSource += depthFragmentShaderSource;
+}
+
+
+void UDestroyShaderVariants(ShaderVariantCache& cache)
 {
-    glDeleteProgram(programId);
+    for (auto& entry : cache.programs)
+    {
+        if (entry.second.id != 0)
+            UDestroyShaderProgram(entry.second);
+    }
+    cache.programs.clear();
 }